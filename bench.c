@@ -0,0 +1,1094 @@
+/*
+ * opm - Open Password Manager.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Alexander Miroch
+ *    Email: <alexander.miroch@gmail.com>
+ */
+
+/*
+ * Microbenchmarks over synthetic vaults.
+ *
+ *	opm_bench search [entries...]
+ *
+ * compares the substring search kernels with strcasestr over the name
+ * and login of every entry, the way an unindexed query does.
+ *
+ *	opm_bench scan [entries...]
+ *
+ * runs a few queries over whole encoded records, decoding each one like
+ * pt_get_entry used to, and over a hot name/login store like the one the
+ * daemon keeps now. Then it writes the vault into a database in $TMPDIR
+ * with the daemon's own code, loads it and times pt_get_entry for the
+ * same queries, the trigram index and the unindexed scan alike.
+ *
+ *	opm_bench crypt [entries...]
+ *
+ * seals and opens a vault's worth of data: AES-256-GCM and
+ * ChaCha20-Poly1305 in segments of several sizes, each with its own nonce
+ * and tag, and the AES-256-CBC file format of 0x101 databases.
+ *
+ *	opm_bench commit [entries...]
+ *
+ * times loading such a database through load_database and adding an
+ * entry followed by sync_db until the writer has it on disk, fdatasync
+ * included.
+ *
+ *	opm_bench scale [entries...]
+ *
+ * the same up to a million entries, after reading every entry back from
+ * the file and comparing it, and the secrets of every BENCH_CHECK_STEP-th,
+ * with the generated one.
+ *
+ *	opm_bench ipc [entries]
+ *
+ * times requests through handle_client over a socketpair: one entry by
+ * id, a query and the whole vault.
+ *
+ * The new benchmarks print min, median, mean, deviation and 95th
+ * percentile. -o saves the medians, -b compares them with saved ones and
+ * makes the exit status 2 if one got more than BENCH_TOLERANCE percent
+ * worse.
+ */
+
+#include "opm.h"
+#include <math.h>
+
+#define BENCH_RUNS	5
+#define BENCH_SAMPLES	50	/* for latencies */
+#define BENCH_TOLERANCE	10
+#define BENCH_RECORD	256	/* bytes per entry for crypt */
+
+static char *words[] = {
+	"mail", "bank", "shop", "cloud", "Git", "Hub", "work", "home", "VPN", "forum",
+	"admin", "dev", "Stage", "prod", "router", "wiki", "chat", "Pay", "news", "game"
+};
+
+#define NUM_WORDS	(sizeof(words) / sizeof(words[0]))
+
+struct bench_vault {
+	unsigned int count;
+	char **name, **login;
+	size_t *name_len, *login_len;
+};
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *make_string(char *sep, int parts, unsigned int n) {
+	char buf[256];
+	int i;
+
+	buf[0] = '\0';
+	for (i = 0; i < parts; i++) {
+		if (i)
+			strcat(buf, sep);
+		strcat(buf, words[rand() % NUM_WORDS]);
+	}
+
+	sprintf(buf + strlen(buf), "%u", n);
+
+	return strdup(buf);
+}
+
+static int make_vault(struct bench_vault *v, unsigned int count) {
+	unsigned int i;
+
+	v->count = count;
+	v->name = malloc(count * sizeof(char *));
+	v->login = malloc(count * sizeof(char *));
+	v->name_len = malloc(count * sizeof(size_t));
+	v->login_len = malloc(count * sizeof(size_t));
+	if (!v->name || !v->login || !v->name_len || !v->login_len)
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		v->name[i] = make_string(" ", 2 + rand() % 3, i);
+		v->login[i] = make_string(".", 1 + rand() % 2, i);
+		if (!v->name[i] || !v->login[i])
+			return 0;
+
+		v->name_len[i] = strlen(v->name[i]);
+		v->login_len[i] = strlen(v->login[i]);
+	}
+
+	return 1;
+}
+
+static void free_vault(struct bench_vault *v) {
+	unsigned int i;
+
+	for (i = 0; i < v->count; i++) {
+		free(v->name[i]);
+		free(v->login[i]);
+	}
+
+	free(v->name);
+	free(v->login);
+	free(v->name_len);
+	free(v->login_len);
+}
+
+/* The entries of a bench_vault encoded the way clients send them */
+struct bench_records {
+	unsigned char *buf;
+	unsigned int *off, *len;
+};
+
+static void random_string(char *buf, unsigned int len) {
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = 'a' + rand() % 26;
+	buf[len] = '\0';
+}
+
+static int make_records(struct bench_records *br, struct bench_vault *v) {
+	char url[64], pass[32], notes[MAX_NOTES_LEN + 1];
+	unsigned char rec[MAX_RECORD_LEN];
+	unsigned int i, len, size = 0, used = 0;
+	struct db_entry de;
+
+	for (i = 0; i < v->count; i++)
+		size += v->name_len[i] + v->login_len[i] + MAX_RECORD_LEN / 4;
+
+	br->buf = malloc(size);
+	br->off = malloc(v->count * sizeof(unsigned int));
+	br->len = malloc(v->count * sizeof(unsigned int));
+	if (!br->buf || !br->off || !br->len)
+		return 0;
+
+	for (i = 0; i < v->count; i++) {
+		random_string(url, 20 + rand() % 40);
+		random_string(pass, 8 + rand() % 20);
+		random_string(notes, rand() % MAX_NOTES_LEN);
+
+		de.name = v->name[i];
+		de.login = v->login[i];
+		de.url = url;
+		de.password = pass;
+		de.notes = notes;
+
+		len = record_encode(&de, rec, sizeof(rec));
+		if (!len || used + len > size)
+			return 0;
+
+		memcpy(br->buf + used, rec, len);
+		br->off[i] = used;
+		br->len[i] = len;
+		used += len;
+	}
+
+	return 1;
+}
+
+static void free_records(struct bench_records *br) {
+	free(br->buf);
+	free(br->off);
+	free(br->len);
+}
+
+/* The hot store of the daemon: name and login of each entry back to back */
+struct bench_hot {
+	unsigned char *buf;
+	struct {
+		unsigned int off;
+		unsigned short name_len, login_len;
+	} *fields;
+};
+
+static int make_hot(struct bench_hot *h, struct bench_vault *v) {
+	unsigned int i, size = 0, used = 0;
+
+	for (i = 0; i < v->count; i++)
+		size += v->name_len[i] + v->login_len[i] + 2;
+
+	h->buf = malloc(size);
+	h->fields = malloc(v->count * sizeof(*h->fields));
+	if (!h->buf || !h->fields)
+		return 0;
+
+	for (i = 0; i < v->count; i++) {
+		h->fields[i].off = used;
+		h->fields[i].name_len = v->name_len[i];
+		h->fields[i].login_len = v->login_len[i];
+		memcpy(h->buf + used, v->name[i], v->name_len[i] + 1);
+		used += v->name_len[i] + 1;
+		memcpy(h->buf + used, v->login[i], v->login_len[i] + 1);
+		used += v->login_len[i] + 1;
+	}
+
+	return 1;
+}
+
+static void free_hot(struct bench_hot *h) {
+	free(h->buf);
+	free(h->fields);
+}
+
+static int dcmp(const void *a, const void *b) {
+	double x = *(double *) a, y = *(double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+struct bench_stats {
+	double min, median, mean, sd, p95;
+};
+
+static void summarize(double *t, unsigned int n, struct bench_stats *st) {
+	unsigned int i;
+	double sum = 0, sq = 0;
+
+	qsort(t, n, sizeof(double), dcmp);
+
+	for (i = 0; i < n; i++)
+		sum += t[i];
+	st->mean = sum / n;
+
+	for (i = 0; i < n; i++)
+		sq += (t[i] - st->mean) * (t[i] - st->mean);
+	st->sd = n > 1 ? sqrt(sq / (n - 1)) : 0;
+
+	st->min = t[0];
+	st->median = t[n / 2];
+	st->p95 = t[(n * 95 + 99) / 100 - 1];
+}
+
+static FILE *save_file;
+static struct {
+	char key[64];
+	double value;
+} *baseline;
+static unsigned int num_baseline;
+static int regressions;
+
+static int load_baseline(char *path) {
+	FILE *f;
+	char key[64];
+	double value;
+	void *tmp;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Can not open %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	while (fscanf(f, "%63s %lf", key, &value) == 2) {
+		tmp = realloc(baseline, (num_baseline + 1) * sizeof(*baseline));
+		if (!tmp) {
+			fclose(f);
+			return 0;
+		}
+		baseline = tmp;
+		strcpy(baseline[num_baseline].key, key);
+		baseline[num_baseline++].value = value;
+	}
+
+	fclose(f);
+
+	return 1;
+}
+
+/* Finish a result line: save it and compare it with the baseline */
+static void result(char *key, double value, int lower_better) {
+	double change, worse;
+	unsigned int i;
+
+	if (save_file)
+		fprintf(save_file, "%s %g\n", key, value);
+
+	for (i = 0; i < num_baseline; i++) {
+		if (strcmp(baseline[i].key, key) || !baseline[i].value)
+			continue;
+
+		change = (value - baseline[i].value) * 100 / baseline[i].value;
+		worse = lower_better ? change : -change;
+		printf(" %+7.1f%%", change);
+		if (worse > BENCH_TOLERANCE) {
+			printf(" REGRESSION");
+			regressions++;
+		}
+		break;
+	}
+
+	putchar('\n');
+}
+
+static void report(char *key, double *t, unsigned int n, char *unit, int lower_better) {
+	struct bench_stats st;
+
+	summarize(t, n, &st);
+	printf("%-40s %10.2f %-5s (min %.2f, mean %.2f, sd %.2f, p95 %.2f)",
+		key, st.median, unit, st.min, st.mean, st.sd, st.p95);
+	result(key, st.median, lower_better);
+}
+
+static unsigned int scan_strcasestr(struct bench_vault *v, char *needle, size_t nlen) {
+	unsigned int i, hits = 0;
+
+	for (i = 0; i < v->count; i++) {
+		if (strcasestr(v->name[i], needle) || strcasestr(v->login[i], needle))
+			hits++;
+	}
+
+	return hits;
+}
+
+static int (*scan_kernel)(const char *, size_t, const char *, size_t);
+
+static unsigned int scan_ci(struct bench_vault *v, char *needle, size_t nlen) {
+	unsigned int i, hits = 0;
+
+	for (i = 0; i < v->count; i++) {
+		if (scan_kernel(v->name[i], strlen(v->name[i]), needle, nlen) ||
+				scan_kernel(v->login[i], strlen(v->login[i]), needle, nlen))
+			hits++;
+	}
+
+	return hits;
+}
+
+static struct bench_records *scan_records_of;
+static struct bench_hot *scan_hot_of;
+
+/* Decode every whole record like pt_get_entry did before the hot store */
+static unsigned int scan_records(struct bench_vault *v, char *needle, size_t nlen) {
+	struct bench_records *br = scan_records_of;
+	struct db_entry de;
+	unsigned int i, hits = 0;
+
+	for (i = 0; i < v->count; i++) {
+		if (!record_decode(br->buf + br->off[i], br->len[i], &de))
+			continue;
+
+		if (ci_search(de.name, strlen(de.name), needle, nlen) ||
+				ci_search(de.login, strlen(de.login), needle, nlen))
+			hits++;
+	}
+
+	return hits;
+}
+
+static unsigned int scan_hot(struct bench_vault *v, char *needle, size_t nlen) {
+	struct bench_hot *h = scan_hot_of;
+	unsigned int i, hits = 0;
+	char *name;
+
+	for (i = 0; i < v->count; i++) {
+		name = (char *) h->buf + h->fields[i].off;
+		if (ci_search(name, h->fields[i].name_len, needle, nlen) ||
+				ci_search(name + h->fields[i].name_len + 1, h->fields[i].login_len, needle, nlen))
+			hits++;
+	}
+
+	return hits;
+}
+
+/* Median time per entry over all needles, in nanoseconds */
+static double run_scan(struct bench_vault *v, char **needles,
+		unsigned int (*scan)(struct bench_vault *, char *, size_t), unsigned int *hits) {
+	double t[BENCH_RUNS], start;
+	int r, q;
+
+	for (r = 0; r < BENCH_RUNS; r++) {
+		*hits = 0;
+		start = now();
+		for (q = 0; needles[q]; q++)
+			*hits += scan(v, needles[q], strlen(needles[q]));
+		t[r] = now() - start;
+	}
+
+	qsort(t, BENCH_RUNS, sizeof(double), dcmp);
+
+	return t[BENCH_RUNS / 2] * 1e9 / ((double) v->count * q);
+}
+
+static int bench_search(int argc, char **argv) {
+	static unsigned int defsizes[] = { 10000, 100000, 1000000 };
+	static char *needles[] = { "hub", "STAGE", "ter.", "bank mail", "nomatch", "x9", NULL };
+	struct {
+		char *name;
+		int (*fn)(const char *, size_t, const char *, size_t);
+	} kernels[] = {
+		{ "scalar", ci_search_scalar },
+#if defined(__x86_64__) || defined(__i386__)
+		{ "sse2", ci_search_sse2 },
+		{ "avx2", ci_search_avx2 },
+#endif
+	};
+	struct bench_vault v;
+	unsigned int i, k, nsizes, size, hits, ref;
+	double base, t;
+	char key[64];
+
+	search_init();
+	printf("selected kernel: %s\n", ci_search_impl);
+	printf("%10s %-12s %10s %8s\n", "entries", "kernel", "ns/entry", "speedup");
+
+	nsizes = argc ? argc : sizeof(defsizes) / sizeof(defsizes[0]);
+	for (i = 0; i < nsizes; i++) {
+		size = argc ? strtoul(argv[i], NULL, 10) : defsizes[i];
+		srand(1);
+		if (!size || !make_vault(&v, size)) {
+			fprintf(stderr, "Can not build a vault of %u entries\n", size);
+			return 1;
+		}
+
+		base = run_scan(&v, needles, scan_strcasestr, &ref);
+		printf("%10u %-12s %10.1f %8s", size, "strcasestr", base, "1.00x");
+		sprintf(key, "search/%u/strcasestr", size);
+		result(key, base, 1);
+
+		for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+			if (!strcmp(kernels[k].name, "avx2") && strcmp(ci_search_impl, "avx2"))
+				continue;
+
+			scan_kernel = kernels[k].fn;
+			t = run_scan(&v, needles, scan_ci, &hits);
+			if (hits != ref) {
+				fprintf(stderr, "%s found %u entries, strcasestr %u\n", kernels[k].name, hits, ref);
+				return 1;
+			}
+			printf("%10u %-12s %10.1f %7.2fx", size, kernels[k].name, t, base / t);
+			sprintf(key, "search/%u/%s", size, kernels[k].name);
+			result(key, t, 1);
+		}
+
+		free_vault(&v);
+	}
+
+	return 0;
+}
+
+/* daemon.c takes it from main.c */
+void emsg(const char *format, ...) {
+	va_list args;
+
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+
+	exit(255);
+}
+
+static char bench_path[PATH_MAX];
+
+static void drop_database(void) {
+	char *p;
+
+	db_close();
+
+	p = journal_path();
+	if (p) {
+		unlink(p);
+		free(p);
+	}
+	unlink(bench_path);
+}
+
+/*
+ * Write the vault into a new database the way the daemon does, one
+ * PT_ADD_ENTRY at a time with a checkpoint every BT_BULK_BATCH entries,
+ * and load it back. The key slot gets the lowest scrypt costs, the
+ * unlock is still part of every load.
+ */
+static int make_database(struct bench_vault *v, struct bench_records *br) {
+	static int started = 0;
+	unsigned int i;
+	char *dir;
+	int fd;
+
+	if (!started) {
+		strcpy((char *) password, "opm_bench");
+		kdf_calibrated = 1;
+		memset(&kdf_tuned, 0, sizeof(kdf_tuned));
+		kdf_tuned.alg = KDF_SCRYPT;
+		kdf_tuned.cost = KDF_SCRYPT_MIN_COST;
+		kdf_tuned.r = kdf_tuned.p = 1;
+
+		search_init();
+		db_init();
+		init_handlers();
+		bt_crypt_start();
+		if (!writer_start())
+			return 0;
+		started = 1;
+	}
+
+	dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	snprintf(bench_path, sizeof(bench_path), "%s/opm_bench.XXXXXX", dir);
+	fd = mkstemp(bench_path);
+	if (fd < 0) {
+		fprintf(stderr, "Can not create %s: %s\n", bench_path, strerror(errno));
+		return 0;
+	}
+	close(fd);
+
+	database_file = bench_path;
+	if (!load_database(1))
+		goto fail;
+
+	for (i = 0; i < v->count; i++) {
+		if (!pt_add_entry(br->buf + br->off[i], br->len[i], -1))
+			goto fail;
+		if ((i + 1) % BT_BULK_BATCH == 0 && !sync_db())
+			goto fail;
+	}
+
+	if (!sync_db())
+		goto fail;
+	writer_wait_idle();
+
+	db_close();
+	if (!load_database(0) || num_records != v->count)
+		goto fail;
+	writer_covered(journal_seq);
+
+	return 1;
+fail:
+	fprintf(stderr, "Database operation failed, see syslog\n");
+	drop_database();
+	return 0;
+}
+
+/* Reads whatever the handlers send, so they never block */
+static void *drain(void *arg) {
+	char buf[65536];
+	int fd = *(int *) arg;
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+
+	return NULL;
+}
+
+static int bench_scan(int argc, char **argv) {
+	static unsigned int defsizes[] = { 10000, 100000 };
+	static char *needles[] = { "hub", "STAGE", "ter.", "nomatch", "x9", NULL };
+	double lat[BENCH_SAMPLES], start, base, t;
+	struct bench_vault v;
+	struct bench_records br;
+	struct bench_hot h;
+	unsigned int i, q, r, nsizes, size, hits, ref;
+	pthread_t reader;
+	char key[64];
+	int sk[2];
+
+	search_init();
+	printf("kernel: %s\n", ci_search_impl);
+	printf("database files in %s\n", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+
+	nsizes = argc ? argc : sizeof(defsizes) / sizeof(defsizes[0]);
+	for (i = 0; i < nsizes; i++) {
+		size = argc ? strtoul(argv[i], NULL, 10) : defsizes[i];
+		srand(1);
+		if (!size || !make_vault(&v, size) || !make_records(&br, &v) || !make_hot(&h, &v)) {
+			fprintf(stderr, "Can not build a vault of %u entries\n", size);
+			return 1;
+		}
+
+		/* the layouts alone, without the index and the replies */
+		scan_records_of = &br;
+		scan_hot_of = &h;
+		base = run_scan(&v, needles, scan_records, &ref);
+		sprintf(key, "scan/%u/records", size);
+		printf("%-40s %10.1f ns/entry", key, base);
+		result(key, base, 1);
+
+		t = run_scan(&v, needles, scan_hot, &hits);
+		if (hits != ref) {
+			fprintf(stderr, "hot store found %u entries, records %u\n", hits, ref);
+			return 1;
+		}
+		sprintf(key, "scan/%u/hot", size);
+		printf("%-40s %10.1f ns/entry %.2fx", key, t, base / t);
+		result(key, t, 1);
+		free_hot(&h);
+
+		if (!make_database(&v, &br))
+			return 1;
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sk) < 0 ||
+				pthread_create(&reader, NULL, drain, &sk[1])) {
+			fprintf(stderr, "Can not start the reader: %s\n", strerror(errno));
+			return 1;
+		}
+
+		for (q = 0; needles[q]; q++) {
+			for (r = 0; r < BENCH_SAMPLES; r++) {
+				start = now();
+				if (!pt_get_entry(needles[q], strlen(needles[q]) + 1, sk[0])) {
+					fprintf(stderr, "Query failed, see syslog\n");
+					return 1;
+				}
+				lat[r] = (now() - start) * 1e6;
+			}
+
+			sprintf(key, "scan/%u/%s", size, needles[q]);
+			report(key, lat, BENCH_SAMPLES, "us", 1);
+		}
+
+		shutdown(sk[0], SHUT_WR);
+		pthread_join(reader, NULL);
+		close(sk[0]);
+		close(sk[1]);
+
+		drop_database();
+		free_records(&br);
+		free_vault(&v);
+	}
+
+	return 0;
+}
+
+
+static unsigned char bench_key[DB_KEY_LEN];
+
+typedef int (*aead_fn)(unsigned char *, unsigned char *, unsigned int, unsigned char *, unsigned int, char *);
+
+/* Same layout as seal_data(): nonce | ciphertext | tag */
+static int chacha_seal(unsigned char *out, unsigned char *in, unsigned int len,
+		unsigned char *aad, unsigned int aad_len, char *key) {
+	EVP_CIPHER_CTX *ctx;
+	int out_len, rv = 0;
+
+	if (RAND_bytes(out, SEAL_NONCE_LEN) != 1)
+		return 0;
+
+	ctx = EVP_CIPHER_CTX_new();
+	if (!ctx)
+		return 0;
+
+	if (EVP_EncryptInit_ex(ctx, EVP_chacha20_poly1305(), NULL, (unsigned char *) key, out) &&
+			EVP_EncryptUpdate(ctx, out + SEAL_NONCE_LEN, &out_len, in, len) &&
+			EVP_EncryptFinal_ex(ctx, out + SEAL_NONCE_LEN + out_len, &out_len) &&
+			EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, SEAL_TAG_LEN, out + SEAL_NONCE_LEN + len))
+		rv = 1;
+
+	EVP_CIPHER_CTX_free(ctx);
+
+	return rv;
+}
+
+static int chacha_open(unsigned char *out, unsigned char *in, unsigned int len,
+		unsigned char *aad, unsigned int aad_len, char *key) {
+	EVP_CIPHER_CTX *ctx;
+	unsigned int clen = len - SEAL_OVERHEAD;
+	int out_len, rv = 0;
+
+	ctx = EVP_CIPHER_CTX_new();
+	if (!ctx)
+		return 0;
+
+	if (EVP_DecryptInit_ex(ctx, EVP_chacha20_poly1305(), NULL, (unsigned char *) key, in) &&
+			EVP_DecryptUpdate(ctx, out, &out_len, in + SEAL_NONCE_LEN, clen) &&
+			EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, SEAL_TAG_LEN, in + SEAL_NONCE_LEN + clen) &&
+			EVP_DecryptFinal_ex(ctx, out + out_len, &out_len) > 0)
+		rv = 1;
+
+	EVP_CIPHER_CTX_free(ctx);
+
+	return rv;
+}
+
+/* Seal 'len' bytes in segments of 'seg', or open them again */
+static int run_segments(aead_fn fn, int sealing, unsigned char *plain, unsigned char *sealed,
+		size_t len, unsigned int seg) {
+	size_t off, n;
+
+	for (off = 0; off < len; off += n, sealed += n + SEAL_OVERHEAD) {
+		n = len - off < seg ? len - off : seg;
+		if (sealing ? !fn(sealed, plain + off, n, NULL, 0, (char *) bench_key) :
+				!fn(plain + off, sealed, n + SEAL_OVERHEAD, NULL, 0, (char *) bench_key))
+			return 0;
+	}
+
+	return 1;
+}
+
+static int bench_crypt(int argc, char **argv) {
+	static unsigned int defsizes[] = { 1000, 10000, 100000 };
+	static unsigned int segs[] = { 4096, 16384, 65536 };
+	struct {
+		char *name;
+		aead_fn seal, open;
+	} ciphers[] = {
+		{ "aes-256-gcm", seal_data, open_data },
+		{ "chacha20-poly1305", chacha_seal, chacha_open },
+	};
+	double enc[BENCH_RUNS], dec[BENCH_RUNS], start;
+	unsigned char *plain, *sealed, *back;
+	unsigned int i, c, k, r, nsizes, size, out_size;
+	size_t len;
+	char key[64];
+	FILE *f;
+
+	RAND_bytes(bench_key, sizeof(bench_key));
+	printf("%-40s %10s\n", "cipher", "MB/s");
+
+	nsizes = argc ? argc : sizeof(defsizes) / sizeof(defsizes[0]);
+	for (i = 0; i < nsizes; i++) {
+		size = argc ? strtoul(argv[i], NULL, 10) : defsizes[i];
+		len = (size_t) size * BENCH_RECORD;
+		plain = malloc(len);
+		sealed = malloc(len + (len / 4096 + 1) * SEAL_OVERHEAD);
+		back = malloc(len);
+		if (!size || !plain || !sealed || !back) {
+			fprintf(stderr, "Can not build a vault of %u entries\n", size);
+			return 1;
+		}
+		RAND_bytes(plain, len);
+
+		for (c = 0; c < sizeof(ciphers) / sizeof(ciphers[0]); c++) {
+			for (k = 0; k < sizeof(segs) / sizeof(segs[0]); k++) {
+				for (r = 0; r < BENCH_RUNS; r++) {
+					start = now();
+					if (!run_segments(ciphers[c].seal, 1, plain, sealed, len, segs[k]))
+						goto fail;
+					enc[r] = len / 1e6 / (now() - start);
+
+					start = now();
+					if (!run_segments(ciphers[c].open, 0, back, sealed, len, segs[k]))
+						goto fail;
+					dec[r] = len / 1e6 / (now() - start);
+				}
+
+				if (memcmp(plain, back, len))
+					goto fail;
+
+				sprintf(key, "crypt/%u/%s/%u/seal", size, ciphers[c].name, segs[k]);
+				report(key, enc, BENCH_RUNS, "MB/s", 0);
+				sprintf(key, "crypt/%u/%s/%u/open", size, ciphers[c].name, segs[k]);
+				report(key, dec, BENCH_RUNS, "MB/s", 0);
+			}
+		}
+
+		/* the whole-file CBC format, through a real file */
+		for (r = 0; r < BENCH_RUNS; r++) {
+			char *p;
+
+			f = tmpfile();
+			if (!f)
+				goto fail;
+
+			start = now();
+			if (!encrypt_db(f, (char *) plain, (char *) bench_key, len) || fflush(f)) {
+				fclose(f);
+				goto fail;
+			}
+			enc[r] = len / 1e6 / (now() - start);
+
+			start = now();
+			p = decrypt_db(f, (char *) bench_key, &out_size);
+			dec[r] = len / 1e6 / (now() - start);
+			fclose(f);
+			if (!p || out_size != len || memcmp(p, plain, len)) {
+				secure_free(p);
+				goto fail;
+			}
+			secure_free(p);
+		}
+
+		sprintf(key, "crypt/%u/aes-256-cbc/file/seal", size);
+		report(key, enc, BENCH_RUNS, "MB/s", 0);
+		sprintf(key, "crypt/%u/aes-256-cbc/file/open", size);
+		report(key, dec, BENCH_RUNS, "MB/s", 0);
+
+		free(plain);
+		free(sealed);
+		free(back);
+	}
+
+	return 0;
+fail:
+	fprintf(stderr, "Encryption failed\n");
+	return 1;
+}
+
+#define BENCH_CHECK_STEP	97	/* entries whose secrets scale reads back */
+
+/* Every entry loaded from the file is the one that was generated */
+static int check_database(struct bench_vault *v, struct bench_records *br) {
+	unsigned char buf[MAX_RECORD_LEN];
+	struct db_entry de, ref;
+	unsigned int i, len;
+	int slot;
+
+	for (i = 0; i < v->count; i++) {
+		slot = id_index_get(i + 1);
+		if (slot < 0 || !db_decode_slot(slot, &de) ||
+				strcmp(de.name, v->name[i]) || strcmp(de.login, v->login[i]))
+			goto mismatch;
+
+		if (i % BENCH_CHECK_STEP)
+			continue;
+
+		len = db_full_record(slot, buf);
+		if (!len || record_decode(buf, len, &de) != len ||
+				!record_decode(br->buf + br->off[i], br->len[i], &ref) ||
+				strcmp(de.url, ref.url) || strcmp(de.password, ref.password) ||
+				strcmp(de.notes, ref.notes))
+			goto mismatch;
+	}
+
+	return 1;
+mismatch:
+	fprintf(stderr, "Entry %u differs from the generated one\n", i + 1);
+	return 0;
+}
+
+static int bench_commit(int argc, char **argv, int scale) {
+	static unsigned int defsizes[] = { 1000, 10000, 100000 };
+	static unsigned int scalesizes[] = { 10000, 100000, 1000000 };
+	unsigned int *sizes = scale ? scalesizes : defsizes;
+	double load[BENCH_RUNS], lat[BENCH_SAMPLES], start;
+	struct bench_vault v;
+	struct bench_records br;
+	unsigned int i, j, r, nsizes, size;
+	char key[64];
+
+	printf("database files in %s\n", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+
+	nsizes = argc ? argc : sizeof(defsizes) / sizeof(defsizes[0]);
+	for (i = 0; i < nsizes; i++) {
+		size = argc ? strtoul(argv[i], NULL, 10) : sizes[i];
+		srand(1);
+		if (!size || !make_vault(&v, size) || !make_records(&br, &v)) {
+			fprintf(stderr, "Can not build a vault of %u entries\n", size);
+			return 1;
+		}
+
+		if (!make_database(&v, &br))
+			return 1;
+
+		if (scale) {
+			start = now();
+			if (!check_database(&v, &br)) {
+				drop_database();
+				return 1;
+			}
+			printf("%u entries checked in %.0f ms\n", size, (now() - start) * 1e3);
+		}
+
+		for (r = 0; r < BENCH_RUNS; r++) {
+			db_close();
+			start = now();
+			if (!load_database(0))
+				goto fail;
+			load[r] = (now() - start) * 1e3;
+			writer_covered(journal_seq);
+		}
+
+		/* one new entry, checkpointed and synced */
+		for (r = 0; r < BENCH_SAMPLES; r++) {
+			j = rand() % size;
+			start = now();
+			if (!pt_add_entry(br.buf + br.off[j], br.len[j], -1) || !sync_db())
+				goto fail;
+			writer_wait_idle();
+			lat[r] = (now() - start) * 1e3;
+		}
+
+		sprintf(key, "load/%u", size);
+		report(key, load, BENCH_RUNS, "ms", 1);
+		sprintf(key, "commit/%u", size);
+		report(key, lat, BENCH_SAMPLES, "ms", 1);
+
+		drop_database();
+		free_records(&br);
+		free_vault(&v);
+	}
+
+	return 0;
+fail:
+	fprintf(stderr, "Database operation failed, see syslog\n");
+	drop_database();
+	return 1;
+}
+
+/* Sockets of requests for the server thread */
+static int ipc_pipe[2];
+
+/* Serves each socket it is given like the daemon's accept loop does */
+static void *ipc_server(void *arg) {
+	int csk;
+
+	while (read(ipc_pipe[0], &csk, sizeof(csk)) == sizeof(csk) && csk >= 0)
+		handle_client(csk);
+
+	return NULL;
+}
+
+/* One request over a fresh socketpair, the reply read up to the end */
+static int ipc_request(unsigned int type, void *data, unsigned int size,
+		unsigned int handle, unsigned char *reply) {
+	unsigned int hdr[3] = { type, size, handle };
+	char tail[2] = { 0, 0 };
+	ssize_t n;
+	int sk[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sk) < 0)
+		return 0;
+
+	if (write(ipc_pipe[1], &sk[0], sizeof(sk[0])) != sizeof(sk[0])) {
+		close(sk[0]);
+		close(sk[1]);
+		return 0;
+	}
+
+	if (send(sk[1], hdr, sizeof(hdr), 0) == sizeof(hdr) && (!size || send(sk[1], data, size, 0) == size)) {
+		/* frames, then "OK" once the handler succeeded */
+		while ((n = recv(sk[1], reply, MAX_PARCEL_LEN, 0)) > 0) {
+			if (n == 1) {
+				tail[0] = tail[1];
+				tail[1] = reply[0];
+			} else {
+				memcpy(tail, reply + n - 2, 2);
+			}
+		}
+	}
+
+	close(sk[1]);
+
+	return !memcmp(tail, "OK", 2);
+}
+
+static int bench_ipc(int argc, char **argv) {
+	unsigned int size = argc ? strtoul(argv[0], NULL, 10) : 10000;
+	double lat[BENCH_SAMPLES], start;
+	struct bench_vault v;
+	struct bench_records br;
+	unsigned long long id = 1;
+	struct {
+		char *name;
+		unsigned int type;
+		void *data;
+		unsigned int len;
+	} reqs[] = {
+		{ "get_id", PT_GET_ID, &id, sizeof(id) },
+		{ "get_entry", PT_GET_ENTRY, "hub", 4 },
+		{ "get_db", PT_GET_DB, NULL, 0 },
+	};
+	unsigned char *reply;
+	unsigned int i, r, handle;
+	pthread_t server;
+	char key[64];
+	int stop = -1;
+
+	srand(1);
+	reply = malloc(MAX_PARCEL_LEN);
+	if (!reply || !size || !make_vault(&v, size) || !make_records(&br, &v)) {
+		fprintf(stderr, "Can not build a vault of %u entries\n", size);
+		return 1;
+	}
+
+	if (!make_database(&v, &br))
+		return 1;
+
+	if (!vault_add(bench_path) || pipe(ipc_pipe) < 0 ||
+			pthread_create(&server, NULL, ipc_server, NULL)) {
+		fprintf(stderr, "Can not start the server: %s\n", strerror(errno));
+		return 1;
+	}
+	handle = current_vault->handle;
+
+	for (i = 0; i < sizeof(reqs) / sizeof(reqs[0]); i++) {
+		for (r = 0; r < BENCH_SAMPLES; r++) {
+			start = now();
+			if (!ipc_request(reqs[i].type, reqs[i].data, reqs[i].len, handle, reply)) {
+				fprintf(stderr, "Request failed, see syslog\n");
+				return 1;
+			}
+			lat[r] = (now() - start) * 1e6;
+		}
+
+		sprintf(key, "ipc/%u/%s", size, reqs[i].name);
+		report(key, lat, BENCH_SAMPLES, "us", 1);
+	}
+
+	if (write(ipc_pipe[1], &stop, sizeof(stop)) == sizeof(stop))
+		pthread_join(server, NULL);
+	close(ipc_pipe[0]);
+	close(ipc_pipe[1]);
+
+	drop_database();
+	free_records(&br);
+	free_vault(&v);
+	free(reply);
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	int opt, rv;
+	char *mode;
+
+	while ((opt = getopt(argc, argv, "+b:o:")) != -1) {
+		switch (opt) {
+			case 'b':
+				if (!load_baseline(optarg))
+					return 1;
+				break;
+			case 'o':
+				save_file = fopen(optarg, "w");
+				if (!save_file) {
+					fprintf(stderr, "Can not create %s: %s\n", optarg, strerror(errno));
+					return 1;
+				}
+				break;
+			default:
+				goto usage;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	mode = argc ? argv[0] : "search";
+	if (argc) {
+		argc--;
+		argv++;
+	}
+
+	if (!strcmp(mode, "search"))
+		rv = bench_search(argc, argv);
+	else if (!strcmp(mode, "scan"))
+		rv = bench_scan(argc, argv);
+	else if (!strcmp(mode, "crypt"))
+		rv = bench_crypt(argc, argv);
+	else if (!strcmp(mode, "commit"))
+		rv = bench_commit(argc, argv, 0);
+	else if (!strcmp(mode, "scale"))
+		rv = bench_commit(argc, argv, 1);
+	else if (!strcmp(mode, "ipc"))
+		rv = bench_ipc(argc, argv);
+	else
+		goto usage;
+
+	if (save_file)
+		fclose(save_file);
+
+	return rv ? rv : regressions ? 2 : 0;
+usage:
+	fprintf(stderr, "Usage: opm_bench [-b baseline] [-o results] search|scan|crypt|commit|scale|ipc [entries...]\n");
+
+	return 1;
+}
@@ -0,0 +1,1927 @@
+/*
+ * opm - Open Password Manager.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Alexander Miroch
+ *    Email: <alexander.miroch@gmail.com>
+ */
+
+/*
+ * Paged database file.
+ *
+ * The file is an array of DB_PAGE_SIZE pages, each sealed on its own
+ * with the page number as associated data and, from version 0x204 on,
+ * followed by a CRC32C that can be checked without the key (--verify)
+ * and tells a damaged page from a wrong passphrase. In 0x205 the key
+ * comes from the passphrase through a KDF whose salt and costs follow
+ * the meta header. From 0x206 on the key is random and the header is
+ * followed by key slots, each holding it sealed with a key derived from
+ * a passphrase, so a new passphrase only rewrites the slots. Up to 0x206
+ * the checksum took 4 bytes of the GCM tag, from 0x207 on the tag is
+ * whole and the checksum takes them from the node instead. Files created
+ * now carry BT_FLAG_DEFLATE, a value is stored deflated when that makes
+ * it smaller.
+ *
+ * Pages 0 and 1 hold two copies of the meta block; a commit writes the
+ * one not holding the current transaction, so a torn meta write falls
+ * back to the previous state. All other
+ * pages form a copy-on-write B+tree keyed by entry id: a modified page
+ * is always written to a new location and the old one is released once
+ * the transaction that dropped it has committed.
+ *
+ * Branch pages stay cached, leaves are only kept for the lifetime of a
+ * transaction, so an update touches O(log n) pages.
+ */
+
+#include "opm.h"
+
+#define BT_CACHE_BITS	12
+#define BT_CACHE_SIZE	(1 << BT_CACHE_BITS)
+
+struct bt_meta bt_meta;
+unsigned int bt_version = VERSION_CODE;
+unsigned char db_key[DB_KEY_LEN];
+
+static unsigned int bt_flags;	/* BT_FLAG_* of the file */
+
+static struct bt_kdf bt_kdf;	/* what db_key was derived with, 0x205 */
+static struct bt_keyslot bt_keys[BT_KEY_SLOTS];	/* db_key sealed, from 0x206 on */
+static int bt_slot = -1;	/* the one the passphrase opened */
+
+static struct bt_meta bt_committed;
+static char *bt_path = NULL;
+static int bt_fd = -1;
+
+struct bt_page {
+	unsigned long long pgno;
+	int dirty;
+	struct bt_page *next;
+	unsigned char data[PAGE_DATA_SIZE];
+};
+
+struct pg_list {
+	unsigned long long *pg;
+	unsigned int count, max;
+};
+
+struct bt_split {
+	int happened;
+	unsigned long long key;
+	unsigned long long pgno;
+};
+
+static struct bt_page *bt_cache[BT_CACHE_SIZE];
+static struct pg_list bt_free, bt_pending, bt_reused;
+
+#define BT_NODE(p)	((struct bt_node *) (p))
+#define BT_CELLS(p)	((unsigned char *) (p) + sizeof(struct bt_node))
+#define BT_CHILD0(p)	((unsigned long long *) BT_CELLS(p))
+#define BT_ENTS(p)	((struct bt_branch_ent *) (BT_CELLS(p) + sizeof(unsigned long long)))
+#define BT_CELL_DEFLATED	0x8000	/* in bt_cell.len, BT_FLAG_DEFLATE files only */
+#define BT_CELL_LEN(c)	(((struct bt_cell *) (c))->len & ~BT_CELL_DEFLATED)
+#define BT_CELL_SIZE(c)	(sizeof(struct bt_cell) + BT_CELL_LEN(c))
+#define BT_DEFLATE_MIN	16	/* shorter values do not get smaller */
+#define BT_DEFLATE_WBITS	11	/* a window as large as a value */
+#define BT_DEFLATE_MEMLEVEL	2	/* a small hash table, it is cleared for every value */
+
+static int pg_push(struct pg_list *l, unsigned long long pgno) {
+	unsigned long long *tmp;
+
+	if (l->count == l->max) {
+		l->max = l->max ? l->max * 2 : 64;
+		tmp = realloc(l->pg, l->max * sizeof(unsigned long long));
+		if (!tmp) {
+			syslog(LOG_ERR, "Memory allocation error");
+			return 0;
+		}
+		l->pg = tmp;
+	}
+
+	l->pg[l->count++] = pgno;
+	return 1;
+}
+
+static unsigned int bt_hash(unsigned long long pgno) {
+	return (pgno * 0x9E3779B97F4A7C15ULL) >> (64 - BT_CACHE_BITS);
+}
+
+static struct bt_page *bt_lookup(unsigned long long pgno) {
+	struct bt_page *pg;
+
+	for (pg = bt_cache[bt_hash(pgno)]; pg; pg = pg->next) {
+		if (pg->pgno == pgno)
+			return pg;
+	}
+
+	return NULL;
+}
+
+static void bt_insert_cache(struct bt_page *pg) {
+	unsigned int h = bt_hash(pg->pgno);
+
+	pg->next = bt_cache[h];
+	bt_cache[h] = pg;
+}
+
+static void bt_evict(struct bt_page *pg) {
+	struct bt_page **pp;
+
+	for (pp = &bt_cache[bt_hash(pg->pgno)]; *pp; pp = &(*pp)->next) {
+		if (*pp == pg) {
+			*pp = pg->next;
+			break;
+		}
+	}
+
+	secure_free(pg);
+}
+
+/*
+ * Drop pages from the cache. Dirty pages always go, clean ones only
+ * when they are leaves or 'all' is set.
+ */
+static void bt_flush_cache(int all) {
+	struct bt_page *pg, *next;
+	int i;
+
+	for (i = 0; i < BT_CACHE_SIZE; i++) {
+		for (pg = bt_cache[i]; pg; pg = next) {
+			next = pg->next;
+			if (all || pg->dirty || BT_NODE(pg->data)->type == BT_LEAF)
+				bt_evict(pg);
+		}
+	}
+}
+
+/* Pages written before 0x207 hold 4 more bytes of cells */
+static unsigned int bt_leaf_cap(void) {
+	return bt_version < FULL_TAG_VERSION_CODE ? BT_OLD_LEAF_CAP : BT_LEAF_CAP;
+}
+
+static int bt_check_node(unsigned char *data) {
+	struct bt_node *node = BT_NODE(data);
+	struct bt_cell *c;
+	unsigned int off, i;
+
+	switch (node->type) {
+		case BT_LEAF:
+			if (node->used > bt_leaf_cap())
+				return 0;
+
+			for (i = 0, off = 0; i < node->count; i++) {
+				c = (struct bt_cell *) (BT_CELLS(data) + off);
+				if (off + sizeof(*c) > node->used ||
+						((c->len & BT_CELL_DEFLATED) && !(bt_flags & BT_FLAG_DEFLATE)))
+					return 0;
+				off += BT_CELL_SIZE(c);
+			}
+
+			return off == node->used;
+		case BT_BRANCH:
+			return node->count <= (bt_leaf_cap() - sizeof(unsigned long long)) /
+				sizeof(struct bt_branch_ent);
+	}
+
+	return 0;
+}
+
+/* The checksum at the end of the page matches the rest of it */
+int bt_page_intact(unsigned char *page) {
+	unsigned int crc;
+
+	memcpy(&crc, page + DB_PAGE_SIZE - PAGE_CRC_LEN, sizeof(crc));
+
+	return crc32c(0, page, DB_PAGE_SIZE - PAGE_CRC_LEN) == crc;
+}
+
+static void bt_page_sum(unsigned char *page) {
+	unsigned int crc = crc32c(0, page, DB_PAGE_SIZE - PAGE_CRC_LEN);
+
+	memcpy(page + DB_PAGE_SIZE - PAGE_CRC_LEN, &crc, sizeof(crc));
+}
+
+static int bt_unseal(unsigned long long pgno, unsigned char *buf, unsigned char *data) {
+	int rv;
+
+	if (bt_version < CHECKSUM_VERSION_CODE) {
+		rv = open_data(data, buf, DB_PAGE_SIZE, (unsigned char *) &pgno, sizeof(pgno), db_key);
+	} else if (!bt_page_intact(buf)) {
+		syslog(LOG_ERR, "Page %llu is damaged, checksum mismatch", pgno);
+		return 0;
+	} else if (bt_version < FULL_TAG_VERSION_CODE) {
+		rv = open_page(data, buf, DB_PAGE_SIZE - PAGE_CRC_LEN,
+			(unsigned char *) &pgno, sizeof(pgno), db_key);
+	} else {
+		rv = open_data(data, buf, DB_PAGE_SIZE - PAGE_CRC_LEN,
+			(unsigned char *) &pgno, sizeof(pgno), db_key);
+		memset(data + PAGE_NODE_SIZE, 0, PAGE_DATA_SIZE - PAGE_NODE_SIZE);
+	}
+
+	if (!rv || !bt_check_node(data)) {
+		syslog(LOG_ERR, "Page %llu is corrupted", pgno);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int bt_seal(unsigned long long pgno, unsigned char *data, unsigned char *buf) {
+	int rv;
+
+	if (bt_version < CHECKSUM_VERSION_CODE)
+		return seal_data(buf, data, PAGE_DATA_SIZE, (unsigned char *) &pgno, sizeof(pgno), db_key);
+
+	if (bt_version < FULL_TAG_VERSION_CODE)
+		rv = seal_page(buf, data, PAGE_DATA_SIZE, (unsigned char *) &pgno, sizeof(pgno), db_key);
+	else
+		rv = seal_data(buf, data, PAGE_NODE_SIZE, (unsigned char *) &pgno, sizeof(pgno), db_key);
+
+	if (!rv)
+		return 0;
+	bt_page_sum(buf);
+
+	return 1;
+}
+
+static int bt_read(unsigned long long pgno, unsigned char *data) {
+	unsigned char buf[DB_PAGE_SIZE];
+
+	if (pgno < BT_FIRST_PAGE || pgno >= bt_meta.npages) {
+		syslog(LOG_ERR, "Invalid page reference %llu", pgno);
+		return 0;
+	}
+
+	if (pread(bt_fd, buf, DB_PAGE_SIZE, pgno * DB_PAGE_SIZE) != DB_PAGE_SIZE) {
+		syslog(LOG_ERR, "Can't read page %llu: %s", pgno, strerror(errno));
+		return 0;
+	}
+
+	return bt_unseal(pgno, buf, data);
+}
+
+/*
+ * Sealing or opening a batch of pages. Every page has a nonce and tag of
+ * its own, so they are independent and a few threads share the work,
+ * each taking the next BT_CRYPT_STEP pages. The threads are started once
+ * with the first file and wait for a batch to be posted, small batches
+ * are done by the caller alone.
+ */
+struct bt_crypt {
+	unsigned long long *pgno;
+	unsigned char **plain;
+	unsigned char *sealed;		/* n pages of DB_PAGE_SIZE */
+	unsigned int n, next;
+	unsigned int helpers;		/* pool threads still wanted */
+	int seal, error;
+};
+
+static pthread_mutex_t bt_crypt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bt_crypt_posted = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t bt_crypt_done = PTHREAD_COND_INITIALIZER;
+static struct bt_crypt *bt_crypt_job;	/* the batch being worked on */
+static unsigned int bt_crypt_threads, bt_crypt_busy;
+
+/* Take steps of bc until none is left, called with bt_crypt_lock held */
+static void bt_crypt_steps(struct bt_crypt *bc) {
+	unsigned int i, end;
+	int ok = 1;
+
+	while (!bc->error && bc->next < bc->n) {
+		i = bc->next;
+		end = bc->n - i < BT_CRYPT_STEP ? bc->n : i + BT_CRYPT_STEP;
+		bc->next = end;
+		pthread_mutex_unlock(&bt_crypt_lock);
+
+		for (; i < end && ok; i++) {
+			if (bc->seal)
+				ok = bt_seal(bc->pgno[i], bc->plain[i], bc->sealed + (size_t) i * DB_PAGE_SIZE);
+			else
+				ok = bt_unseal(bc->pgno[i], bc->sealed + (size_t) i * DB_PAGE_SIZE, bc->plain[i]);
+		}
+
+		pthread_mutex_lock(&bt_crypt_lock);
+		if (!ok)
+			bc->error = 1;
+	}
+}
+
+static void *bt_crypt_worker(void *arg) {
+	struct bt_crypt *bc;
+
+	(void) arg;
+
+	pthread_mutex_lock(&bt_crypt_lock);
+	while (1) {
+		bc = bt_crypt_job;
+		if (!bc || !bc->helpers || bc->error || bc->next >= bc->n) {
+			pthread_cond_wait(&bt_crypt_posted, &bt_crypt_lock);
+			continue;
+		}
+
+		bc->helpers--;
+		bt_crypt_busy++;
+		bt_crypt_steps(bc);
+		if (!--bt_crypt_busy)
+			pthread_cond_signal(&bt_crypt_done);
+	}
+
+	return NULL;
+}
+
+/*
+ * Start the crypt threads, once for the life of the process. Until then
+ * every batch is done by its caller; the daemon calls it after the fork.
+ */
+void bt_crypt_start(void) {
+	pthread_t thread;
+	long cpus;
+	unsigned int n;
+
+	if (bt_crypt_threads)
+		return;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	n = cpus < 1 ? 1 : cpus > BT_CRYPT_MAX_THREADS ? BT_CRYPT_MAX_THREADS : cpus;
+
+	/* the caller of bt_crypt_run() is one of them */
+	for (bt_crypt_threads = 1; bt_crypt_threads < n; bt_crypt_threads++) {
+		if (pthread_create(&thread, NULL, bt_crypt_worker, NULL))
+			break;
+		pthread_detach(thread);
+	}
+}
+
+static int bt_crypt_run(struct bt_crypt *bc) {
+	unsigned int n = 1;
+
+	/* small batches are not worth a thread */
+	if (bc->n >= 2 * BT_CRYPT_MIN_PAGES && bt_crypt_threads > 1) {
+		n = bc->n / BT_CRYPT_MIN_PAGES;
+		if (n > bt_crypt_threads)
+			n = bt_crypt_threads;
+	}
+
+	bc->next = 0;
+	bc->error = 0;
+	bc->helpers = n - 1;
+
+	pthread_mutex_lock(&bt_crypt_lock);
+	/* the pool works on one batch at a time, another one is done here */
+	if (bc->helpers && !bt_crypt_job) {
+		bt_crypt_job = bc;
+		pthread_cond_broadcast(&bt_crypt_posted);
+	}
+
+	bt_crypt_steps(bc);
+
+	if (bt_crypt_job == bc) {
+		while (bt_crypt_busy)
+			pthread_cond_wait(&bt_crypt_done, &bt_crypt_lock);
+		bt_crypt_job = NULL;
+	}
+	pthread_mutex_unlock(&bt_crypt_lock);
+
+	return !bc->error;
+}
+
+/* Read pages in, a run of consecutive ones with a single call */
+static int bt_read_batch(unsigned long long *pgno, unsigned int n, unsigned char *buf) {
+	unsigned int i, j;
+	size_t len;
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && pgno[j] == pgno[j - 1] + 1; j++)
+			;
+
+		len = (size_t) (j - i) * DB_PAGE_SIZE;
+		if (pread(bt_fd, buf + (size_t) i * DB_PAGE_SIZE, len, pgno[i] * DB_PAGE_SIZE) != (ssize_t) len) {
+			syslog(LOG_ERR, "Can't read page %llu: %s", pgno[i], strerror(errno));
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int bt_write_batch(unsigned long long *pgno, unsigned int n, unsigned char *buf) {
+	unsigned int i, j;
+	size_t len;
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && pgno[j] == pgno[j - 1] + 1; j++)
+			;
+
+		len = (size_t) (j - i) * DB_PAGE_SIZE;
+		if (pwrite(bt_fd, buf + (size_t) i * DB_PAGE_SIZE, len, pgno[i] * DB_PAGE_SIZE) != (ssize_t) len) {
+			syslog(LOG_ERR, "Can't write page %llu: %s", pgno[i], strerror(errno));
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static struct bt_page *bt_get_page(unsigned long long pgno) {
+	struct bt_page *pg;
+
+	pg = bt_lookup(pgno);
+	if (pg)
+		return pg;
+
+	pg = secure_alloc(sizeof(struct bt_page));
+	if (!pg) {
+		syslog(LOG_ERR, "Memory allocation error");
+		return NULL;
+	}
+
+	if (!bt_read(pgno, pg->data)) {
+		secure_free(pg);
+		return NULL;
+	}
+
+	pg->pgno = pgno;
+	pg->dirty = 0;
+	bt_insert_cache(pg);
+
+	return pg;
+}
+
+static struct bt_page *bt_new_page(unsigned short type) {
+	struct bt_page *pg;
+
+	pg = secure_alloc(sizeof(struct bt_page));
+	if (!pg) {
+		syslog(LOG_ERR, "Memory allocation error");
+		return NULL;
+	}
+
+	if (bt_free.count) {
+		pg->pgno = bt_free.pg[--bt_free.count];
+		if (!pg_push(&bt_reused, pg->pgno)) {
+			bt_free.count++;
+			secure_free(pg);
+			return NULL;
+		}
+	} else {
+		pg->pgno = bt_meta.npages++;
+	}
+
+	pg->dirty = 1;
+	BT_NODE(pg->data)->type = type;
+	bt_insert_cache(pg);
+
+	return pg;
+}
+
+static int bt_release(struct bt_page *pg) {
+	if (!pg_push(&bt_pending, pg->pgno))
+		return 0;
+
+	bt_evict(pg);
+	return 1;
+}
+
+/* Make a page writable in the current transaction */
+static struct bt_page *bt_touch(struct bt_page *pg) {
+	struct bt_page *np;
+
+	if (pg->dirty)
+		return pg;
+
+	np = bt_new_page(BT_NODE(pg->data)->type);
+	if (!np)
+		return NULL;
+
+	memcpy(np->data, pg->data, PAGE_DATA_SIZE);
+	if (!bt_release(pg))
+		return NULL;
+
+	return np;
+}
+
+static unsigned int bt_child_index(unsigned char *data, unsigned long long key) {
+	struct bt_branch_ent *ents = BT_ENTS(data);
+	unsigned int lo = 0, hi = BT_NODE(data)->count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ents[mid].key <= key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static unsigned long long bt_child(unsigned char *data, unsigned int i) {
+	return i ? BT_ENTS(data)[i - 1].child : *BT_CHILD0(data);
+}
+
+static void bt_set_child(unsigned char *data, unsigned int i, unsigned long long pgno) {
+	if (i)
+		BT_ENTS(data)[i - 1].child = pgno;
+	else
+		*BT_CHILD0(data) = pgno;
+}
+
+/*
+ * Pick how many of the n cells (total bytes) stay in the left page.
+ * Appends at the right edge keep the left page full, everything else
+ * is split as evenly as the cell sizes allow.
+ */
+static unsigned int bt_leaf_split_point(unsigned char *cells, unsigned int n, unsigned int total, int append) {
+	unsigned int i, left = 0, best = 0, best_diff = ~0U, diff, cap = bt_leaf_cap();
+
+	for (i = 1; i < n; i++) {
+		left += BT_CELL_SIZE(cells + left);
+		if (left > cap)
+			break;
+
+		if (total - left > cap)
+			continue;
+
+		if (append) {
+			best = i;
+			continue;
+		}
+
+		diff = left > total / 2 ? left - total / 2 : total / 2 - left;
+		if (diff < best_diff) {
+			best_diff = diff;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static int bt_leaf_insert(struct bt_page *pg, unsigned long long key, unsigned char *val,
+		unsigned int len, struct bt_split *sp) {
+	struct bt_node *node = BT_NODE(pg->data);
+	unsigned char *cells = BT_CELLS(pg->data);
+	unsigned char tmp[2 * PAGE_DATA_SIZE];
+	unsigned int i, off, oldsize = 0, newsize, total, n, k, loff, size = len & ~BT_CELL_DEFLATED;
+	struct bt_cell *c = NULL;
+	struct bt_page *right;
+	int replace = 0;
+
+	for (i = 0, off = 0; i < node->count; i++) {
+		c = (struct bt_cell *) (cells + off);
+		if (c->key >= key)
+			break;
+		off += BT_CELL_SIZE(c);
+	}
+
+	if (i < node->count && c->key == key) {
+		replace = 1;
+		oldsize = BT_CELL_SIZE(c);
+	}
+
+	newsize = sizeof(struct bt_cell) + size;
+	total = node->used - oldsize + newsize;
+	n = node->count + !replace;
+	sp->happened = 0;
+
+	if (!replace)
+		bt_meta.nkeys++;
+
+	if (total <= bt_leaf_cap()) {
+		memmove(cells + off + newsize, cells + off + oldsize, node->used - off - oldsize);
+		c = (struct bt_cell *) (cells + off);
+		c->key = key;
+		c->len = len;
+		memcpy(cells + off + sizeof(struct bt_cell), val, size);
+		node->used = total;
+		node->count = n;
+		return 1;
+	}
+
+	memcpy(tmp, cells, off);
+	c = (struct bt_cell *) (tmp + off);
+	c->key = key;
+	c->len = len;
+	memcpy(tmp + off + sizeof(struct bt_cell), val, size);
+	memcpy(tmp + off + newsize, cells + off + oldsize, node->used - off - oldsize);
+
+	k = bt_leaf_split_point(tmp, n, total, i == n - 1);
+	if (!k) {
+		syslog(LOG_ERR, "Can not split leaf page");
+		return 0;
+	}
+
+	for (i = 0, loff = 0; i < k; i++)
+		loff += BT_CELL_SIZE(tmp + loff);
+
+	right = bt_new_page(BT_LEAF);
+	if (!right)
+		return 0;
+
+	memset(cells, 0, BT_OLD_LEAF_CAP);
+	memcpy(cells, tmp, loff);
+	node->count = k;
+	node->used = loff;
+
+	memcpy(BT_CELLS(right->data), tmp + loff, total - loff);
+	BT_NODE(right->data)->count = n - k;
+	BT_NODE(right->data)->used = total - loff;
+
+	memset(tmp, 0, sizeof(tmp));
+
+	sp->happened = 1;
+	sp->key = ((struct bt_cell *) BT_CELLS(right->data))->key;
+	sp->pgno = right->pgno;
+
+	return 1;
+}
+
+/* Insert separator 'key' with right child 'child' at entry position i */
+static int bt_branch_insert(struct bt_page *pg, unsigned int i, unsigned long long key,
+		unsigned long long child, struct bt_split *sp) {
+	struct bt_node *node = BT_NODE(pg->data);
+	struct bt_branch_ent tmp[BT_BRANCH_MAX + 1], *ents = BT_ENTS(pg->data);
+	struct bt_page *right;
+	unsigned int n, m;
+
+	sp->happened = 0;
+	if (node->count < BT_BRANCH_MAX) {
+		memmove(ents + i + 1, ents + i, (node->count - i) * sizeof(*ents));
+		ents[i].key = key;
+		ents[i].child = child;
+		node->count++;
+		return 1;
+	}
+
+	memcpy(tmp, ents, i * sizeof(*ents));
+	tmp[i].key = key;
+	tmp[i].child = child;
+	memcpy(tmp + i + 1, ents + i, (node->count - i) * sizeof(*ents));
+	n = node->count + 1;
+
+	/* entry m moves up, its child becomes child0 of the right page */
+	m = (i == n - 1) ? n - 1 : n / 2;
+
+	right = bt_new_page(BT_BRANCH);
+	if (!right)
+		return 0;
+
+	memcpy(ents, tmp, m * sizeof(*ents));
+	node->count = m;
+
+	*BT_CHILD0(right->data) = tmp[m].child;
+	memcpy(BT_ENTS(right->data), tmp + m + 1, (n - m - 1) * sizeof(*ents));
+	BT_NODE(right->data)->count = n - m - 1;
+
+	sp->happened = 1;
+	sp->key = tmp[m].key;
+	sp->pgno = right->pgno;
+
+	return 1;
+}
+
+static int bt_insert(unsigned long long *pgno, unsigned long long key, unsigned char *val,
+		unsigned int len, struct bt_split *sp) {
+	struct bt_page *pg;
+	struct bt_split csp;
+	unsigned long long child;
+	unsigned int i;
+
+	pg = bt_get_page(*pgno);
+	if (!pg)
+		return 0;
+
+	if (BT_NODE(pg->data)->type == BT_LEAF) {
+		pg = bt_touch(pg);
+		if (!pg)
+			return 0;
+
+		*pgno = pg->pgno;
+		return bt_leaf_insert(pg, key, val, len, sp);
+	}
+
+	i = bt_child_index(pg->data, key);
+	child = bt_child(pg->data, i);
+
+	if (!bt_insert(&child, key, val, len, &csp))
+		return 0;
+
+	pg = bt_touch(pg);
+	if (!pg)
+		return 0;
+
+	*pgno = pg->pgno;
+	bt_set_child(pg->data, i, child);
+
+	if (!csp.happened) {
+		sp->happened = 0;
+		return 1;
+	}
+
+	return bt_branch_insert(pg, i, csp.key, csp.pgno, sp);
+}
+
+/*
+ * Values are deflated and inflated one at a time with raw streams that
+ * are set up once and reset for every value.
+ */
+static z_stream bt_zdef, bt_zinf;
+static int bt_zdef_ready, bt_zinf_ready;
+
+/* The deflated value in out, 0 if it would not get smaller */
+static unsigned int bt_deflate(unsigned char *in, unsigned int len, unsigned char *out) {
+	if (len < BT_DEFLATE_MIN)
+		return 0;
+
+	if (!bt_zdef_ready) {
+		bt_zdef.zalloc = secure_zalloc;
+		bt_zdef.zfree = secure_zfree;
+		bt_zdef.opaque = Z_NULL;
+		if (deflateInit2(&bt_zdef, Z_BEST_SPEED, Z_DEFLATED, -BT_DEFLATE_WBITS,
+				BT_DEFLATE_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+			return 0;
+		bt_zdef_ready = 1;
+	} else if (deflateReset(&bt_zdef) != Z_OK) {
+		return 0;
+	}
+
+	bt_zdef.next_in = in;
+	bt_zdef.avail_in = len;
+	bt_zdef.next_out = out;
+	bt_zdef.avail_out = len - 1;
+
+	if (deflate(&bt_zdef, Z_FINISH) != Z_STREAM_END)
+		return 0;
+
+	return len - 1 - bt_zdef.avail_out;
+}
+
+/* Inflate into out (BT_MAX_VALUE bytes), 0 if the value is damaged */
+static unsigned int bt_inflate(unsigned char *in, unsigned int len, unsigned char *out) {
+	if (!bt_zinf_ready) {
+		bt_zinf.zalloc = secure_zalloc;
+		bt_zinf.zfree = secure_zfree;
+		bt_zinf.opaque = Z_NULL;
+		bt_zinf.next_in = Z_NULL;
+		bt_zinf.avail_in = 0;
+		if (inflateInit2(&bt_zinf, -MAX_WBITS) != Z_OK)
+			return 0;
+		bt_zinf_ready = 1;
+	} else if (inflateReset(&bt_zinf) != Z_OK) {
+		return 0;
+	}
+
+	bt_zinf.next_in = in;
+	bt_zinf.avail_in = len;
+	bt_zinf.next_out = out;
+	bt_zinf.avail_out = BT_MAX_VALUE;
+
+	if (inflate(&bt_zinf, Z_FINISH) != Z_STREAM_END || bt_zinf.avail_in)
+		return 0;
+
+	return BT_MAX_VALUE - bt_zinf.avail_out;
+}
+
+/*
+ * Where the value of cell c is, inflated into buf (BT_MAX_VALUE bytes)
+ * if it was stored deflated.
+ */
+static int bt_value(struct bt_cell *c, unsigned char *buf, unsigned char **val, unsigned int *len) {
+	*val = (unsigned char *) c + sizeof(*c);
+	*len = BT_CELL_LEN(c);
+	if (!(c->len & BT_CELL_DEFLATED))
+		return 1;
+
+	*len = bt_inflate(*val, *len, buf);
+	*val = buf;
+	if (!*len) {
+		syslog(LOG_ERR, "Record %llu is corrupted", c->key);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int bt_store(unsigned long long key, unsigned char *val, unsigned int len) {
+	struct bt_page *pg;
+	struct bt_split sp;
+	unsigned long long root;
+
+	if (!bt_meta.root) {
+		pg = bt_new_page(BT_LEAF);
+		if (!pg)
+			return 0;
+
+		bt_meta.root = pg->pgno;
+		bt_meta.depth = 1;
+	}
+
+	root = bt_meta.root;
+	if (!bt_insert(&root, key, val, len, &sp))
+		return 0;
+
+	if (sp.happened) {
+		pg = bt_new_page(BT_BRANCH);
+		if (!pg)
+			return 0;
+
+		*BT_CHILD0(pg->data) = root;
+		BT_ENTS(pg->data)[0].key = sp.key;
+		BT_ENTS(pg->data)[0].child = sp.pgno;
+		BT_NODE(pg->data)->count = 1;
+
+		root = pg->pgno;
+		bt_meta.depth++;
+	}
+
+	bt_meta.root = root;
+
+	return 1;
+}
+
+int bt_put(unsigned long long key, unsigned char *val, unsigned int len) {
+	unsigned char packed[BT_MAX_VALUE];
+	unsigned int n;
+	int rv;
+
+	if (len > BT_MAX_VALUE) {
+		syslog(LOG_ERR, "Record is too large");
+		return 0;
+	}
+
+	/* files that allow it get the deflated value when it is smaller */
+	n = bt_flags & BT_FLAG_DEFLATE ? bt_deflate(val, len, packed) : 0;
+	if (n)
+		rv = bt_store(key, packed, n | BT_CELL_DEFLATED);
+	else
+		rv = bt_store(key, val, len);
+
+	memset(packed, 0, sizeof(packed));
+
+	return rv;
+}
+
+/* Copy the value of key into buf (BT_MAX_VALUE bytes), 0 if there is none */
+unsigned int bt_get(unsigned long long key, unsigned char *buf) {
+	unsigned long long pgno = bt_meta.root;
+	struct bt_page *pg;
+	struct bt_cell *c;
+	unsigned char *val;
+	unsigned int i, off, len;
+
+	if (!pgno)
+		return 0;
+
+	while (1) {
+		pg = bt_get_page(pgno);
+		if (!pg)
+			return 0;
+
+		if (BT_NODE(pg->data)->type != BT_BRANCH)
+			break;
+
+		pgno = bt_child(pg->data, bt_child_index(pg->data, key));
+	}
+
+	for (i = 0, off = 0; i < BT_NODE(pg->data)->count; i++) {
+		c = (struct bt_cell *) (BT_CELLS(pg->data) + off);
+		if (c->key == key) {
+			if (!bt_value(c, buf, &val, &len))
+				return 0;
+			if (len > BT_MAX_VALUE) {
+				syslog(LOG_ERR, "Record %llu is too large", key);
+				return 0;
+			}
+			if (val != buf)
+				memcpy(buf, val, len);
+			return len;
+		}
+		off += BT_CELL_SIZE(c);
+	}
+
+	return 0;
+}
+
+static int bt_remove(unsigned long long *pgno, unsigned long long key, int *found, int *empty) {
+	struct bt_page *pg;
+	struct bt_node *node;
+	struct bt_branch_ent *ents;
+	unsigned long long child;
+	unsigned int i, off, size;
+	unsigned char *cells;
+	struct bt_cell *c;
+	int cempty = 0;
+
+	*found = 0;
+	*empty = 0;
+
+	pg = bt_get_page(*pgno);
+	if (!pg)
+		return 0;
+
+	node = BT_NODE(pg->data);
+	if (node->type == BT_LEAF) {
+		cells = BT_CELLS(pg->data);
+		for (i = 0, off = 0; i < node->count; i++) {
+			c = (struct bt_cell *) (cells + off);
+			if (c->key == key)
+				break;
+			off += BT_CELL_SIZE(c);
+		}
+
+		if (i == node->count)
+			return 1;
+
+		*found = 1;
+		bt_meta.nkeys--;
+
+		if (node->count == 1) {
+			*empty = 1;
+			return bt_release(pg);
+		}
+
+		pg = bt_touch(pg);
+		if (!pg)
+			return 0;
+
+		node = BT_NODE(pg->data);
+		cells = BT_CELLS(pg->data);
+		size = BT_CELL_SIZE(cells + off);
+
+		memmove(cells + off, cells + off + size, node->used - off - size);
+		node->used -= size;
+		node->count--;
+		memset(cells + node->used, 0, size);
+
+		*pgno = pg->pgno;
+		return 1;
+	}
+
+	i = bt_child_index(pg->data, key);
+	child = bt_child(pg->data, i);
+
+	if (!bt_remove(&child, key, found, &cempty))
+		return 0;
+
+	if (!*found)
+		return 1;
+
+	if (cempty && !node->count) {
+		*empty = 1;
+		return bt_release(pg);
+	}
+
+	pg = bt_touch(pg);
+	if (!pg)
+		return 0;
+
+	*pgno = pg->pgno;
+	node = BT_NODE(pg->data);
+	ents = BT_ENTS(pg->data);
+
+	if (!cempty) {
+		bt_set_child(pg->data, i, child);
+		return 1;
+	}
+
+	if (!i) {
+		*BT_CHILD0(pg->data) = ents[0].child;
+		i = 1;
+	}
+
+	memmove(ents + i - 1, ents + i, (node->count - i) * sizeof(*ents));
+	node->count--;
+
+	return 1;
+}
+
+int bt_del(unsigned long long key) {
+	struct bt_page *pg;
+	unsigned long long root;
+	int found, empty;
+
+	if (!bt_meta.root)
+		return 1;
+
+	root = bt_meta.root;
+	if (!bt_remove(&root, key, &found, &empty))
+		return 0;
+
+	if (!found)
+		return 1;
+
+	bt_meta.ndeleted++;
+	if (empty) {
+		bt_meta.root = 0;
+		bt_meta.depth = 0;
+		return 1;
+	}
+
+	/* collapse branch roots that are left with a single child */
+	while (1) {
+		pg = bt_get_page(root);
+		if (!pg)
+			return 0;
+
+		if (BT_NODE(pg->data)->type != BT_BRANCH || BT_NODE(pg->data)->count)
+			break;
+
+		root = *BT_CHILD0(pg->data);
+		if (!bt_release(pg))
+			return 0;
+
+		bt_meta.depth--;
+	}
+
+	bt_meta.root = root;
+
+	return 1;
+}
+
+/* Keys bt_walk() hands to its callback */
+static unsigned long long walk_lo, walk_hi;
+
+/* Leaves found by bt_walk() and not read yet, in key order */
+static unsigned long long walk_pg[BT_CRYPT_BATCH];
+static unsigned int walk_count;
+static unsigned char *walk_plain, *walk_sealed;
+
+static int bt_walk_flush(int (*cb)(unsigned long long, unsigned char *, unsigned int)) {
+	unsigned char *plain[BT_CRYPT_BATCH], *data, buf[BT_MAX_VALUE], *val;
+	struct bt_crypt bc;
+	struct bt_cell *c;
+	unsigned int i, j, off, len;
+	int rv;
+
+	for (i = 0; i < walk_count; i++)
+		plain[i] = walk_plain + (size_t) i * PAGE_DATA_SIZE;
+
+	bc.pgno = walk_pg;
+	bc.plain = plain;
+	bc.sealed = walk_sealed;
+	bc.n = walk_count;
+	bc.seal = 0;
+	rv = bt_read_batch(walk_pg, walk_count, walk_sealed) && bt_crypt_run(&bc);
+
+	for (i = 0; i < walk_count && rv; i++) {
+		data = plain[i];
+		if (BT_NODE(data)->type != BT_LEAF) {
+			syslog(LOG_ERR, "Page %llu is corrupted", walk_pg[i]);
+			rv = 0;
+			break;
+		}
+
+		for (j = 0, off = 0; j < BT_NODE(data)->count && rv; j++) {
+			c = (struct bt_cell *) (BT_CELLS(data) + off);
+			if (c->key >= walk_lo && c->key < walk_hi &&
+					(!bt_value(c, buf, &val, &len) || !cb(c->key, val, len)))
+				rv = 0;
+			off += BT_CELL_SIZE(c);
+		}
+	}
+
+	memset(walk_plain, 0, (size_t) walk_count * PAGE_DATA_SIZE);
+	memset(buf, 0, sizeof(buf));
+	walk_count = 0;
+
+	return rv;
+}
+
+/* The page holds keys from min to max */
+static int bt_walk_page(unsigned long long pgno, unsigned char *seen, unsigned int level,
+		unsigned long long min, unsigned long long max,
+		int (*cb)(unsigned long long, unsigned char *, unsigned int)) {
+	unsigned long long cmin, cmax;
+	struct bt_page *pg;
+	unsigned int i;
+
+	if (pgno < BT_FIRST_PAGE || pgno >= bt_meta.npages || (seen[pgno / 8] & (1 << (pgno % 8))) ||
+			level > bt_meta.depth) {
+		syslog(LOG_ERR, "Invalid page reference %llu", pgno);
+		return 0;
+	}
+
+	seen[pgno / 8] |= 1 << (pgno % 8);
+
+	if (level < bt_meta.depth) {
+		pg = bt_get_page(pgno);
+		if (!pg)
+			return 0;
+
+		if (BT_NODE(pg->data)->type != BT_BRANCH) {
+			syslog(LOG_ERR, "Page %llu is corrupted", pgno);
+			return 0;
+		}
+
+		for (i = 0; i <= BT_NODE(pg->data)->count; i++) {
+			cmin = i ? BT_ENTS(pg->data)[i - 1].key : min;
+			cmax = i < BT_NODE(pg->data)->count ? BT_ENTS(pg->data)[i].key - 1 : max;
+			if (!bt_walk_page(bt_child(pg->data, i), seen, level + 1, cmin, cmax, cb))
+				return 0;
+		}
+
+		return 1;
+	}
+
+	/* nothing wanted in there, the page just counts as used */
+	if (max < walk_lo || min >= walk_hi)
+		return 1;
+
+	walk_pg[walk_count++] = pgno;
+	if (walk_count == BT_CRYPT_BATCH)
+		return bt_walk_flush(cb);
+
+	return 1;
+}
+
+/*
+ * Visit the records with keys from lo up to hi in key order, only the
+ * leaves holding them are read, BT_CRYPT_BATCH at a time. Pages not
+ * reachable from the root are what is left over from earlier
+ * transactions and become free.
+ */
+int bt_walk(unsigned long long lo, unsigned long long hi,
+		int (*cb)(unsigned long long, unsigned char *, unsigned int)) {
+	unsigned char *seen;
+	unsigned long long pgno;
+	int rv;
+
+	seen = calloc(bt_meta.npages / 8 + 1, 1);
+	walk_plain = secure_alloc((size_t) BT_CRYPT_BATCH * PAGE_DATA_SIZE);
+	walk_sealed = malloc((size_t) BT_CRYPT_BATCH * DB_PAGE_SIZE);
+	if (!seen || !walk_plain || !walk_sealed) {
+		syslog(LOG_ERR, "Memory allocation error");
+		rv = 0;
+		goto out;
+	}
+
+	walk_lo = lo;
+	walk_hi = hi;
+	walk_count = 0;
+	rv = !bt_meta.root || bt_walk_page(bt_meta.root, seen, 1, 0, ~0ULL, cb);
+	if (rv && walk_count)
+		rv = bt_walk_flush(cb);
+out:
+	walk_count = 0;
+	secure_free(walk_plain);
+	free(walk_sealed);
+	walk_plain = walk_sealed = NULL;
+
+	if (!rv) {
+		free(seen);
+		return 0;
+	}
+
+	bt_free.count = 0;
+	for (pgno = bt_meta.npages - 1; pgno >= BT_FIRST_PAGE; pgno--) {
+		if (!(seen[pgno / 8] & (1 << (pgno % 8))) && !pg_push(&bt_free, pgno)) {
+			free(seen);
+			return 0;
+		}
+	}
+
+	free(seen);
+
+	return 1;
+}
+
+static void bt_meta_aad(unsigned char *aad, unsigned long long pgno, unsigned int version) {
+	struct bt_meta_hdr *mh = (struct bt_meta_hdr *) aad;
+
+	memset(mh, 0, sizeof(*mh));
+	memcpy(mh->signature, PAGED_SIGNATURE, sizeof(mh->signature));
+	mh->version = version;
+	mh->page_size = DB_PAGE_SIZE;
+	memcpy(aad + sizeof(*mh), &pgno, sizeof(pgno));
+}
+
+static int bt_write_meta(struct bt_keyslot *keys) {
+	unsigned char buf[DB_PAGE_SIZE], aad[sizeof(struct bt_meta_hdr) + sizeof(unsigned long long)];
+	unsigned long long pgno = bt_meta.txn % 2;
+	struct bt_meta_tail *tail;
+
+	unsigned int off = sizeof(struct bt_meta_hdr);
+
+	memset(buf, 0, sizeof(buf));
+	bt_meta_aad(aad, pgno, bt_version | bt_flags);
+	memcpy(buf, aad, sizeof(struct bt_meta_hdr));
+
+	if (bt_version >= ENVELOPE_VERSION_CODE) {
+		memcpy(buf + off, keys, sizeof(bt_keys));
+		off += sizeof(bt_keys);
+	} else if (bt_version >= KDF_VERSION_CODE) {
+		memcpy(buf + off, &bt_kdf, sizeof(bt_kdf));
+		off += sizeof(bt_kdf);
+	}
+
+	if (!seal_data(buf + off, (unsigned char *) &bt_meta, sizeof(bt_meta),
+			aad, sizeof(aad), db_key))
+		return 0;
+
+	if (bt_version >= CHECKSUM_VERSION_CODE) {
+		tail = (struct bt_meta_tail *) (buf + DB_PAGE_SIZE - sizeof(*tail));
+		tail->txn = bt_meta.txn;
+		tail->npages = bt_meta.npages;
+		bt_page_sum(buf);
+	}
+
+	if (pwrite(bt_fd, buf, DB_PAGE_SIZE, pgno * DB_PAGE_SIZE) != DB_PAGE_SIZE) {
+		syslog(LOG_ERR, "Can't write meta page: %s", strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Databases before KDF_VERSION_CODE are sealed with the passphrase buffer */
+void bt_plain_key(void) {
+	memcpy(db_key, password, DB_KEY_LEN);
+	memset(&bt_kdf, 0, sizeof(bt_kdf));
+	memset(bt_keys, 0, sizeof(bt_keys));
+	bt_slot = -1;
+}
+
+static long bt_msec(struct timespec *start) {
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (end.tv_sec - start->tv_sec) * 1000 + (end.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* In 0x205 the key comes from the passphrase once, both meta pages share it */
+static int bt_derive(struct bt_kdf *kdf) {
+	struct timespec start;
+
+	if (!memcmp(kdf, &bt_kdf, sizeof(*kdf)))
+		return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!kdf_derive((char *) password, kdf, db_key)) {
+		syslog(LOG_ERR, "Can not derive the database key");
+		memset(&bt_kdf, 0, sizeof(bt_kdf));
+		return 0;
+	}
+
+	bt_kdf = *kdf;
+	syslog(LOG_INFO, "Database key derived in %ld ms", bt_msec(&start));
+
+	return 1;
+}
+
+/* The salt and costs are the associated data of the sealed key */
+static int bt_unwrap(struct bt_keyslot *ks, char *pass, unsigned char *key) {
+	unsigned char kek[DB_KEY_LEN];
+	int rv;
+
+	rv = kdf_derive(pass, &ks->kdf, kek) &&
+		open_data(key, ks->wrapped, sizeof(ks->wrapped),
+			(unsigned char *) &ks->kdf, sizeof(ks->kdf), (char *) kek);
+	memset(kek, 0, sizeof(kek));
+
+	return rv;
+}
+
+/* Seal 'key' under 'pass' with a fresh salt and the current costs */
+static int bt_wrap(struct bt_keyslot *ks, char *pass, unsigned char *key) {
+	unsigned char kek[DB_KEY_LEN];
+	struct bt_keyslot tmp;
+	int rv;
+
+	memset(&tmp, 0, sizeof(tmp));
+	if (kdf_calibrated)
+		tmp.kdf = kdf_tuned;
+	else
+		kdf_defaults(&tmp.kdf);
+
+	if (RAND_bytes(tmp.kdf.salt, sizeof(tmp.kdf.salt)) != 1) {
+		syslog(LOG_ERR, "Can not generate salt");
+		return 0;
+	}
+
+	rv = kdf_derive(pass, &tmp.kdf, kek);
+	if (!rv && tmp.kdf.alg == KDF_SCRYPT) {
+		/* the crypto library may come without scrypt */
+		syslog(LOG_WARNING, "scrypt failed, falling back to PBKDF2");
+		tmp.kdf.alg = KDF_PBKDF2;
+		tmp.kdf.cost = KDF_PBKDF2_ITER;
+		tmp.kdf.r = tmp.kdf.p = 0;
+		rv = kdf_derive(pass, &tmp.kdf, kek);
+	}
+
+	if (!rv)
+		syslog(LOG_ERR, "Can not derive the key encryption key");
+	else
+		rv = seal_data(tmp.wrapped, key, DB_KEY_LEN,
+			(unsigned char *) &tmp.kdf, sizeof(tmp.kdf), (char *) kek);
+
+	if (rv)
+		*ks = tmp;
+
+	memset(kek, 0, sizeof(kek));
+
+	return rv;
+}
+
+/*
+ * Take db_key out of the first slot the passphrase opens. Both meta pages
+ * normally carry the same slots, so the second one costs nothing. Slots
+ * that are all unused leave db_key as the caller set it (opm_bench).
+ */
+static int bt_unlock(struct bt_keyslot *keys) {
+	unsigned char key[DB_KEY_LEN];
+	struct timespec start;
+	int i, used = 0;
+
+	if (!memcmp(keys, bt_keys, sizeof(bt_keys)))
+		return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < BT_KEY_SLOTS; i++) {
+		if (keys[i].kdf.alg == KDF_NONE)
+			continue;
+
+		used++;
+		if (bt_unwrap(&keys[i], (char *) password, key))
+			break;
+	}
+
+	if (used && i == BT_KEY_SLOTS) {
+		memset(key, 0, sizeof(key));
+		return 0;
+	}
+
+	if (used) {
+		memcpy(db_key, key, sizeof(db_key));
+		memset(key, 0, sizeof(key));
+		syslog(LOG_INFO, "Database key unlocked in %ld ms", bt_msec(&start));
+	}
+
+	memcpy(bt_keys, keys, sizeof(bt_keys));
+	bt_slot = used ? i : -1;
+
+	return 1;
+}
+
+/* A file written now should get a random key and a key slot */
+int bt_rekey_due(void) {
+	return bt_slot < 0;
+}
+
+/*
+ * A new key for the file about to be created, sealed in the first slot
+ * under the passphrase, which the daemon only holds while loading a
+ * database.
+ */
+int bt_rekey(void) {
+	unsigned char key[DB_KEY_LEN];
+	struct bt_keyslot ks;
+
+	if (!*password) {
+		syslog(LOG_ERR, "No passphrase to derive the database key from");
+		return 0;
+	}
+
+	if (RAND_bytes(key, sizeof(key)) != 1) {
+		syslog(LOG_ERR, "Can not generate the database key");
+		return 0;
+	}
+
+	if (!bt_wrap(&ks, (char *) password, key)) {
+		memset(key, 0, sizeof(key));
+		return 0;
+	}
+
+	memcpy(db_key, key, sizeof(db_key));
+	memset(key, 0, sizeof(key));
+	memset(&bt_kdf, 0, sizeof(bt_kdf));
+	memset(bt_keys, 0, sizeof(bt_keys));
+	bt_keys[0] = ks;
+	bt_slot = 0;
+
+	return 1;
+}
+
+/* --calibrate gave other costs than the slot was sealed with */
+int bt_rewrap_due(void) {
+	struct bt_kdf *kdf;
+
+	if (!kdf_calibrated || bt_slot < 0)
+		return 0;
+
+	kdf = &bt_keys[bt_slot].kdf;
+
+	return kdf->alg != kdf_tuned.alg || kdf->cost != kdf_tuned.cost ||
+		kdf->r != kdf_tuned.r || kdf->p != kdf_tuned.p;
+}
+
+static int bt_read_meta(unsigned long long pgno, struct bt_meta *meta, unsigned int *version,
+		unsigned int *flags) {
+	unsigned char buf[DB_PAGE_SIZE], aad[sizeof(struct bt_meta_hdr) + sizeof(unsigned long long)];
+	struct bt_meta_hdr *mh = (struct bt_meta_hdr *) buf;
+	struct bt_keyslot keys[BT_KEY_SLOTS];
+	unsigned int off = sizeof(*mh), v;
+	struct bt_kdf kdf;
+
+	if (pread(bt_fd, buf, DB_PAGE_SIZE, pgno * DB_PAGE_SIZE) != DB_PAGE_SIZE)
+		return 0;
+
+	if (memcmp(mh->signature, PAGED_SIGNATURE, sizeof(mh->signature)))
+		return 0;
+
+	v = mh->version & BT_VERSION_MASK;
+	if (v > VERSION_CODE || (mh->version & ~BT_VERSION_MASK & ~BT_FLAGS) ||
+			mh->page_size != DB_PAGE_SIZE) {
+		syslog(LOG_ERR, "Database is not supported. Please upgrade the software");
+		return 0;
+	}
+
+	if (v >= CHECKSUM_VERSION_CODE && !bt_page_intact(buf)) {
+		syslog(LOG_ERR, "Meta page %llu is damaged, checksum mismatch", pgno);
+		return 0;
+	}
+
+	if (v >= ENVELOPE_VERSION_CODE) {
+		memcpy(keys, buf + off, sizeof(keys));
+		off += sizeof(keys);
+		if (!bt_unlock(keys))
+			return 0;
+	} else if (v >= KDF_VERSION_CODE) {
+		memcpy(&kdf, buf + off, sizeof(kdf));
+		off += sizeof(kdf);
+		if (!bt_derive(&kdf))
+			return 0;
+	} else {
+		bt_plain_key();
+	}
+
+	bt_meta_aad(aad, pgno, mh->version);
+	if (!open_data((unsigned char *) meta, buf + off, sizeof(*meta) + SEAL_OVERHEAD,
+			aad, sizeof(aad), db_key))
+		return 0;
+
+	*version = v;
+	*flags = mh->version & ~BT_VERSION_MASK;
+
+	return 1;
+}
+
+/* Tell a paged database from a 0x101 one, whose first bytes are ciphertext */
+int bt_probe(char *path) {
+	struct bt_meta_hdr mh;
+	int fd, i, rv = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	for (i = 0; i < 2 && !rv; i++) {
+		if (pread(fd, &mh, sizeof(mh), i * DB_PAGE_SIZE) == sizeof(mh) &&
+				!memcmp(mh.signature, PAGED_SIGNATURE, sizeof(mh.signature)))
+			rv = 1;
+	}
+
+	close(fd);
+
+	return rv;
+}
+
+static void bt_reset(char *path) {
+	bt_flush_cache(1);
+	bt_free.count = 0;
+	bt_pending.count = 0;
+	bt_reused.count = 0;
+
+	if (bt_path != path) {
+		free(bt_path);
+		bt_path = strdup(path);
+	}
+}
+
+int bt_open(char *path) {
+	struct bt_meta m[2];
+	unsigned int version[2], flags[2];
+	int ok[2], i;
+
+	bt_reset(path);
+	if (!bt_path) {
+		syslog(LOG_ERR, "No memory");
+		return 0;
+	}
+
+	/* a key left from another passphrase must not be taken */
+	memset(&bt_kdf, 0, sizeof(bt_kdf));
+	memset(bt_keys, 0, sizeof(bt_keys));
+	bt_slot = -1;
+
+	bt_fd = open(bt_path, O_RDONLY);
+	if (bt_fd < 0) {
+		syslog(LOG_ERR, "Can not open database file: %s", strerror(errno));
+		return 0;
+	}
+
+	for (i = 0; i < 2; i++)
+		ok[i] = bt_read_meta(i, &m[i], &version[i], &flags[i]);
+
+	close(bt_fd);
+	bt_fd = -1;
+
+	if (!ok[0] && !ok[1])
+		return 0;
+
+	i = (ok[0] && (!ok[1] || m[0].txn > m[1].txn)) ? 0 : 1;
+	bt_meta = m[i];
+	bt_version = version[i];
+	bt_flags = flags[i];
+	bt_committed = bt_meta;
+
+	memset(m, 0, sizeof(m));
+
+	return 1;
+}
+
+int bt_create(char *path) {
+	unsigned char zero[DB_PAGE_SIZE];
+
+	bt_reset(path);
+	if (!bt_path) {
+		syslog(LOG_ERR, "No memory");
+		return 0;
+	}
+
+	bt_fd = open(bt_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (bt_fd < 0) {
+		syslog(LOG_ERR, "Can not create database file: %s", strerror(errno));
+		return 0;
+	}
+
+	memset(&bt_meta, 0, sizeof(bt_meta));
+	bt_version = VERSION_CODE;
+	bt_flags = BT_FLAG_DEFLATE;
+	bt_meta.txn = 1;
+	bt_meta.npages = BT_FIRST_PAGE;
+
+	memset(zero, 0, sizeof(zero));
+	if (pwrite(bt_fd, zero, DB_PAGE_SIZE, 0) != DB_PAGE_SIZE || !bt_write_meta(bt_keys) ||
+			fdatasync(bt_fd) < 0) {
+		syslog(LOG_ERR, "Can not initialize database file");
+		close(bt_fd);
+		bt_fd = -1;
+		return 0;
+	}
+
+	close(bt_fd);
+	bt_fd = -1;
+	bt_committed = bt_meta;
+
+	return 1;
+}
+
+/* Point the pager to the new name of its (renamed) file */
+int bt_rename(char *path) {
+	char *p;
+
+	p = strdup(path);
+	if (!p) {
+		syslog(LOG_ERR, "No memory");
+		return 0;
+	}
+
+	free(bt_path);
+	bt_path = p;
+
+	return 1;
+}
+
+int bt_begin(void) {
+	if (bt_fd >= 0)
+		return 1;
+
+	bt_fd = open(bt_path, O_RDWR);
+	if (bt_fd < 0) {
+		syslog(LOG_ERR, "Can not open database file: %s", strerror(errno));
+		return 0;
+	}
+
+	bt_committed = bt_meta;
+	bt_pending.count = 0;
+	bt_reused.count = 0;
+
+	return 1;
+}
+
+/* Forget everything done since bt_begin() and close the file */
+void bt_abort(void) {
+	unsigned int i;
+
+	bt_flush_cache(0);
+
+	for (i = 0; i < bt_reused.count; i++)
+		pg_push(&bt_free, bt_reused.pg[i]);
+
+	bt_pending.count = 0;
+	bt_reused.count = 0;
+	bt_meta = bt_committed;
+
+	if (bt_fd >= 0) {
+		close(bt_fd);
+		bt_fd = -1;
+	}
+}
+
+static int pg_cmp(const void *a, const void *b) {
+	unsigned long long x = (*(struct bt_page **) a)->pgno, y = (*(struct bt_page **) b)->pgno;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Seal the pages BT_CRYPT_BATCH at a time and write them out */
+static int bt_write_dirty(struct bt_page **dirty, unsigned int n) {
+	unsigned long long pgno[BT_CRYPT_BATCH];
+	unsigned char *plain[BT_CRYPT_BATCH], *sealed;
+	struct bt_crypt bc;
+	unsigned int i, j, k;
+
+	if (!n)
+		return 1;
+
+	k = n < BT_CRYPT_BATCH ? n : BT_CRYPT_BATCH;
+	sealed = malloc((size_t) k * DB_PAGE_SIZE);
+	if (!sealed) {
+		syslog(LOG_ERR, "Memory allocation error");
+		return 0;
+	}
+
+	bc.pgno = pgno;
+	bc.plain = plain;
+	bc.sealed = sealed;
+	bc.seal = 1;
+
+	for (i = 0; i < n; i += k) {
+		k = n - i < BT_CRYPT_BATCH ? n - i : BT_CRYPT_BATCH;
+		for (j = 0; j < k; j++) {
+			pgno[j] = dirty[i + j]->pgno;
+			plain[j] = dirty[i + j]->data;
+		}
+
+		bc.n = k;
+		if (!bt_crypt_run(&bc) || !bt_write_batch(pgno, k, sealed)) {
+			free(sealed);
+			return 0;
+		}
+	}
+
+	free(sealed);
+
+	return 1;
+}
+
+/* The meta page gets 'keys' as its key slots */
+static int bt_commit_keys(unsigned long long journal_seq, unsigned long long next_id,
+		struct bt_keyslot *keys) {
+	struct bt_page **dirty, *pg;
+	unsigned int i, n = 0, max = 64;
+
+	if (bt_fd < 0)
+		return 0;
+
+	dirty = malloc(max * sizeof(*dirty));
+	if (!dirty) {
+		syslog(LOG_ERR, "Memory allocation error");
+		bt_abort();
+		return 0;
+	}
+
+	for (i = 0; i < BT_CACHE_SIZE; i++) {
+		for (pg = bt_cache[i]; pg; pg = pg->next) {
+			if (!pg->dirty)
+				continue;
+
+			if (n == max) {
+				struct bt_page **tmp;
+
+				max *= 2;
+				tmp = realloc(dirty, max * sizeof(*dirty));
+				if (!tmp) {
+					syslog(LOG_ERR, "Memory allocation error");
+					free(dirty);
+					bt_abort();
+					return 0;
+				}
+				dirty = tmp;
+			}
+			dirty[n++] = pg;
+		}
+	}
+
+	qsort(dirty, n, sizeof(*dirty), pg_cmp);
+	if (!bt_write_dirty(dirty, n)) {
+		free(dirty);
+		bt_abort();
+		return 0;
+	}
+
+	/* pages must be on disk before the meta block points to them */
+	if (fdatasync(bt_fd) < 0) {
+		syslog(LOG_ERR, "Can't sync database: %s", strerror(errno));
+		free(dirty);
+		bt_abort();
+		return 0;
+	}
+
+	bt_meta.txn++;
+	bt_meta.journal_seq = journal_seq;
+	bt_meta.next_id = next_id;
+
+	if (!bt_write_meta(keys) || fdatasync(bt_fd) < 0) {
+		free(dirty);
+		bt_abort();
+		return 0;
+	}
+
+	for (i = 0; i < n; i++)
+		dirty[i]->dirty = 0;
+
+	free(dirty);
+
+	for (i = 0; i < bt_pending.count; i++)
+		pg_push(&bt_free, bt_pending.pg[i]);
+
+	bt_pending.count = 0;
+	bt_reused.count = 0;
+	bt_flush_cache(0);
+
+	bt_committed = bt_meta;
+	close(bt_fd);
+	bt_fd = -1;
+
+	return 1;
+}
+
+int bt_commit(unsigned long long journal_seq, unsigned long long next_id) {
+	return bt_commit_keys(journal_seq, next_id, bt_keys);
+}
+
+/*
+ * Seal the key under 'pass' in the slot 'old' opens. The new slots are
+ * published like any change, by commits that carry nothing else: the
+ * first goes to the meta page that is not current, the second replaces
+ * the other copy, which the old passphrase would still open. Neither
+ * frees a page, so falling back to an older copy finds the same tree.
+ * The writer must be idle.
+ */
+int bt_passwd(char *old, char *pass) {
+	struct bt_keyslot keys[BT_KEY_SLOTS];
+	unsigned char key[DB_KEY_LEN];
+	int i;
+
+	if (bt_version < ENVELOPE_VERSION_CODE || bt_slot < 0) {
+		syslog(LOG_ERR, "Database has no key slots");
+		return 0;
+	}
+
+	for (i = 0; i < BT_KEY_SLOTS; i++) {
+		if (bt_keys[i].kdf.alg != KDF_NONE && bt_unwrap(&bt_keys[i], old, key) &&
+				!CRYPTO_memcmp(key, db_key, sizeof(key)))
+			break;
+	}
+	memset(key, 0, sizeof(key));
+
+	if (i == BT_KEY_SLOTS) {
+		syslog(LOG_ERR, "Invalid passphrase");
+		return 0;
+	}
+
+	memcpy(keys, bt_keys, sizeof(keys));
+	if (!bt_wrap(&keys[i], pass, db_key))
+		return 0;
+
+	if (!bt_begin() || !bt_commit_keys(bt_meta.journal_seq, bt_meta.next_id, keys))
+		return 0;
+
+	memcpy(bt_keys, keys, sizeof(bt_keys));
+	bt_slot = i;
+
+	if (!bt_begin() || !bt_commit(bt_meta.journal_seq, bt_meta.next_id)) {
+		syslog(LOG_ERR, "Can not write the second meta page, the old passphrase "
+			"still opens the previous transaction");
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Pager state of a vault that is not the current one */
+struct bt_state {
+	struct bt_meta meta, committed;
+	unsigned int version, flags;
+	struct bt_kdf kdf;
+	struct bt_keyslot keys[BT_KEY_SLOTS];
+	int slot;
+	unsigned char key[DB_KEY_LEN];
+	char *path;
+	int fd;
+	struct bt_page *cache[BT_CACHE_SIZE];
+	struct pg_list free, pending, reused;
+};
+
+/* Move the pager state into the vault, leaving a closed pager behind */
+int bt_park(struct vault *v) {
+	struct bt_state *s = v->bt;
+
+	if (!s) {
+		s = secure_alloc(sizeof(*s));
+		if (!s) {
+			syslog(LOG_ERR, "No memory");
+			return 0;
+		}
+		v->bt = s;
+	}
+
+	s->meta = bt_meta;
+	s->committed = bt_committed;
+	s->version = bt_version;
+	s->flags = bt_flags;
+	s->kdf = bt_kdf;
+	memcpy(s->keys, bt_keys, sizeof(bt_keys));
+	s->slot = bt_slot;
+	memcpy(s->key, db_key, sizeof(db_key));
+	s->path = bt_path;
+	s->fd = bt_fd;
+	memcpy(s->cache, bt_cache, sizeof(bt_cache));
+	s->free = bt_free;
+	s->pending = bt_pending;
+	s->reused = bt_reused;
+
+	memset(&bt_meta, 0, sizeof(bt_meta));
+	memset(&bt_committed, 0, sizeof(bt_committed));
+	bt_version = VERSION_CODE;
+	bt_flags = 0;
+	memset(&bt_kdf, 0, sizeof(bt_kdf));
+	memset(bt_keys, 0, sizeof(bt_keys));
+	bt_slot = -1;
+	memset(db_key, 0, sizeof(db_key));
+	bt_path = NULL;
+	bt_fd = -1;
+	memset(bt_cache, 0, sizeof(bt_cache));
+	memset(&bt_free, 0, sizeof(bt_free));
+	memset(&bt_pending, 0, sizeof(bt_pending));
+	memset(&bt_reused, 0, sizeof(bt_reused));
+
+	return 1;
+}
+
+void bt_resume(struct vault *v) {
+	struct bt_state *s = v->bt;
+
+	bt_meta = s->meta;
+	bt_committed = s->committed;
+	bt_version = s->version;
+	bt_flags = s->flags;
+	bt_kdf = s->kdf;
+	memcpy(bt_keys, s->keys, sizeof(bt_keys));
+	bt_slot = s->slot;
+	memcpy(db_key, s->key, sizeof(db_key));
+	bt_path = s->path;
+	bt_fd = s->fd;
+	memcpy(bt_cache, s->cache, sizeof(bt_cache));
+	bt_free = s->free;
+	bt_pending = s->pending;
+	bt_reused = s->reused;
+}
+
+/* Drop everything the pager holds */
+void bt_close(void) {
+	bt_abort();
+	bt_flush_cache(1);
+
+	free(bt_free.pg);
+	free(bt_pending.pg);
+	free(bt_reused.pg);
+	memset(&bt_free, 0, sizeof(bt_free));
+	memset(&bt_pending, 0, sizeof(bt_pending));
+	memset(&bt_reused, 0, sizeof(bt_reused));
+
+	free(bt_path);
+	bt_path = NULL;
+	memset(&bt_meta, 0, sizeof(bt_meta));
+	memset(&bt_committed, 0, sizeof(bt_committed));
+	bt_version = VERSION_CODE;
+	bt_flags = 0;
+	memset(&bt_kdf, 0, sizeof(bt_kdf));
+	memset(bt_keys, 0, sizeof(bt_keys));
+	bt_slot = -1;
+	memset(db_key, 0, sizeof(db_key));
+}
@@ -0,0 +1,159 @@
+/*
+ * opm - Open Password Manager.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Alexander Miroch
+ *    Email: <alexander.miroch@gmail.com>
+ */
+
+/*
+ * CRC32C (Castagnoli), with the crc32 instructions of SSE 4.2 or ARMv8
+ * when the CPU has them and a slice-by-8 table otherwise.
+ */
+
+#include "opm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_HW_CRC
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#define HAVE_HW_CRC
+#endif
+
+#define CRC32C_POLY	0x82f63b78
+
+static unsigned int crc_table[8][256];
+static unsigned int (*crc_update)(unsigned int, const unsigned char *, size_t);
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static unsigned int crc_sw(unsigned int crc, const unsigned char *p, size_t len) {
+	unsigned long long w;
+
+	for (; len && ((unsigned long) p & 7); len--)
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&w, p, sizeof(w));
+		w ^= crc;
+		crc = crc_table[7][w & 0xff] ^
+			crc_table[6][(w >> 8) & 0xff] ^
+			crc_table[5][(w >> 16) & 0xff] ^
+			crc_table[4][(w >> 24) & 0xff] ^
+			crc_table[3][(w >> 32) & 0xff] ^
+			crc_table[2][(w >> 40) & 0xff] ^
+			crc_table[1][(w >> 48) & 0xff] ^
+			crc_table[0][w >> 56];
+	}
+
+	for (; len; len--)
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+static unsigned int crc_hw(unsigned int crc, const unsigned char *p, size_t len) {
+	unsigned int w;
+
+	for (; len && ((unsigned long) p & 3); len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+#ifdef __x86_64__
+	{
+		unsigned long long c = crc, q;
+
+		for (; len >= 8; len -= 8, p += 8) {
+			memcpy(&q, p, sizeof(q));
+			c = _mm_crc32_u64(c, q);
+		}
+		crc = (unsigned int) c;
+	}
+#endif
+
+	for (; len >= 4; len -= 4, p += 4) {
+		memcpy(&w, p, sizeof(w));
+		crc = _mm_crc32_u32(crc, w);
+	}
+
+	for (; len; len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+
+static int crc_hw_supported(void) {
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static unsigned int crc_hw(unsigned int crc, const unsigned char *p, size_t len) {
+	unsigned long long q;
+
+	for (; len && ((unsigned long) p & 7); len--)
+		crc = __crc32cb(crc, *p++);
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&q, p, sizeof(q));
+		crc = __crc32cd(crc, q);
+	}
+
+	for (; len; len--)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+
+static int crc_hw_supported(void) {
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+static void crc_init(void) {
+	unsigned int i, j, c;
+
+	for (i = 0; i < 256; i++) {
+		for (c = i, j = 0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc_table[0][i] = c;
+	}
+
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++)
+			crc_table[j][i] = crc_table[0][crc_table[j - 1][i] & 0xff] ^ (crc_table[j - 1][i] >> 8);
+	}
+
+	crc_update = crc_sw;
+#ifdef HAVE_HW_CRC
+	if (crc_hw_supported())
+		crc_update = crc_hw;
+#endif
+}
+
+/* crc is 0 to start with or the result for the data before */
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len) {
+	pthread_once(&crc_once, crc_init);
+
+	return ~crc_update(~crc, buf, len);
+}
+
+int crc32c_hw(void) {
+	pthread_once(&crc_once, crc_init);
+
+	return crc_update != crc_sw;
+}
@@ -23,7 +23,32 @@
 
 pid_t xdaemon_pid;
 int pfd;
-int (*handlers[PT_MAX])(void *, int);
+int (*handlers[PT_MAX])(void *, unsigned int, int);
+
+/*
+ * Group commit: journal records queue up until no other client is
+ * waiting to be served and commit_window milliseconds have passed
+ * since the first of them, or commit_ops records are queued. Then the
+ * group goes to the writer thread. Clients whose requests were
+ * journaled wait here for their OK until their generation is written,
+ * or synced with the "always" fsync policy.
+ */
+unsigned int commit_window = DEFAULT_COMMIT_WINDOW;
+unsigned int commit_ops = DEFAULT_COMMIT_OPS;
+
+struct waiter {
+	int csk;
+	int durable;	/* PT_DURABLE, reply with the durable generation */
+	unsigned long long seq;
+};
+
+static struct waiter *waiters = NULL;
+static unsigned int num_waiters = 0, max_waiters = 0;
+static struct timespec batch_start;
+
+/* Set by pt_durable() for handle_client() */
+static unsigned long long durable_request = 0;
+static int durable_requested = 0;
 
 void init_handlers(void) {
 	int i;
@@ -37,12 +62,32 @@ void init_handlers(void) {
 	handlers[PT_GET_DB] = pt_get_db;
 	handlers[PT_STOP] = pt_stop;
 	handlers[PT_COPY] = pt_copy;
+	handlers[PT_GET_ID] = pt_get_id;
+	handlers[PT_UPDATE_ID] = pt_update_id;
+	handlers[PT_REMOVE_ID] = pt_remove_id;
+	handlers[PT_FUZZY] = pt_fuzzy;
+	handlers[PT_DURABLE] = pt_durable;
+	handlers[PT_IMPORT] = pt_import;
+	handlers[PT_EXPORT] = pt_export;
+	handlers[PT_OPEN] = pt_open;
+	handlers[PT_VAULTS] = pt_vaults;
+	handlers[PT_CLOSE] = pt_close;
+	handlers[PT_HISTORY] = pt_history;
+	handlers[PT_RESTORE] = pt_restore;
+	handlers[PT_PASSWD] = pt_passwd;
 }
 
-int pt_stop(void *data, int csk) {
+/* Requests that are not for a particular vault */
+static int is_global(unsigned int type) {
+	return type == PT_OPEN || type == PT_VAULTS || type == PT_STOP || type == PT_COPY;
+}
+
+int pt_stop(void *data, unsigned int len, int csk) {
 	
 	syslog(LOG_INFO, "Stop signal received");
 
+	vault_sync_all();
+
 	syslog(LOG_INFO, "Stopping %d",xdaemon_pid);
 	if (xdaemon_pid)
 		kill(xdaemon_pid, SIGTERM);
@@ -50,13 +95,39 @@ int pt_stop(void *data, int csk) {
 	exit(0);
 }
 
-int pt_copy(void *data, int csk) {
+/* Wait until the given generation (0 - everything so far) is synced */
+int pt_durable(void *data, unsigned int len, int csk) {
+	unsigned long long seq = 0;
+
+	if (len && (len != sizeof(seq) || !data)) {
+		syslog(LOG_ERR, "Invalid generation received");
+		return 0;
+	}
+
+	if (len)
+		memcpy(&seq, data, sizeof(seq));
+
+	if (!seq || seq > journal_seq)
+		seq = journal_seq;
+
+	durable_request = seq;
+	durable_requested = 1;
+
+	return 1;
+}
+
+int pt_copy(void *data, unsigned int size, int csk) {
 	char *password = (char *) data;
 	int len;
 
 	if (!xdaemon_pid)	
 		return 1;
 
+	if (!size || size > MAX_RECORD_LEN || password[size - 1] != '\0') {
+		syslog(LOG_ERR, "Invalid password");
+		return 0;
+	}
+
 	len = strlen(password);
 	if (!len) {
 		syslog(LOG_ERR, "Invalid password");
@@ -126,12 +197,85 @@ int is_daemon_started(void) {
 	return 1;
 }
 
+static long elapsed_ms(struct timespec *since) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/* The reply is sent by answer_waiters() */
+static int add_waiter(int csk, unsigned long long seq, int durable) {
+	struct waiter *tmp;
+
+	if (num_waiters == max_waiters) {
+		max_waiters = max_waiters ? max_waiters * 2 : 16;
+		tmp = realloc(waiters, max_waiters * sizeof(struct waiter));
+		if (!tmp) {
+			syslog(LOG_ERR, "Can't alloc memory");
+			max_waiters = num_waiters;
+			return 0;
+		}
+		waiters = tmp;
+	}
+
+	waiters[num_waiters].csk = csk;
+	waiters[num_waiters].seq = seq;
+	waiters[num_waiters].durable = durable;
+	num_waiters++;
+
+	return 1;
+}
+
+/* Hand the queued journal records to the writer */
+void group_commit(void) {
+	writer_journal();
+}
+
+void answer_waiters(void) {
+	unsigned long long written, durable, failed, done;
+	struct waiter *w;
+	unsigned int i, j, len = sizeof(done);
+
+	if (writer_status(&written, &durable, &failed)) {
+		writer_wait_idle();
+		db_compact();
+	}
+
+	for (i = 0, j = 0; i < num_waiters; i++) {
+		w = &waiters[i];
+		done = (w->durable || fsync_policy == FSYNC_ALWAYS) ? durable : written;
+
+		if (w->seq <= done) {
+			if (!w->durable || (send_reply(w->csk, &len, sizeof(len)) &&
+					send_reply(w->csk, &done, sizeof(done))))
+				send_ok(w->csk);
+		} else if (w->seq <= failed) {
+			send_error(w->csk);
+		} else {
+			waiters[j++] = *w;
+			continue;
+		}
+
+		close(w->csk);
+	}
+
+	num_waiters = j;
+}
+
 void start_daemon(void) {
 	struct sockaddr_un addr;
+	struct pollfd fds[2];
 	int fd, csk, pfds[2];
 	int is_db_new = 0;
+	long timeout;
 
 	*password = 0;
+	secure_lock(password, sizeof(password));
+
+	search_init();
+	db_init();
 
 	is_db_new = access(database_file, 0) ? 1 : 0;
 	ask_password(is_db_new);
@@ -141,9 +285,14 @@ void start_daemon(void) {
 		exit(255);
 	}	
 
+	/* the daemon keeps the derived key only */
+	memset(password, 0, sizeof(password));
+
 	if (!do_daemon())
 		return;	
 
+	secure_relock();
+
 	xdaemon_pid = 0;
 	pfd = xdaemon(pfds, &xdaemon_pid);
 	if (!pfd) 
@@ -151,6 +300,10 @@ void start_daemon(void) {
 	
 
 	init_handlers();
+	bt_crypt_start();
+
+	if (!writer_start() || !vault_add(database_file))
+		exit(255);
 
 	fd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (fd < 0) {
@@ -176,7 +329,35 @@ void start_daemon(void) {
 	
 	}
 	
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = writer_fd;
+	fds[1].events = POLLIN;
+
 	while (1) {
+		timeout = -1;
+		if (journal_pending) {
+			timeout = (long) commit_window - elapsed_ms(&batch_start);
+			if (timeout < 0 || journal_pending >= commit_ops)
+				timeout = 0;
+		}
+
+		if (poll(fds, 2, timeout) < 0) {
+			if (errno != EINTR)
+				syslog(LOG_ERR, "Poll error: %s", strerror(errno));
+			continue;
+		}
+
+		if (fds[1].revents & POLLIN)
+			answer_waiters();
+
+		if (journal_pending && (journal_pending >= commit_ops ||
+				(!(fds[0].revents & POLLIN) && elapsed_ms(&batch_start) >= commit_window)))
+			group_commit();
+
+		if (!(fds[0].revents & POLLIN))
+			continue;
+
 		csk = accept(fd, NULL, NULL);
 		if (csk < 0) {
 			syslog(LOG_ERR, "Accept error: %s", strerror(errno));
@@ -184,7 +365,6 @@ void start_daemon(void) {
 		}
 
 		handle_client(csk);
-
 	}
 }
 
@@ -227,18 +407,22 @@ int stop_daemon(void) {
 
 void handle_client(int csk) {
 	ssize_t bytes;
-	unsigned int data[2];
+	unsigned int data[3];
+	struct vault *v;
 	unsigned char *buf = NULL;
-	int (*handler)(void *, int);
+	int (*handler)(void *, unsigned int, int);
+	unsigned long long seq;
+	unsigned int pending;
+	int rv;
 
-	bytes = recv(csk, (void *) data, sizeof(unsigned int) * 2, 0);
+	bytes = recv(csk, (void *) data, sizeof(data), MSG_WAITALL);
 	if (bytes < 0) {
 		syslog(LOG_ERR, "Handle client error: %s", strerror(errno));
 		close(csk);
 		return;
 	}
 
-	if (!bytes) {
+	if (bytes != sizeof(data)) {
 		close(csk);
 		return;
 	}
@@ -257,7 +441,7 @@ void handle_client(int csk) {
 	}
 
 	if (data[1] > 0) {
-		buf = malloc(sizeof(char) * data[1]);
+		buf = secure_alloc(data[1]);
 		if (!buf) {
 			syslog(LOG_ERR, "Can't alloc memory");
 			close(csk);
@@ -268,27 +452,59 @@ void handle_client(int csk) {
 		if (bytes < 0) {
 			syslog(LOG_ERR, "Handle client error: %s", strerror(errno));
 			close(csk);
-			free(buf);
+			secure_free(buf);
 			return;
 		}
 
-		if (!bytes) {
+		if (bytes != data[1]) {
 			syslog(LOG_ERR, "Client closed connection");
 			close(csk);
-			free(buf);
+			secure_free(buf);
 			return;
 		}
 	}
 
-	if (!handler(buf, csk)) {
+	if (!is_global(data[0]) && !vault_switch(data[2])) {
+		secure_free(buf);
+		send_error(csk);
+		close(csk);
+		return;
+	}
+
+	v = current_vault;
+	seq = journal_seq;
+	pending = journal_pending;
+	durable_requested = 0;
+	rv = handler(buf, data[1], csk);
+	secure_free(buf);
+
+	if (!rv) {
 		syslog(LOG_ERR, "Handler failed");
 		send_error(csk);
 		close(csk);
-		free(buf);
 		return;
 	}
 
-	send_ok(csk);
+	if (!pending && journal_pending)
+		clock_gettime(CLOCK_MONOTONIC, &batch_start);
+
+	if (durable_requested) {
+		group_commit();
+		writer_sync();
+		seq = durable_request;
+	} else if (journal_seq == seq || current_vault != v) {
+		send_ok(csk);
+		close(csk);
+		return;
+	} else {
+		seq = journal_seq;
+	}
+
+	/* the change is not on disk yet */
+	if (add_waiter(csk, seq, durable_requested))
+		return;
+
+	send_error(csk);
 	close(csk);
 }
 
@@ -335,8 +551,9 @@ int send_parcel(struct parcel *pc) {
 }
 
 int _send_parcel(int fd, struct parcel *pc) {
+	unsigned int hdr[3] = { pc->type, pc->length, vault_handle };
 	
-	if (send(fd, (void *) pc, sizeof(unsigned int) * 2, 0) < 0) {
+	if (send(fd, (void *) hdr, sizeof(hdr), 0) < 0) {
 		close(fd);
 		return 0;
 	}
@@ -351,34 +568,22 @@ int _send_parcel(int fd, struct parcel *pc) {
 	return 1;
 }
 
-int _get_parcel(int fd, struct parcel *pc) {
-	unsigned int len;
-	char *data;
-	int rv;
-
-        rv = recv(fd, &len, sizeof(unsigned int), 0);
-        if (!rv)
-                return 0;
-
-	if (rv < 0)
+/*
+ * Read one frame of a streamed reply into buf (MAX_PARCEL_LEN bytes).
+ * An empty frame ends the reply.
+ */
+int _get_frame(int fd, unsigned char *buf, unsigned int *len) {
+	if (recv(fd, len, sizeof(unsigned int), MSG_WAITALL) != sizeof(unsigned int))
 		return 0;
 
-	pc->length = len;
-	pc->type = PT_REPLY;
-	if (pc->length > 0) {
-		if (pc->length > MAX_PARCEL_LEN) {
-			fprintf(stderr, "Invalid reply\n");
-			return 0;
-		}
-
-		rv = recv(fd, pc->data, pc->length, MSG_WAITALL);
-		if (!rv) 
-			return 0;
-
-		if (rv < 0)
-			return 0;
+	if (*len > MAX_PARCEL_LEN) {
+		fprintf(stderr, "Invalid reply\n");
+		return 0;
 	}
 
+	if (*len && recv(fd, buf, *len, MSG_WAITALL) != *len)
+		return 0;
+
 	return 1;
 }
 
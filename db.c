@@ -22,44 +22,661 @@
 #include "opm.h"
 
 char *database_file = NULL;
-char *mapped_db = NULL;
-struct db_header *dh = NULL;
+unsigned long long next_entry_id = 1;
 
-void init_header(void) {
+/*
+ * Entries are kept encoded (see record.c) back to back in the cold
+ * arena, the record table maps slots to them. Searches only need the
+ * name and the login, which are copied to the hot arena as two
+ * zero-terminated strings, so a scan never pulls passwords and notes
+ * through the cache. Replaced and removed records leave garbage behind
+ * which is squeezed out once it dominates.
+ */
+struct db_record *records = NULL;
+unsigned int num_records = 0;
+
+struct db_arena {
+	unsigned char *buf;
+	unsigned int len, size, garbage;
+};
+
+/* Hot part of a slot: name at off, login right after it */
+struct db_hot {
+	unsigned int off;
+	unsigned short name_len, login_len;
+};
+
+static unsigned int records_capacity = 0;
+static struct db_arena cold = { NULL, 0, 0, 0 }, hot = { NULL, 0, 0, 0 };
+static struct db_hot *hot_fields = NULL;
+
+/* Free slots, most recently freed on top */
+static unsigned int *free_slots = NULL;
+static unsigned int num_free = 0, max_free = 0;
+
+/* Percentage of removed entries that triggers compaction, 0 disables it */
+unsigned int compact_ratio = DEFAULT_COMPACT_RATIO;
+
+/* Whole 0x101 database, only alive while it is being converted */
+static struct db_header *dh = NULL;
+static char *mapped_db = NULL;
+
+/*
+ * Entries changed since the last checkpoint, slot is -1 for removals
+ * and -2 for revisions, which are kept in rev.
+ */
+struct db_change {
+	unsigned long long id;
+	int slot;
+	unsigned char *rev;
+	unsigned int rev_len;
+};
+
+static struct db_change *changes = NULL;
+static unsigned int num_changes = 0, max_changes = 0;
+
+/* Batches of the import session of the vault, see pt_import() */
+static unsigned char *import_stage = NULL;
+static unsigned int import_len = 0, import_size = 0, import_session = 0;
+static int import_open = 0;
+
+/*
+ * Secret parts read for lazy slots, by id. Whether the database file
+ * has been opened for reading them.
+ */
+struct secret_cache {
+	unsigned long long id;
+	unsigned int len;
+	unsigned char rec[MAX_RECORD_LEN];
+};
 
-	dh = (struct db_header *) malloc(sizeof(struct db_header));
-	if (!dh) {
-		syslog(LOG_ERR, "Cant alloc memory");
-		exit(1);
+static struct secret_cache secrets[SECRET_CACHE_SIZE];
+static int secrets_open = 0;
+
+static int change_add(unsigned long long id, int slot) {
+	struct db_change *tmp;
+
+	if (num_changes == max_changes) {
+		max_changes = max_changes ? max_changes * 2 : 256;
+		tmp = realloc(changes, max_changes * sizeof(struct db_change));
+		if (!tmp) {
+			syslog(LOG_ERR, "Memory allocation error");
+			return 0;
+		}
+		changes = tmp;
 	}
 
-	strncpy(dh->signature, DATABASE_SIGNATURE, strlen(DATABASE_SIGNATURE));
-	dh->version = VERSION_CODE;
-	dh->num_entries = 0;
-	dh->entry_size = sizeof(struct db_entry);
+	changes[num_changes].id = id;
+	changes[num_changes].slot = slot;
+	changes[num_changes].rev = NULL;
+	num_changes++;
+
+	return 1;
 }
 
-int load_database(int is_db_new) {
-	FILE *f;
-	unsigned int size ;
-	char *p;
+/* Room for 'n' more changes, none of them can fail then */
+static int change_reserve(unsigned int n) {
+	struct db_change *tmp;
+	unsigned int max = max_changes ? max_changes : 256;
 
-	if (!database_file)
+	while (max < num_changes + n)
+		max *= 2;
+
+	if (max == max_changes)
+		return 1;
+
+	tmp = realloc(changes, max * sizeof(struct db_change));
+	if (!tmp) {
+		syslog(LOG_ERR, "Memory allocation error");
 		return 0;
+	}
 
-	if (is_db_new) {
-		if (!creat(database_file, 0)) {
-			syslog(LOG_ERR, "Can not create database file");
+	changes = tmp;
+	max_changes = max;
+
+	return 1;
+}
+
+static void import_drop(void) {
+	secure_free(import_stage);
+	import_stage = NULL;
+	import_len = import_size = 0;
+	import_open = 0;
+}
+
+static void free_revision(struct db_change *c) {
+	secure_free(c->rev);
+	c->rev = NULL;
+}
+
+static void drop_revisions(void) {
+	unsigned int i, j;
+
+	for (i = 0, j = 0; i < num_changes; i++) {
+		if (changes[i].slot == -2)
+			free_revision(&changes[i]);
+		else
+			changes[j++] = changes[i];
+	}
+
+	num_changes = j;
+}
+
+static void arena_free(struct db_arena *a) {
+	secure_free(a->buf);
+	a->buf = NULL;
+	a->len = a->size = a->garbage = 0;
+}
+
+void init_records(void) {
+	memset(secrets, 0, sizeof(secrets));
+	arena_free(&cold);
+	arena_free(&hot);
+
+	free(records);
+	free(hot_fields);
+	records = NULL;
+	hot_fields = NULL;
+	num_records = records_capacity = 0;
+	num_free = 0;
+	id_index_clear();
+}
+
+struct db_state {
+	unsigned long long next_id;
+	struct db_record *records;
+	unsigned int num_records, capacity;
+	struct db_arena cold, hot;
+	struct db_hot *hot_fields;
+	unsigned int *free_slots;
+	unsigned int num_free, max_free;
+	struct db_change *changes;
+	unsigned int num_changes, max_changes;
+	unsigned char *import_stage;
+	unsigned int import_len, import_size, import_session;
+	int import_open;
+};
+
+/* Move the entry table into the vault, see vault.c */
+int db_park(struct vault *v) {
+	struct db_state *s = v->db;
+
+	if (!s) {
+		s = malloc(sizeof(*s));
+		if (!s) {
+			syslog(LOG_ERR, "Memory allocation error");
 			return 0;
 		}
+		v->db = s;
+	}
+
+	s->next_id = next_entry_id;
+	s->records = records;
+	s->num_records = num_records;
+	s->capacity = records_capacity;
+	s->cold = cold;
+	s->hot = hot;
+	s->hot_fields = hot_fields;
+	s->free_slots = free_slots;
+	s->num_free = num_free;
+	s->max_free = max_free;
+	s->changes = changes;
+	s->num_changes = num_changes;
+	s->max_changes = max_changes;
+	s->import_stage = import_stage;
+	s->import_len = import_len;
+	s->import_size = import_size;
+	s->import_session = import_session;
+	s->import_open = import_open;
+
+	memset(secrets, 0, sizeof(secrets));
+	next_entry_id = 1;
+	records = NULL;
+	num_records = records_capacity = 0;
+	memset(&cold, 0, sizeof(cold));
+	memset(&hot, 0, sizeof(hot));
+	hot_fields = NULL;
+	free_slots = NULL;
+	num_free = max_free = 0;
+	changes = NULL;
+	num_changes = max_changes = 0;
+	import_stage = NULL;
+	import_len = import_size = import_session = 0;
+	import_open = 0;
+
+	return 1;
+}
+
+void db_resume(struct vault *v) {
+	struct db_state *s = v->db;
+
+	next_entry_id = s->next_id;
+	records = s->records;
+	num_records = s->num_records;
+	records_capacity = s->capacity;
+	cold = s->cold;
+	hot = s->hot;
+	hot_fields = s->hot_fields;
+	free_slots = s->free_slots;
+	num_free = s->num_free;
+	max_free = s->max_free;
+	changes = s->changes;
+	num_changes = s->num_changes;
+	max_changes = s->max_changes;
+	import_stage = s->import_stage;
+	import_len = s->import_len;
+	import_size = s->import_size;
+	import_session = s->import_session;
+	import_open = s->import_open;
+}
+
+/* Forget the current vault, unsaved changes are lost */
+void db_close(void) {
+	bt_close();
+	journal_close();
+	writer_covered(0);
+
+	init_records();
+	tg_clear();
+	tg_valid = 0;
+
+	drop_revisions();
+	import_drop();
+	free(free_slots);
+	free(changes);
+	free_slots = NULL;
+	changes = NULL;
+	max_free = 0;
+	num_changes = max_changes = 0;
+	next_entry_id = 1;
+}
+
+static int db_reserve(unsigned int slots) {
+	struct db_record *tmp;
+	struct db_hot *htmp;
+
+	if (slots <= records_capacity)
+		return 1;
+
+	if (slots < records_capacity * 2)
+		slots = records_capacity * 2;
+
+	tmp = realloc(records, slots * sizeof(struct db_record));
+	if (!tmp) {
+		syslog(LOG_ERR, "Memory allocation error");
+		return 0;
+	}
+	records = tmp;
+
+	htmp = realloc(hot_fields, slots * sizeof(struct db_hot));
+	if (!htmp) {
+		syslog(LOG_ERR, "Memory allocation error");
+		return 0;
+	}
+	hot_fields = htmp;
+
+	records_capacity = slots;
+
+	return 1;
+}
+
+static unsigned int hot_len(unsigned int slot) {
+	return hot_fields[slot].name_len + hot_fields[slot].login_len + 2;
+}
+
+/* Where the data of a live slot sits in the arena */
+static unsigned int *arena_ref(struct db_arena *a, unsigned int slot, unsigned int *len) {
+	if (a == &hot) {
+		*len = hot_len(slot);
+		return &hot_fields[slot].off;
+	}
+
+	*len = records[slot].len;
+	return &records[slot].off;
+}
+
+/* Move the arena to a buffer of 'size' bytes, wiping the old one */
+static int arena_move(struct db_arena *a, unsigned int size, int pack) {
+	unsigned char *tmp;
+	unsigned int i, off = 0, *ref, len;
+
+	tmp = secure_alloc(size);
+	if (!tmp) {
+		syslog(LOG_ERR, "Memory allocation error");
+		return 0;
+	}
+
+	if (!pack) {
+		memcpy(tmp, a->buf, a->len);
+		off = a->len;
+	} else {
+		for (i = 0; i < num_records; i++) {
+			if (!records[i].len)
+				continue;
+
+			ref = arena_ref(a, i, &len);
+			memcpy(tmp + off, a->buf + *ref, len);
+			*ref = off;
+			off += len;
+		}
+		a->garbage = 0;
+	}
+
+	secure_free(a->buf);
+	a->buf = tmp;
+	a->len = off;
+	a->size = size;
+
+	return 1;
+}
 
-		init_header();
-		mapped_db = ((unsigned char *) dh) + sizeof(struct db_header);
-		sync_db();
+static int arena_reserve(struct db_arena *a, unsigned int len) {
+	unsigned int size;
 
+	if (a->len + len <= a->size)
 		return 1;
+
+	if (a->garbage > ARENA_COMPACT_MIN && a->garbage > a->len / 2 &&
+			a->len - a->garbage + len <= a->size)
+		return arena_move(a, a->size, 1);
+
+	size = a->size ? a->size : ARENA_COMPACT_MIN;
+	while (size < a->len + len)
+		size *= 2;
+
+	return arena_move(a, size, 0);
+}
+
+/* Encode the index part of a record, the entry without its secrets */
+static unsigned int index_record(unsigned char *rec, unsigned int len, unsigned char *buf) {
+	struct db_entry de;
+
+	if (record_decode(rec, len, &de) != len)
+		return 0;
+
+	de.password = de.notes = "";
+
+	return record_encode(&de, buf, MAX_RECORD_LEN);
+}
+
+/*
+ * From VERSION_CODE 0x202 on an entry is stored as two records: the
+ * index part under its id and the secret part, only password and
+ * notes, under id | BT_SECRET. Unlocking reads just the leaves of the
+ * index parts, a secret part is read when it is asked for.
+ */
+int db_store(unsigned long long id, unsigned char *rec, unsigned int len) {
+	unsigned char buf[MAX_RECORD_LEN];
+	struct db_entry de;
+	unsigned int n;
+	int rv;
+
+	if (bt_version < SPLIT_VERSION_CODE)
+		return bt_put(id, rec, len);
+
+	n = index_record(rec, len, buf);
+	if (!n || !bt_put(id, buf, n))
+		return 0;
+
+	record_decode(rec, len, &de);
+	de.name = de.url = de.login = "";
+	n = record_encode(&de, buf, sizeof(buf));
+	rv = bt_put(id | BT_SECRET, buf, n);
+	memset(buf, 0, sizeof(buf));
+
+	return rv;
+}
+
+int db_unstore(unsigned long long id) {
+	if (bt_version < SPLIT_VERSION_CODE)
+		return bt_del(id);
+
+	return bt_del(id) && bt_del(id | BT_SECRET) && bt_del(id | BT_HISTORY);
+}
+
+/*
+ * Read the secret part of an entry into buf. The file stays open for
+ * more of them until secrets_close().
+ */
+static unsigned int db_secret(unsigned long long id, unsigned char *buf) {
+	struct secret_cache *sc = &secrets[id % SECRET_CACHE_SIZE];
+	struct db_entry de;
+	unsigned int len;
+
+	if (sc->len && sc->id == id) {
+		memcpy(buf, sc->rec, sc->len);
+		return sc->len;
+	}
+
+	if (!secrets_open) {
+		/* the writer thread must not be in the middle of a checkpoint */
+		writer_wait_idle();
+		if (!bt_begin())
+			return 0;
+		secrets_open = 1;
+	}
+
+	len = bt_get(id | BT_SECRET, buf);
+	if (!len || record_decode(buf, len, &de) != len) {
+		syslog(LOG_ERR, "Secret of entry %llu is missing", id);
+		return 0;
+	}
+
+	sc->id = id;
+	sc->len = len;
+	memcpy(sc->rec, buf, len);
+
+	return len;
+}
+
+static void secrets_close(void) {
+	if (secrets_open)
+		bt_abort();
+
+	secrets_open = 0;
+}
+
+/*
+ * The record of a slot, either in the arena or in buf. With 'full' the
+ * secret part of a lazy slot is read in, without it password and
+ * notes are left out.
+ */
+static unsigned int slot_record(unsigned int slot, int full, unsigned char *buf, unsigned char **rec) {
+	struct db_record *r = &records[slot];
+	unsigned char secret[MAX_RECORD_LEN];
+	struct db_entry de, sde;
+	unsigned int len;
+
+	*rec = cold.buf + r->off;
+	if (full ? !r->lazy : r->lazy)
+		return r->len;
+
+	*rec = buf;
+	if (!full)
+		return index_record(cold.buf + r->off, r->len, buf);
+
+	len = db_secret(r->id, secret);
+	if (!len)
+		return 0;
+
+	record_decode(cold.buf + r->off, r->len, &de);
+	record_decode(secret, len, &sde);
+	de.password = sde.password;
+	de.notes = sde.notes;
+	len = record_encode(&de, buf, MAX_RECORD_LEN);
+	memset(secret, 0, sizeof(secret));
+
+	return len;
+}
+
+/* The whole record of a live slot, copied into buf */
+unsigned int db_full_record(int slot, unsigned char *buf) {
+	unsigned char *rec;
+	unsigned int len;
+
+	len = slot_record(slot, 1, buf, &rec);
+	secrets_close();
+
+	if (len && rec != buf)
+		memcpy(buf, rec, len);
+
+	return len;
+}
+
+/*
+ * Read the revisions of an entry into buf, see history.c. Those not
+ * checkpointed yet are written into the file first.
+ */
+int db_history(unsigned long long id, unsigned char *buf, unsigned int *len) {
+	if (!sync_db())
+		return 0;
+
+	writer_wait_idle();
+	if (!bt_begin())
+		return 0;
+
+	*len = bt_get(id | BT_HISTORY, buf);
+	bt_abort();
+
+	return 1;
+}
+
+static int load_entry(unsigned long long id, unsigned char *val, unsigned int len) {
+	unsigned char buf[MAX_RECORD_LEN];
+	struct db_entry de;
+	int rv;
+
+	if (bt_version == FIXED_RECORD_VERSION_CODE) {
+		if (len != sizeof(struct db_entry_v1)) {
+			syslog(LOG_ERR, "Database is corrupted");
+			return 0;
+		}
+
+		len = record_from_v1((struct db_entry_v1 *) val, buf);
+		rv = db_put_slot(num_records, id, buf, len);
+		memset(buf, 0, sizeof(buf));
+
+		return rv;
+	}
+
+	if (record_decode(val, len, &de) != len) {
+		syslog(LOG_ERR, "Database is corrupted");
+		return 0;
+	}
+
+	if (!db_put_slot(num_records, id, val, len))
+		return 0;
+
+	records[num_records - 1].lazy = bt_version >= SPLIT_VERSION_CODE;
+
+	return 1;
+}
+
+static int load_paged(void) {
+	unsigned long long seq;
+
+	if (!bt_open(database_file)) {
+		syslog(LOG_ERR, "Invalid passphrase or database is corrupted");
+		return 0;
+	}
+
+	journal_seq = seq = bt_meta.journal_seq;
+	next_entry_id = bt_meta.next_id;
+
+	if (!bt_begin())
+		return 0;
+
+	if (!journal_replay()) {
+		syslog(LOG_ERR, "Can not replay journal");
+		bt_abort();
+		return 0;
+	}
+
+	if (journal_seq != seq) {
+		if (!bt_commit(journal_seq, next_entry_id))
+			return 0;
+
+		journal_reset();
+		if (!bt_begin())
+			return 0;
+	}
+
+	init_records();
+	if (!db_reserve(bt_version < SPLIT_VERSION_CODE ? bt_meta.nkeys : bt_meta.nkeys / 2) ||
+			!bt_walk(0, BT_HISTORY, load_entry)) {
+		bt_abort();
+		return 0;
+	}
+
+	bt_abort();
+
+	if (bt_version < VERSION_CODE || bt_rekey_due())
+		return db_convert();
+
+	/* other costs only need the key slot sealed again */
+	if (bt_rewrap_due() && !bt_passwd((char *) password, (char *) password))
+		syslog(LOG_ERR, "Can not seal the database key with the new costs");
+
+	return 1;
+}
+
+static int legacy_reserve(unsigned int slots) {
+	unsigned char *tmp;
+
+	tmp = secure_realloc(dh, sizeof(struct db_header) + slots * sizeof(struct db_entry_v1));
+	if (!tmp) {
+		syslog(LOG_ERR, "Memory allocation error");
+		return 0;
+	}
+
+	dh = (struct db_header *) tmp;
+	mapped_db = tmp + sizeof(struct db_header);
+
+	return 1;
+}
+
+/* Journal records of 0x101 databases address the fixed-size slots */
+int legacy_put_slot(unsigned int slot, struct db_entry_v1 *de) {
+	if (!dh)
+		return 0;
+
+	if (slot >= dh->num_entries) {
+		if (!legacy_reserve(slot + 1))
+			return 0;
+
+		memset(mapped_db + dh->num_entries * sizeof(struct db_entry_v1), 0,
+			(slot + 1 - dh->num_entries) * sizeof(struct db_entry_v1));
+		dh->num_entries = slot + 1;
 	}
 
+	((struct db_entry_v1 *) mapped_db)[slot] = *de;
+
+	return 1;
+}
+
+int legacy_del_slot(unsigned int slot) {
+	if (!dh || slot >= dh->num_entries)
+		return 0;
+
+	memset(((struct db_entry_v1 *) mapped_db) + slot, 0, sizeof(struct db_entry_v1));
+
+	return 1;
+}
+
+static void legacy_free(void) {
+	secure_free(dh);
+	dh = NULL;
+	mapped_db = NULL;
+}
+
+static int load_legacy(void) {
+	unsigned char buf[MAX_RECORD_LEN];
+	struct db_entry_v1 *de;
+	FILE *f;
+	unsigned int size, i, len;
+	char *p;
+	int rv;
+
 	f = fopen(database_file, "r");
 	if (!f) {
 		syslog(LOG_ERR, "Can not open database file");
@@ -76,453 +693,1688 @@ int load_database(int is_db_new) {
 	fclose(f);
 
 	if (!size) {
-		init_header();
-		mapped_db = ((unsigned char *) dh) + sizeof(struct db_header);
-		return 1;
+		secure_free(p);
+		p = secure_alloc(sizeof(struct db_header));
+		if (!p) {
+			syslog(LOG_ERR, "Memory allocation error");
+			return 0;
+		}
+		size = sizeof(struct db_header);
+		memcpy(p, DATABASE_SIGNATURE, strlen(DATABASE_SIGNATURE));
+		((struct db_header *) p)->version = LEGACY_VERSION_CODE;
+	}
+
+	dh = (struct db_header *) p;
+	mapped_db = ((unsigned char *) dh) + sizeof(struct db_header);
+
+	if (strncmp(dh->signature, DATABASE_SIGNATURE, strlen(DATABASE_SIGNATURE))) {
+		syslog(LOG_ERR, "Invalid passphrase or database is corrupted");
+		goto err;
+	}
+
+	size -= sizeof(struct db_header);
+	if (size % sizeof(struct db_entry_v1) ||
+			dh->num_entries != (size / sizeof(struct db_entry_v1))) {
+		syslog(LOG_ERR, "Database is corrupted");
+		goto err;
+	}
+
+	if (dh->version > LEGACY_VERSION_CODE) {
+		syslog(LOG_ERR, "Database is not supported. Please upgrade the software");
+		goto err;
+	}
+
+	journal_seq = dh->journal_seq;
+	bt_plain_key();
+	if (!journal_replay()) {
+		syslog(LOG_ERR, "Can not replay journal");
+		goto err;
+	}
+
+	init_records();
+	de = (struct db_entry_v1 *) mapped_db;
+	for (i = 0; i < dh->num_entries; i++, de++) {
+		if (!de->name[0])
+			continue;
+
+		len = record_from_v1(de, buf);
+		rv = db_put_slot(num_records, 0, buf, len);
+		memset(buf, 0, sizeof(buf));
+		if (!rv)
+			goto err;
+	}
+
+	legacy_free();
+
+	return db_convert();
+err:
+	legacy_free();
+	return 0;
+}
+
+/* Build the search index once all entries have their ids */
+static void index_records(void) {
+	struct db_entry de;
+	unsigned int i;
+
+	tg_clear();
+	for (i = 0; i < num_records && tg_valid; i++) {
+		if (!db_decode_slot(i, &de))
+			continue;
+
+		de.id = records[i].id;
+		tg_add(&de);
+	}
+}
+
+int load_database(int is_db_new) {
+	char *p;
+	int rv;
+
+	if (!database_file)
+		return 0;
+
+	if (is_db_new) {
+		p = journal_path();
+		if (!p)
+			return 0;
+
+		unlink(p);
+		free(p);
+
+		if (!bt_rekey() || !bt_create(database_file)) {
+			syslog(LOG_ERR, "Can not create database file");
+			return 0;
+		}
+
+		init_records();
+		journal_seq = 0;
+		next_entry_id = 1;
+		tg_clear();
+
+		return 1;
+	}
+
+	if (bt_probe(database_file))
+		rv = load_paged();
+	else
+		rv = load_legacy();
+
+	if (rv)
+		index_records();
+
+	return rv;
+}
+
+static int id_cmp(const void *a, const void *b) {
+	unsigned long long x = records[*(unsigned int *) a].id, y = records[*(unsigned int *) b].id;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Read the secret parts of the lazy slots in, the file is about to go */
+static int load_secrets(void) {
+	unsigned char buf[MAX_RECORD_LEN], *rec;
+	unsigned int i, len;
+	int rv = 1;
+
+	for (i = 0; i < num_records && rv; i++) {
+		if (!records[i].len || !records[i].lazy)
+			continue;
+
+		len = slot_record(i, 1, buf, &rec);
+		rv = len && db_put_slot(i, records[i].id, buf, len);
+	}
+
+	secrets_close();
+	memset(buf, 0, sizeof(buf));
+
+	return rv;
+}
+
+/* Once they are in the file, keep just the index parts */
+static void drop_secrets(void) {
+	unsigned char buf[MAX_RECORD_LEN];
+	unsigned int i, len;
+
+	for (i = 0; i < num_records; i++) {
+		if (!records[i].len || records[i].lazy)
+			continue;
+
+		len = index_record(cold.buf + records[i].off, records[i].len, buf);
+		if (!len || !db_put_slot(i, records[i].id, buf, len))
+			break;
+		records[i].lazy = 1;
+	}
+}
+
+/*
+ * The revisions waiting for a checkpoint go into the new file right
+ * away, the journal they are in is reset after the rewrite.
+ */
+static int push_revisions(void) {
+	unsigned int i;
+
+	for (i = 0; i < num_changes; i++) {
+		if (changes[i].slot == -2 && id_index_get(changes[i].id) >= 0 &&
+				!history_push(changes[i].id, changes[i].rev, changes[i].rev_len))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Write the loaded entries into a new, densely packed paged file of
+ * the current version and replace the database with it. Entries coming
+ * from a 0x101 database get ids in slot order.
+ */
+static int db_rewrite(void) {
+	struct db_record *r;
+	unsigned int *order;
+	char *cp, *dir;
+	unsigned int i, n = 0;
+	int fd;
+
+	if (!load_secrets() || !history_save())
+		return 0;
+
+	order = malloc((num_records + 1) * sizeof(unsigned int));
+	if (!order) {
+		syslog(LOG_ERR, "No memory");
+		history_drop();
+		return 0;
+	}
+
+	for (i = 0; i < num_records; i++) {
+		if (!records[i].len)
+			continue;
+
+		if (!records[i].id) {
+			records[i].id = next_entry_id++;
+			if (!id_index_put(records[i].id, i)) {
+				free(order);
+				history_drop();
+				return 0;
+			}
+		}
+		order[n++] = i;
+	}
+
+	/* keys go in ascending so that leaves are filled up */
+	qsort(order, n, sizeof(unsigned int), id_cmp);
+
+	dir = strdup(database_file);
+	cp = malloc(strlen(database_file) + 14);
+	if (!dir || !cp) {
+		syslog(LOG_ERR, "No memory");
+		free(order);
+		free(dir);
+		free(cp);
+		history_drop();
+		return 0;
+	}
+
+	sprintf(cp, "%s/.opm.XXXXXX", dirname(dir));
+	free(dir);
+
+	fd = mkstemp(cp);
+	if (fd < 0) {
+		syslog(LOG_ERR, "Can't create tmp-file: %s", strerror(errno));
+		free(order);
+		free(cp);
+		history_drop();
+		return 0;
+	}
+
+	close(fd);
+
+	/* the old pages are all read, the new file can get a new key */
+	if ((bt_rekey_due() && !bt_rekey()) || !bt_create(cp) || !bt_begin())
+		goto err;
+
+	for (i = 0; i < n; i++) {
+		r = &records[order[i]];
+		if (!db_store(r->id, cold.buf + r->off, r->len)) {
+			bt_abort();
+			goto err;
+		}
+
+		if ((i + 1) % BT_BULK_BATCH)
+			continue;
+
+		if (!bt_commit(journal_seq, next_entry_id) || !bt_begin())
+			goto err;
+	}
+
+	if (!history_load() || !push_revisions()) {
+		bt_abort();
+		goto err;
+	}
+
+	if (!bt_commit(journal_seq, next_entry_id))
+		goto err;
+
+	if (rename(cp, database_file) < 0) {
+		syslog(LOG_ERR, "Can't rename db: %s", strerror(errno));
+		goto err;
+	}
+
+	free(order);
+	free(cp);
+
+	if (!bt_rename(database_file))
+		return 0;
+
+	if (fsync_policy != FSYNC_NEVER && !sync_dir(database_file))
+		return 0;
+
+	journal_reset();
+	writer_covered(journal_seq);
+	drop_secrets();
+	drop_revisions();
+
+	return 1;
+err:
+	history_drop();
+	unlink(cp);
+	free(order);
+	free(cp);
+	return 0;
+}
+
+int db_convert(void) {
+	if (!db_rewrite()) {
+		syslog(LOG_ERR, "Can not convert database");
+		return 0;
+	}
+
+	syslog(LOG_INFO, "Database converted to version %x", VERSION_CODE);
+
+	return 1;
+}
+
+/*
+ * Removed entries leave underfilled pages behind. Once they make up
+ * compact_ratio percent of what the file has seen since the last
+ * rewrite, the live entries are written out into a fresh file.
+ */
+int db_compact(void) {
+	unsigned long long deleted = bt_meta.ndeleted, pages = bt_meta.npages;
+
+	if (!compact_ratio || !deleted ||
+			deleted * 100 < (bt_meta.nkeys + deleted) * compact_ratio)
+		return 1;
+
+	if (!db_rewrite()) {
+		syslog(LOG_ERR, "Can not compact database");
+		return 0;
+	}
+
+	syslog(LOG_INFO, "Database compacted from %llu to %llu pages", pages, bt_meta.npages);
+
+	return 1;
+}
+
+static void db_release_slot(int slot) {
+	struct db_record *r = &records[slot];
+	struct db_hot *h = &hot_fields[slot];
+
+	if (r->len) {
+		memset(cold.buf + r->off, 0, r->len);
+		cold.garbage += r->len;
+		memset(hot.buf + h->off, 0, hot_len(slot));
+		hot.garbage += hot_len(slot);
+	}
+
+	if (secrets[r->id % SECRET_CACHE_SIZE].id == r->id)
+		memset(&secrets[r->id % SECRET_CACHE_SIZE], 0, sizeof(struct secret_cache));
+
+	id_index_del(r->id);
+	r->id = 0;
+	r->len = 0;
+	r->lazy = 0;
+}
+
+void db_del_slot(int slot) {
+	unsigned int *tmp;
+
+	if (!records[slot].len)
+		return;
+
+	db_release_slot(slot);
+
+	if (num_free == max_free) {
+		max_free = max_free ? max_free * 2 : 256;
+		tmp = realloc(free_slots, max_free * sizeof(unsigned int));
+		if (!tmp) {
+			/* the slot is just not reused then */
+			syslog(LOG_ERR, "Memory allocation error");
+			max_free = num_free;
+			return;
+		}
+		free_slots = tmp;
+	}
+
+	free_slots[num_free++] = slot;
+}
+
+/*
+ * Squeeze the free slots out of the table once there are too many of
+ * them, keeping the order of the live entries. Pending changes are
+ * moved along, the ones for entries removed since are dropped.
+ */
+static int records_pack(void) {
+	unsigned int *map, i, j, n;
+	struct db_change *c;
+
+	if (!compact_ratio || num_free < RECORDS_PACK_MIN || num_free * 100 < num_records * compact_ratio)
+		return 1;
+
+	map = malloc(num_records * sizeof(unsigned int));
+	if (!map) {
+		syslog(LOG_ERR, "Memory allocation error");
+		return 1;
+	}
+
+	for (i = 0, n = 0; i < num_records; i++) {
+		map[i] = n;
+		if (records[i].len)
+			n++;
+	}
+
+	for (i = 0, j = 0, c = changes; i < num_changes; i++, c++) {
+		if (c->slot >= 0) {
+			if (records[c->slot].id != c->id)
+				continue;
+			c->slot = map[c->slot];
+		}
+		changes[j++] = *c;
+	}
+
+	for (i = 0; i < num_records; i++) {
+		if (!records[i].len || map[i] == i)
+			continue;
+
+		records[map[i]] = records[i];
+		hot_fields[map[i]] = hot_fields[i];
+		id_index_put(records[i].id, map[i]);
+	}
+
+	free(map);
+
+	num_changes = j;
+	num_records = n;
+	num_free = 0;
+
+	return 1;
+}
+
+int db_add_entry(struct db_entry *de) {
+	unsigned char buf[MAX_RECORD_LEN];
+	struct parcel pc;
+	int rv;
+
+	pc.type = PT_ADD_ENTRY;
+	pc.length = record_encode(de, buf, sizeof(buf));
+	pc.data = (void *) buf;
+
+	if (!pc.length) {
+		fprintf(stderr, "Entry is too long\n");
+		return 0;
+	}
+
+	rv = send_parcel(&pc);
+	memset(buf, 0, sizeof(buf));
+
+	return rv;
+}
+
+/*
+ * Streamed reply: frames of at most MAX_PARCEL_LEN bytes, each a
+ * length followed by whole entries (id and record), and an empty
+ * frame at the end. Without idxs all live entries go out. Only with
+ * 'full' do the records carry password and notes.
+ */
+static unsigned char frame_buf[sizeof(unsigned int) + MAX_PARCEL_LEN];
+
+/* The daemon's static buffers of plain text stay in RAM */
+void db_init(void) {
+	secure_lock(frame_buf, sizeof(frame_buf));
+	secure_lock(secrets, sizeof(secrets));
+	secure_lock(db_key, sizeof(db_key));
+}
+
+static int send_frame(int csk, unsigned int len) {
+	int rv;
+
+	memcpy(frame_buf, &len, sizeof(len));
+	rv = send_reply(csk, frame_buf, sizeof(len) + len);
+	memset(frame_buf, 0, sizeof(len) + len);
+
+	return rv;
+}
+
+static int send_frames(int csk, unsigned int *idxs, unsigned int cnt, int full) {
+	unsigned char *p = frame_buf + sizeof(unsigned int);
+	unsigned char buf[MAX_RECORD_LEN], *rec;
+	struct db_record *r;
+	unsigned int i, n, len = 0;
+	int rv = 0;
+
+	if (!idxs)
+		cnt = num_records;
+
+	for (i = 0; i < cnt; i++) {
+		r = &records[idxs ? idxs[i] : i];
+		if (!r->len)
+			continue;
+
+		n = slot_record(idxs ? idxs[i] : i, full, buf, &rec);
+		if (!n)
+			goto out;
+
+		if (len + sizeof(r->id) + n > MAX_PARCEL_LEN) {
+			if (!send_frame(csk, len))
+				goto out;
+			len = 0;
+		}
+
+		memcpy(p + len, &r->id, sizeof(r->id));
+		memcpy(p + len + sizeof(r->id), rec, n);
+		len += sizeof(r->id) + n;
+	}
+
+	if (len && !send_frame(csk, len))
+		goto out;
+
+	rv = send_frame(csk, 0);
+out:
+	secrets_close();
+	memset(buf, 0, sizeof(buf));
+
+	return rv;
+}
+
+int pt_export(void *data, unsigned int len, int csk) {
+	return send_frames(csk, NULL, 0, 1);
+}
+
+static int slot_cmp(const void *a, const void *b) {
+	unsigned int x = *(unsigned int *) a, y = *(unsigned int *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int is_match(unsigned int slot, char *string, size_t slen) {
+	struct db_hot *h = &hot_fields[slot];
+	char *name = (char *) hot.buf + h->off;
+
+	return ci_search(name, h->name_len, string, slen) ||
+		ci_search(name + h->name_len + 1, h->login_len, string, slen);
+}
+
+/* Check the entries the trigram index came up with */
+static int get_indexed(char *string, unsigned long long *ids, unsigned int n, int csk) {
+	unsigned int i, cnt = 0;
+	unsigned int *idxs;
+	size_t slen = strlen(string);
+	int slot, rv;
+
+	idxs = (unsigned int *) malloc(sizeof(unsigned int) * (n + 1));
+	if (!idxs) {
+		syslog(LOG_ERR, "Can not alloc memory");
+		free(ids);
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		slot = id_index_get(ids[i]);
+		if (slot < 0 || !records[slot].len)
+			continue;
+
+		if (is_match(slot, string, slen))
+			idxs[cnt++] = slot;
+	}
+
+	free(ids);
+
+	/* same order as a full scan */
+	qsort(idxs, cnt, sizeof(unsigned int), slot_cmp);
+	rv = send_frames(csk, idxs, cnt, 0);
+	free(idxs);
+
+	return rv;
+}
+
+int pt_get_entry(void *data, unsigned int len, int csk) {
+	char *string = (char *) data;
+	unsigned long long *ids;
+	unsigned int i, cnt;
+	unsigned int *idxs;
+	size_t slen;
+	int rv;
+
+	if (len && string[len - 1] != '\0') {
+		syslog(LOG_ERR, "Invalid search string");
+		return 0;
+	}
+
+	slen = string ? strlen(string) : 0;
+
+	if (!slen)
+		return send_frames(csk, NULL, 0, 0);
+
+	if (tg_query(string, &ids, &cnt))
+		return get_indexed(string, ids, cnt, csk);
+
+	idxs = (unsigned int *) malloc(sizeof(unsigned int) * (num_records + 1));
+	if (!idxs) {
+		syslog(LOG_ERR, "Can not alloc memory");
+		return 0;
+	}
+
+	cnt = 0;
+	for (i = 0; i < num_records; i++) {
+		if (!records[i].len)
+			continue;
+
+		if (is_match(i, string, slen))
+			idxs[cnt++] = i;
+	}
+
+	rv = send_frames(csk, idxs, cnt, 0);
+	free(idxs);
+
+	return rv;
+}
+
+int pt_get_db(void *data, unsigned int len, int csk) {
+	return pt_get_entry(NULL, 0, csk);
+}
+
+/* Score every entry and send back the best ones, best first */
+int pt_fuzzy(void *data, unsigned int len, int csk) {
+	struct fuzzy_query *q = (struct fuzzy_query *) data;
+	struct fuzzy_top top;
+	struct db_hot *h;
+	unsigned int i, *idxs;
+	char *name;
+	size_t plen;
+	int score, s, rv;
+
+	if (!q || len <= sizeof(*q) || ((char *) data)[len - 1] != '\0') {
+		syslog(LOG_ERR, "Invalid search string");
+		return 0;
+	}
+
+	if (!q->limit || q->limit > MAX_FUZZY_LIMIT) {
+		syslog(LOG_ERR, "Invalid result limit");
+		return 0;
+	}
+
+	plen = strlen(q->pattern);
+
+	top.k = q->limit;
+	top.count = 0;
+	top.hits = malloc(sizeof(struct fuzzy_hit) * top.k);
+	idxs = malloc(sizeof(unsigned int) * top.k);
+	if (!top.hits || !idxs) {
+		syslog(LOG_ERR, "Can not alloc memory");
+		free(top.hits);
+		free(idxs);
+		return 0;
+	}
+
+	for (i = 0; i < num_records; i++) {
+		if (!records[i].len)
+			continue;
+
+		h = &hot_fields[i];
+		name = (char *) hot.buf + h->off;
+		score = fuzzy_score(name, h->name_len, q->pattern, plen);
+		s = fuzzy_score(name + h->name_len + 1, h->login_len, q->pattern, plen);
+		if (s != FUZZY_NONE && s - FUZZY_LOGIN_PENALTY > score)
+			score = s - FUZZY_LOGIN_PENALTY;
+
+		if (score != FUZZY_NONE)
+			fuzzy_offer(&top, score, i);
+	}
+
+	fuzzy_drain(&top, idxs);
+	rv = send_frames(csk, idxs, top.count, 0);
+
+	free(top.hits);
+	free(idxs);
+
+	return rv;
+}
+
+static int db_remove(int slot) {
+	struct db_entry de;
+	unsigned long long id;
+
+	db_decode_slot(slot, &de);
+	syslog(LOG_ERR, "Removing %s\n", de.name);
+	id = de.id = records[slot].id;
+	if (!journal_append(JOURNAL_DEL, id, NULL, 0))
+		return 0;
+
+	tg_del(&de);
+	db_del_slot(slot);
+	if (!db_changed(id, -1))
+		return 0;
+
+	return records_pack();
+}
+
+int pt_remove_entry(void *data, unsigned int len, int csk) {
+	int *idx = (int *) data;
+	int i, j;
+
+	if (!idx || len != sizeof(int)) {
+		syslog(LOG_ERR, "Invalid index received");
+		return 0;
+	}
+
+	for (j = 0, i = 0; i < num_records; i++) {
+		if (!records[i].len)
+			continue;
+
+		if (++j == *idx)
+			break;
+	}
+
+	if (i == num_records)
+		return 0;
+
+	return db_remove(i);
+}
+
+static int parcel_id(void *data, unsigned int len, unsigned long long *id) {
+	if (!data || len < sizeof(*id)) {
+		syslog(LOG_ERR, "Invalid id received");
+		return 0;
+	}
+
+	memcpy(id, data, sizeof(*id));
+
+	return 1;
+}
+
+/* The reply is empty when there is no such entry */
+int pt_get_id(void *data, unsigned int len, int csk) {
+	unsigned long long id;
+	unsigned int idx;
+	int slot;
+
+	if (!parcel_id(data, len, &id) || len != sizeof(id))
+		return 0;
+
+	slot = id_index_get(id);
+	if (slot < 0)
+		return send_frame(csk, 0);
+
+	idx = slot;
+
+	return send_frames(csk, &idx, 1, 1);
+}
+
+int pt_remove_id(void *data, unsigned int len, int csk) {
+	unsigned long long id;
+	int slot;
+
+	if (!parcel_id(data, len, &id) || len != sizeof(id))
+		return 0;
+
+	slot = id_index_get(id);
+	if (slot < 0) {
+		syslog(LOG_ERR, "No entry with id %llu", id);
+		return 0;
+	}
+
+	return db_remove(slot);
+}
+
+/* Keep the revision for the next checkpoint */
+static int db_revised(unsigned long long id, unsigned char *rev, unsigned int len) {
+	unsigned char *copy;
+
+	copy = secure_alloc(len);
+	if (!copy) {
+		syslog(LOG_ERR, "Memory allocation error");
+		return 0;
+	}
+	memcpy(copy, rev, len);
+
+	if (!change_add(id, -2)) {
+		secure_free(copy);
+		return 0;
+	}
+
+	changes[num_changes - 1].rev = copy;
+	changes[num_changes - 1].rev_len = len;
+
+	return 1;
+}
+
+/* Replace the entry in slot by a valid record, the old version becomes a revision */
+int db_update(int slot, unsigned long long id, unsigned char *rec, unsigned int len) {
+	unsigned char buf[MAX_RECORD_LEN], rev[MAX_RECORD_LEN];
+	struct db_entry de, old;
+	unsigned int n, rlen = 0;
+
+	record_decode(rec, len, &de);
+
+	if (keep_revisions && bt_version >= HISTORY_VERSION_CODE) {
+		n = db_full_record(slot, buf);
+		if (!n)
+			return 0;
+
+		record_decode(buf, n, &old);
+		rlen = revision_make(&old, &de, rev);
+		memset(buf, 0, sizeof(buf));
+	}
+
+	/* a revision without the change is harmless, the other way round it is lost */
+	if (rlen && !journal_append(JOURNAL_REV, id, rev, rlen)) {
+		memset(rev, 0, sizeof(rev));
+		return 0;
+	}
+
+	if (!journal_append(JOURNAL_PUT, id, rec, len))
+		return 0;
+
+	if (db_decode_slot(slot, &old)) {
+		old.id = id;
+		tg_del(&old);
+	}
+
+	if (!db_put_slot(slot, id, rec, len))
+		return 0;
+
+	de.id = id;
+	tg_add(&de);
+
+	if (rlen && !db_revised(id, rev, rlen)) {
+		memset(rev, 0, sizeof(rev));
+		return 0;
+	}
+	memset(rev, 0, sizeof(rev));
+
+	return db_changed(id, slot);
+}
+
+/* The id is followed by the new record */
+int pt_update_id(void *data, unsigned int len, int csk) {
+	unsigned char *rec = (unsigned char *) data + sizeof(unsigned long long);
+	struct db_entry de;
+	unsigned long long id;
+	int slot;
+
+	if (!parcel_id(data, len, &id))
+		return 0;
+
+	len -= sizeof(id);
+	if (len > MAX_RECORD_LEN || record_decode(rec, len, &de) != len || !de.name[0]) {
+		syslog(LOG_ERR, "Invalid entry received");
+		return 0;
+	}
+
+	slot = id_index_get(id);
+	if (slot < 0) {
+		syslog(LOG_ERR, "No entry with id %llu", id);
+		return 0;
+	}
+
+	return db_update(slot, id, rec, len);
+}
+
+/* Returns the slot of the new entry or -1 */
+static int db_insert(unsigned char *data, unsigned int len, struct db_entry *de) {
+	unsigned long long id;
+	int slot;
+
+	id = next_entry_id;
+	if (!journal_append(JOURNAL_PUT, id, data, len))
+		return -1;
+
+	next_entry_id++;
+
+	slot = find_free_slot();
+	if (slot < 0)
+		slot = num_records;
+
+	if (!db_put_slot(slot, id, data, len))
+		return -1;
+
+	de->id = id;
+	tg_add(de);
+
+	return db_changed(id, slot) ? slot : -1;
+}
+
+int pt_add_entry(void *data, unsigned int len, int csk) {
+	struct db_entry de;
+
+	if (!data || len > MAX_RECORD_LEN || record_decode(data, len, &de) != len || !de.name[0]) {
+		syslog(LOG_ERR, "Invalid entry received");
+		return 0;
+	}
+
+	return db_insert(data, len, &de) >= 0;
+}
+
+/*
+ * Bulk import. The batches of an import session are only checked and
+ * staged; the last one adds all staged entries that are not already
+ * in the database (same name and login), followed by one checkpoint.
+ */
+static int importing = 0;
+
+/* name+login -> slot + 1 of the entries seen so far */
+static unsigned int *dedup = NULL;
+static unsigned int dedup_mask = 0;
+
+
+static unsigned int dedup_hash(char *name, unsigned int nlen, char *login, unsigned int llen) {
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	unsigned int i;
+
+	for (i = 0; i < nlen; i++)
+		h = (h ^ (unsigned char) name[i]) * 0x100000001b3ULL;
+
+	h = (h ^ 0xff) * 0x100000001b3ULL;
+	for (i = 0; i < llen; i++)
+		h = (h ^ (unsigned char) login[i]) * 0x100000001b3ULL;
+
+	return (unsigned int) (h ^ h >> 32) & dedup_mask;
+}
+
+/*
+ * Look the name and login up. If they are new and slot is not -1, the
+ * slot goes into the set. Returns whether they were there before.
+ */
+static int dedup_check(char *name, char *login, int slot) {
+	unsigned int nlen = strlen(name), llen = strlen(login), h;
+	struct db_hot *hf;
+	char *hn;
+
+	for (h = dedup_hash(name, nlen, login, llen); dedup[h]; h = (h + 1) & dedup_mask) {
+		hf = &hot_fields[dedup[h] - 1];
+		hn = (char *) hot.buf + hf->off;
+		if (hf->name_len == nlen && hf->login_len == llen &&
+				!memcmp(hn, name, nlen) && !memcmp(hn + nlen + 1, login, llen))
+			return 1;
+	}
+
+	if (slot >= 0)
+		dedup[h] = slot + 1;
+
+	return 0;
+}
+
+/*
+ * Allocate for all staged entries up front, duplicates included, so that
+ * adding them can not run out of memory halfway.
+ */
+static int import_reserve(void) {
+	struct db_entry de;
+	unsigned int off, n, cnt = 0, hot_len = 0;
+
+	for (off = 0; off < import_len; off += n, cnt++) {
+		n = record_decode(import_stage + off, import_len - off, &de);
+		hot_len += strlen(de.name) + strlen(de.login) + 2;
+	}
+
+	return journal_reserve(cnt, import_len) && db_reserve(num_records + cnt) &&
+		arena_reserve(&cold, import_len) && arena_reserve(&hot, hot_len) &&
+		id_index_reserve(cnt) && change_reserve(cnt);
+}
+
+/* Take the entries of a failed import out again, ids from 'first' on */
+static int import_undo(unsigned long long first) {
+	unsigned long long id;
+	int slot;
+
+	for (id = first; id < next_entry_id; id++) {
+		slot = id_index_get(id);
+		if (slot >= 0 && !db_remove(slot))
+			return 0;
+	}
+
+	return 1;
+}
+
+static int import_commit(int csk) {
+	struct import_result res = { 0, 0 };
+	unsigned long long first = next_entry_id;
+	struct db_entry de;
+	unsigned int off, n, size, i;
+	int slot, rv = 1;
+
+	for (off = 0, n = 0; off < import_len; n++)
+		off += record_decode(import_stage + off, import_len - off, &de);
+
+	for (size = 1024; size < (num_records + n) * 2; size *= 2)
+		;
+
+	dedup = calloc(size, sizeof(unsigned int));
+	if (!dedup || !import_reserve()) {
+		syslog(LOG_ERR, "Memory allocation error");
+		free(dedup);
+		dedup = NULL;
+		import_drop();
+		return 0;
+	}
+	dedup_mask = size - 1;
+
+	for (i = 0; i < num_records; i++) {
+		if (records[i].len)
+			dedup_check((char *) hot.buf + hot_fields[i].off,
+				(char *) hot.buf + hot_fields[i].off + hot_fields[i].name_len + 1, i);
+	}
+
+	/* no checkpoints in between, one for the lot */
+	importing = 1;
+	for (off = 0; off < import_len; off += n) {
+		n = record_decode(import_stage + off, import_len - off, &de);
+		if (dedup_check(de.name, de.login, -1)) {
+			res.duplicates++;
+			continue;
+		}
+
+		slot = db_insert(import_stage + off, n, &de);
+		if (slot < 0) {
+			rv = 0;
+			break;
+		}
+
+		/* the hot store has the entry now */
+		dedup_check(de.name, de.login, slot);
+		res.added++;
+	}
+
+	free(dedup);
+	dedup = NULL;
+	import_drop();
+
+	/* all or nothing */
+	if (!rv) {
+		if (import_undo(first))
+			syslog(LOG_ERR, "Import failed, %u entries taken back", res.added);
+		else
+			syslog(LOG_ERR, "Import failed, can not take back %u entries", res.added);
+		importing = 0;
+		return 0;
+	}
+	importing = 0;
+
+	syslog(LOG_INFO, "Imported %u entries, %u duplicates", res.added, res.duplicates);
+
+	if (res.added && !sync_db())
+		syslog(LOG_WARNING, "Checkpoint failed, keeping journal");
+
+	size = sizeof(res);
+
+	return send_reply(csk, &size, sizeof(size)) && send_reply(csk, &res, sizeof(res));
+}
+
+int pt_import(void *data, unsigned int len, int csk) {
+	struct import_batch *b = data;
+	struct db_entry de;
+	unsigned char *tmp;
+	unsigned int off, n;
+
+	if (!data || len < sizeof(*b)) {
+		syslog(LOG_ERR, "Invalid import batch received");
+		return 0;
+	}
+
+	if (b->flags & IMPORT_BEGIN) {
+		import_drop();
+		import_session = b->session;
+		import_open = 1;
+	}
+
+	if (!import_open || b->session != import_session) {
+		syslog(LOG_ERR, "No such import session");
+		return 0;
+	}
+
+	if (b->flags & IMPORT_ABORT) {
+		import_drop();
+		return 1;
+	}
+
+	for (off = sizeof(*b); off < len; off += n) {
+		n = record_decode((unsigned char *) data + off, len - off, &de);
+		if (!n || !de.name[0]) {
+			syslog(LOG_ERR, "Invalid entry received");
+			import_drop();
+			return 0;
+		}
+	}
+
+	len -= sizeof(*b);
+	if (import_len + len > import_size) {
+		if (import_len + len > MAX_IMPORT_SIZE) {
+			syslog(LOG_ERR, "Import is too large");
+			import_drop();
+			return 0;
+		}
+
+		n = import_size ? import_size : MAX_PARCEL_LEN;
+		while (n < import_len + len)
+			n *= 2;
+
+		tmp = secure_realloc(import_stage, n);
+		if (!tmp) {
+			syslog(LOG_ERR, "Memory allocation error");
+			import_drop();
+			return 0;
+		}
+
+		import_stage = tmp;
+		import_size = n;
+	}
+
+	memcpy(import_stage + import_len, (unsigned char *) data + sizeof(*b), len);
+	import_len += len;
+
+	if (b->flags & IMPORT_COMMIT)
+		return import_commit(csk);
+
+	return 1;
+}
+
+/*
+ * num_records counts slots, removed entries leave free slots (len 0)
+ * behind until they are reused.
+ */
+int db_put_slot(int slot, unsigned long long id, unsigned char *rec, unsigned int len) {
+	struct db_entry de;
+	struct db_hot *h;
+
+	if (!record_decode(rec, len, &de)) {
+		syslog(LOG_ERR, "Invalid record");
+		return 0;
 	}
-	
 
-	dh = (struct db_header *) p;
-	mapped_db = ((unsigned char *) dh) + sizeof(struct db_header);
+	if (slot >= num_records) {
+		if (!db_reserve(slot + 1))
+			return 0;
 
-	if (strncmp(dh->signature, DATABASE_SIGNATURE, strlen(DATABASE_SIGNATURE))) {
-		syslog(LOG_ERR, "Invalid passphrase or database is corrupted");
-		return 0;
+		memset(records + num_records, 0, (slot + 1 - num_records) * sizeof(struct db_record));
+		num_records = slot + 1;
 	}
 
-	size -= sizeof(struct db_header);
-	if (size % sizeof(struct db_entry)) {
-		syslog(LOG_ERR, "Database is corrupted");
+	h = &hot_fields[slot];
+	if (!arena_reserve(&cold, len) ||
+			!arena_reserve(&hot, strlen(de.name) + strlen(de.login) + 2))
 		return 0;
-	}	
 
-	if (dh->num_entries != (size / sizeof(struct db_entry))) {
-		syslog(LOG_ERR, "Database is corrupted");
+	db_release_slot(slot);
+	if (id && !id_index_put(id, slot))
 		return 0;
-	}
 
-	if (dh->version > VERSION_CODE) {
-		syslog(LOG_ERR, "Database is not supported. Please upgrade the software");
-		return 0;
-	}
+	memcpy(cold.buf + cold.len, rec, len);
+	records[slot].id = id;
+	records[slot].off = cold.len;
+	records[slot].len = len;
+	records[slot].lazy = 0;
+	cold.len += len;
+
+	h->off = hot.len;
+	h->name_len = strlen(de.name);
+	h->login_len = strlen(de.login);
+	memcpy(hot.buf + hot.len, de.name, h->name_len + 1);
+	memcpy(hot.buf + hot.len + h->name_len + 1, de.login, h->login_len + 1);
+	hot.len += hot_len(slot);
 
 	return 1;
 }
 
-int db_add_entry(struct db_entry *de) {
+int db_decode_slot(int slot, struct db_entry *de) {
+	struct db_record *r = &records[slot];
 
-	struct parcel pc;
+	if (!r->len)
+		return 0;
 
-	pc.type = PT_ADD_ENTRY;
-	pc.length = sizeof(*de);
-	pc.data = (void *) de;
+	return record_decode(cold.buf + r->off, r->len, de) != 0;
+}
 
-	if (!send_parcel(&pc)) 
+/* Remember what to write at the next checkpoint */
+int db_changed(unsigned long long id, int slot) {
+	if (!change_add(id, slot))
 		return 0;
 
+	if (!importing && journal_size > JOURNAL_COMPACT_SIZE && !sync_db())
+		syslog(LOG_WARNING, "Checkpoint failed, keeping journal");
+
 	return 1;
 }
 
-int pt_get_entry(void *data, int csk) {
-	unsigned int size;
-	char *string = (char *) data;
-	struct db_entry *de;
-	int i, cnt;
-	int *idxs, idx;
+/*
+ * Checkpoint: copy the entries changed since the last one and let the
+ * writer thread put them into the database file, after the journal
+ * records queued so far. A snapshot is a sequence of checkpoint_entry
+ * headers, each followed by the record unless it is a removal. The
+ * revisions go in under id | BT_HISTORY.
+ */
+int sync_db(void) {
+	struct checkpoint_entry *ce;
+	struct db_change *c;
+	struct db_record *r;
+	unsigned char *snap;
+	unsigned int i, size = 0, len;
 
-	if (!mapped_db || !dh) {
-		syslog(LOG_ERR, "Database is not initialized");
+	if (!database_file) {
+		syslog(LOG_ERR, "Database is not defined");
 		return 0;
 	}
 
+	if (!num_changes)
+		return 1;
 
-	idxs = (int *) malloc(sizeof(int) * dh->num_entries);
-	if (!idxs) {
-		syslog(LOG_ERR, "Can not alloc memory");
-		return 0;
+	for (i = 0, c = changes; i < num_changes; i++, c++) {
+		size += sizeof(*ce);
+		if (c->slot >= 0)
+			size += records[c->slot].len;
+		else if (c->rev)
+			size += c->rev_len;
 	}
 
-	cnt = 0;
-	de = (struct db_entry *) mapped_db;
-	for (i = 0; i < dh->num_entries; i++, de++) {
-		if (!de->name[0]) 
-			continue;
+	snap = secure_alloc(size);
+	if (!snap) {
+		syslog(LOG_ERR, "Memory allocation error");
+		return 0;
+	}
 
-		if (!string || !*string) {
-			idxs[cnt++] = i;
-			continue;
-		}
-			
-		if (strcasestr(de->name, string)) {
-			idxs[cnt++] = i;
-			continue;
+	for (i = 0, len = 0, c = changes; i < num_changes; i++, c++) {
+		ce = (struct checkpoint_entry *) (snap + len);
+		ce->id = c->id;
+		ce->len = 0;
+
+		if (c->slot >= 0) {
+			/* removed (and maybe reused) since */
+			r = &records[c->slot];
+			if (r->id != c->id)
+				continue;
+
+			ce->len = r->len;
+			memcpy(snap + len + sizeof(*ce), cold.buf + r->off, r->len);
+		} else if (c->rev) {
+			ce->id |= BT_HISTORY;
+			ce->len = c->rev_len;
+			memcpy(snap + len + sizeof(*ce), c->rev, c->rev_len);
 		}
 
-		if (strcasestr(de->login, string)) {
-			idxs[cnt++] = i;
-			continue;
-		}
+		len += sizeof(*ce) + ce->len;
 	}
 
-	size = cnt * sizeof(struct db_entry);
-	if (!send_reply(csk, (void *) &size, sizeof(unsigned int))) 
+	writer_journal();
+	if (!writer_checkpoint(snap, len, journal_seq, next_entry_id))
 		return 0;
 
-	if (!size)
-		return 1;
-
-	for (i = 0; i < cnt; i++) {
-		idx = idxs[i];
-
-		de = ((struct db_entry *) mapped_db) + idx;
-		if (!send_reply(csk, (void *) de, sizeof(struct db_entry))) 
-			return 0;
-	}
+	drop_revisions();
+	num_changes = 0;
+	journal_size = 0;
 
 	return 1;
 }
 
-int pt_get_db(void *data, int csk) {
-	unsigned int size;
-	char *cp;
-	int i;
+/* Runs in the writer thread */
+int db_checkpoint(unsigned char *snap, unsigned int len, unsigned long long seq,
+		unsigned long long next_id) {
+	struct checkpoint_entry ce;
+	unsigned int off;
+	int rv;
 
-	size = dh->num_entries * sizeof(struct db_entry);
-	if (!send_reply(csk, (void *) &size, sizeof(unsigned int))) 
+	if (!bt_begin())
 		return 0;
 
-	cp = mapped_db;
-	for (i = 0; i < dh->num_entries; i++) {
-		if (!*cp) {
-			cp += sizeof(struct db_entry);
-			continue;
-		}
-		if (!send_reply(csk, (void *) cp, sizeof(struct db_entry))) 
+	for (off = 0; off < len; off += sizeof(ce) + ce.len) {
+		memcpy(&ce, snap + off, sizeof(ce));
+		if (ce.id & BT_HISTORY)
+			rv = history_push(ce.id & ~BT_HISTORY, snap + off + sizeof(ce), ce.len);
+		else if (ce.len)
+			rv = db_store(ce.id, snap + off + sizeof(ce), ce.len);
+		else
+			rv = db_unstore(ce.id);
+
+		if (!rv) {
+			bt_abort();
 			return 0;
-
-		cp += sizeof(struct db_entry);
+		}
 	}
 
-	return 1;
+	return bt_commit(seq, next_id);
 }
 
-int pt_remove_entry(void *data, int csk) {
-	struct db_entry *de;
-	int *idx = (int *) data;
-	int i, j;
-	int removed = 0;
-
-	if (!mapped_db || !dh) {
-		syslog(LOG_ERR, "Database is not initialized");
-		return 0;
-	}
-
-	if (!idx) {
-		syslog(LOG_ERR, "Invalid index received");
-		return 0;
-	}
+int remove_entry(int idx) {
+	struct parcel pc;
 
-	de = (struct db_entry *) mapped_db;
-	for (j = 0, i = 0; i < dh->num_entries; i++) {
-		if (de->name[0] == '\0') {
-			de++;
-			continue;
-		}
+	pc.type = PT_REMOVE_ENTRY;
+	pc.length = sizeof(idx);
+	pc.data = (void *) &idx;
 
-		++j;
-		if (j == *idx) {
-			syslog(LOG_ERR, "Removing %s\n",de->name);
-			de->name[0] = '\0';
-			dh->num_entries--;
-			removed = 1;
-			break;
-		}
-	
-		de++;
+        if (!send_parcel(&pc)) {
+                return 0;
 	}
 	
-	if (!removed)
-		return 0;
-
-	if (!sync_db())
-		return 0;
 
 	return 1;
 }
 
-int pt_add_entry(void *data, int csk) {
-	struct db_entry *de = (struct db_entry *) data;
-	struct db_entry *fde;
-	unsigned char *tmp;
-	int size;
+int remove_entry_id(unsigned long long id) {
+	struct parcel pc;
 
-	if (!mapped_db || !dh) {
-		syslog(LOG_ERR, "Database is not initialized");
-		return 0;
-	}
+	pc.type = PT_REMOVE_ID;
+	pc.length = sizeof(id);
+	pc.data = (void *) &id;
 
-	fde = find_free_slot();
-	if (!fde) {
-		size = sizeof(struct db_header) + (dh->num_entries + 1) * sizeof(struct db_entry);
-		tmp = (unsigned char *) realloc(dh, size);
-		if (!tmp) {
-			free(dh);
-			syslog(LOG_ERR, "Memory allocation error");
-			return 0;
-		}
+	return send_parcel(&pc);
+}
 
-		dh = (struct db_header *) tmp;
-		mapped_db = tmp + sizeof(struct db_header);
+int db_update_entry(unsigned long long id, struct db_entry *de) {
+	unsigned char buf[sizeof(id) + MAX_RECORD_LEN];
+	struct parcel pc;
+	unsigned int len;
+	int rv;
 
-		fde = (struct db_entry *) (mapped_db + dh->num_entries * sizeof(struct db_entry));
+	memcpy(buf, &id, sizeof(id));
+	len = record_encode(de, buf + sizeof(id), MAX_RECORD_LEN);
+	if (!len) {
+		fprintf(stderr, "Entry is too long\n");
+		return 0;
 	}
 
-	dh->num_entries++;
+	pc.type = PT_UPDATE_ID;
+	pc.length = sizeof(id) + len;
+	pc.data = (void *) buf;
 
-	*fde = *de;
-	if (!sync_db())
-		return 0;
+	rv = send_parcel(&pc);
+	memset(buf, 0, sizeof(buf));
 
-	return 1;
+	return rv;
 }
 
-int sync_db(void) {
-	FILE *f;
-	int fd, size;
-	char *cp, *dir;
+void free_reply(struct parcel *pc) {
+	secure_free(pc->data);
+}
 
-	if (!database_file) {
-		syslog(LOG_ERR, "Database is not defined");
+/*
+ * Send a request and read the entries of the streamed reply one by
+ * one with stream_next(). Only the entries of the current frame are
+ * kept, an entry is valid until the next call.
+ */
+int stream_open(struct entry_stream *es, struct parcel *pc) {
+	memset(es, 0, sizeof(*es));
+
+	es->fd = do_connect();
+	if (!es->fd)
+		return 0;
+
+	es->buf = secure_alloc(MAX_PARCEL_LEN);
+	if (!es->buf) {
+		fprintf(stderr, "Memory allocation error\n");
+		close(es->fd);
 		return 0;
 	}
 
-	cp = malloc(strlen(database_file) + 12);
-	if (!cp) {
-		syslog(LOG_ERR, "No memory");
+	if (!_send_parcel(es->fd, pc)) {
+		secure_free(es->buf);
 		return 0;
 	}
 
-	strcpy(cp, database_file);
-	dir = dirname(cp);
+	return 1;
+}
+
+/* NULL at the end of the reply or on error (es->error is set) */
+struct db_entry *stream_next(struct entry_stream *es) {
+	unsigned int len;
 
-	strcpy(cp, dir);
-	strcat(cp, "/.opm.XXXXXX");
+	while (es->next == es->count) {
+		if (es->fd < 0)
+			return NULL;
 
-	fd = mkstemp(cp);
-	if (fd < 0) {
-		syslog(LOG_ERR, "Can't create tmp-file in /tmp");
-		free(cp);
-		return 0;
+		free(es->entries);
+		es->entries = NULL;
+		es->next = es->count = 0;
+
+		if (!_get_frame(es->fd, es->buf, &len))
+			goto err;
+
+		if (!len) {
+			if (!is_ok_reply(es->fd))
+				goto err;
+
+			close(es->fd);
+			es->fd = -1;
+			return NULL;
+		}
+
+		es->entries = record_decode_all(es->buf, len, &es->count);
+		if (!es->entries)
+			goto err;
 	}
-	
-	f = fdopen(fd, "w");
-	if (!f) {
-		syslog(LOG_ERR, "Can't create tmp-file in /tmp");
-		free(cp);
-		close(fd);
-		return 0;
-	}	
 
-	size = sizeof(struct db_header) + sizeof(struct db_entry) * dh->num_entries;
-	if (!encrypt_db(f, (char *) dh, password, size)) {
-		syslog(LOG_ERR, "Error upon saving db");
-		free(cp);
-		fclose(f);
+	return &es->entries[es->next++];
+err:
+	fprintf(stderr, "Communication error\n");
+	close(es->fd);
+	es->fd = -1;
+	es->error = 1;
+	return NULL;
+}
+
+void stream_close(struct entry_stream *es) {
+	if (es->fd >= 0)
+		close(es->fd);
+
+	free(es->entries);
+	secure_free(es->buf);
+}
+
+/*
+ * For replies of a few entries, all of them have to come in one
+ * frame. The entries point into pc->data, release both with free()
+ * and free_reply().
+ */
+struct db_entry *query_entries(struct parcel *pc, unsigned int *nums) {
+	struct db_entry *entries = NULL;
+	unsigned int len, end = 0;
+	int fd;
+
+	fd = do_connect();
+	if (!fd)
+		return NULL;
+
+	if (!_send_parcel(fd, pc))
+		return NULL;
+
+	pc->data = secure_alloc(MAX_PARCEL_LEN);
+	if (!pc->data) {
 		close(fd);
-		return 0;
+		return NULL;
 	}
-	
-	fclose(f);
+
+	if (_get_frame(fd, pc->data, &len) &&
+			(!len || recv(fd, &end, sizeof(end), MSG_WAITALL) == sizeof(end)) &&
+			!end && is_ok_reply(fd))
+		entries = record_decode_all(pc->data, len, nums);
+
 	close(fd);
 
-	if (rename(cp, database_file) < 0) {
-		syslog(LOG_ERR, "Can't rename db: %s", strerror(errno));
-		unlink(cp);
-		free(cp);
-		return 0;
+	if (!entries) {
+		fprintf(stderr, end ? "Reply is too large\n" : "Communication error\n");
+		free_reply(pc);
+		return NULL;
 	}
 
-	unlink(cp);
-	free(cp);
-
-        return 1;
+	return entries;
 }
 
-int remove_entry(int idx) {
+static int list_vault(int is_verbose) {
+	struct entry_stream es;
 	struct parcel pc;
+	struct db_entry *de;
+	unsigned int n = 0;
 
-	pc.type = PT_REMOVE_ENTRY;
-	pc.length = sizeof(idx);
-	pc.data = (void *) &idx;
+	pc.type = PT_GET_DB;
+	pc.length = 0;
 
-        if (!send_parcel(&pc)) {
-                return 0;
-	}
-	
+	if (!stream_open(&es, &pc))
+		return 0;
+
+	while ((de = stream_next(&es)))
+		pretty_entry(de, ++n, is_verbose);
+
+	stream_close(&es);
+	if (es.error)
+		return 0;
+
+	if (!n)
+		printf("No entries\n");
 
 	return 1;
 }
 
 int list_db(int is_verbose) {
-	struct parcel pc;
-	int rv, fd, i;
-	struct db_entry *de;
-	unsigned int nums;
+	struct vault_info **vl;
+	unsigned int i, nv;
+	int rv = 1;
 
-        pc.type = PT_GET_DB;
-        pc.length = 0;
+	if (!all_vaults)
+		return list_vault(is_verbose);
 
-	fd = do_connect();
-	if (!fd)
+	if (!get_vaults(&vl, &nv))
 		return 0;
 
-        if (!_send_parcel(fd, &pc)) {
-		close(fd);
-                return 0;
+	for (i = 0; i < nv && rv; i++) {
+		printf("%s%s:\n", i ? "\n" : "", vl[i]->path);
+		vault_handle = vl[i]->handle;
+		rv = list_vault(is_verbose);
 	}
 
-	pc.data = malloc(sizeof(char) * MAX_PARCEL_LEN);
-	if (!pc.data) {
-		close(fd);
-		return 0;
-	}
-	
-	if (!_get_parcel(fd, &pc)) {
-		close(fd);
-		free(pc.data);
+	free_vaults(vl, nv);
+
+	return rv;
+}
+
+struct match {
+	unsigned int vault;
+	unsigned long long id;
+};
+
+/* With --all, the path of the vault goes before its first match */
+static void show_vault(struct vault_info **vl, unsigned int nv, unsigned int handle, unsigned int *shown) {
+	unsigned int i;
+
+	if (!vl || handle == *shown)
+		return;
+
+	for (i = 0; i < nv && vl[i]->handle != handle; i++)
+		;
+
+	if (i < nv)
+		printf("%s:\n", vl[i]->path);
+	*shown = handle;
+}
+
+/*
+ * Print the matches as they come in. Only the first one is kept, to
+ * be printed once a second one shows up; for the others just the id
+ * is. Matches come without their secrets, the chosen one is fetched
+ * again by id unless it is what came back already. With --all the
+ * request goes to every open vault in turn.
+ */
+static int show_entries(struct parcel *pc, int is_verbose, int is_console) {
+	unsigned char rec[MAX_RECORD_LEN];
+	struct match *hits = NULL, *tmp;
+	struct vault_info **vl = NULL;
+	unsigned int n = 0, max = 0, choice, nv = 1, v, shown = 0;
+	struct entry_stream es;
+	struct db_entry *de, first;
+	int rv = 0, open = 0;
+
+	if (all_vaults && !get_vaults(&vl, &nv))
 		return 0;
+
+	for (v = 0; v < nv; v++) {
+		if (vl)
+			vault_handle = vl[v]->handle;
+
+		if (!stream_open(&es, pc))
+			goto out;
+		open = 1;
+
+		while ((de = stream_next(&es))) {
+			if (n == max) {
+				max = max ? max * 2 : 64;
+				tmp = realloc(hits, max * sizeof(*hits));
+				if (!tmp) {
+					fprintf(stderr, "Memory allocation error\n");
+					goto out;
+				}
+				hits = tmp;
+			}
+
+			hits[n].vault = vault_handle;
+			hits[n++].id = de->id;
+			if (n == 1) {
+				record_encode(de, rec, sizeof(rec));
+				record_decode(rec, sizeof(rec), &first);
+				first.id = de->id;
+				continue;
+			}
+
+			if (n == 2) {
+				show_vault(vl, nv, hits[0].vault, &shown);
+				pretty_entry(&first, 1, is_verbose);
+			}
+			show_vault(vl, nv, vault_handle, &shown);
+			pretty_entry(de, n, is_verbose);
+		}
+
+		stream_close(&es);
+		open = 0;
+		if (es.error)
+			goto out;
 	}
-	
-	close(fd);	
 
-	if (!pc.length) {
-		printf("No entries\n");
-		free(pc.data);
-		return 1;
+	if (!n) {
+		printf("Entry not found\n");
+		rv = 1;
+		goto out;
 	}
-	
-	if (pc.length % sizeof(struct db_entry) || pc.type != PT_REPLY) {
-		fprintf(stderr, "Communication error");
-		free(pc.data);
-		return 0;
+
+	if (n > 1) {
+		choice = ask_entry();
+		if (choice > n || !choice) {
+			fprintf(stderr, "Invalid input\n");
+			goto out;
+		}
+
+		vault_handle = hits[choice - 1].vault;
+		all_vaults = 0;
+		rv = get_entry_id(hits[choice - 1].id, is_verbose, is_console);
+		goto out;
 	}
-		
-	nums = pc.length / sizeof(struct db_entry);
-	pretty_output((struct db_entry *) pc.data, nums, is_verbose);
 
-	close(fd);
-	free(pc.data);
+	if (pc->type != PT_GET_ID) {
+		vault_handle = hits[0].vault;
+		all_vaults = 0;
+		rv = get_entry_id(hits[0].id, is_verbose, is_console);
+		goto out;
+	}
 
-        return 1;
+	rv = do_password(first.name, first.password, is_console);
+	if (!rv)
+		fprintf(stderr, "Failed to process password\n");
+out:
+	if (open)
+		stream_close(&es);
+	if (vl)
+		free_vaults(vl, nv);
+	memset(rec, 0, sizeof(rec));
+	free(hits);
+
+	return rv;
 }
 
 int get_entry(unsigned char *string, int is_verbose, int is_console) {
 	struct parcel pc;
-	int rv, fd, i;
 	int slen;
-	struct db_entry *de;
-	unsigned int nums, choice;
-	
 
 	slen = string ? strlen(string) : -1;
-	if (slen > MAX_ENTRY_LEN)
+	if (slen >= MAX_RECORD_LEN)
 		return 0;
 
 	pc.type = PT_GET_ENTRY;
-        pc.length = slen + 1;
-	pc.data = NULL;
-	if (pc.length) {
-		pc.data = malloc(sizeof(char) * slen + 1);
-		if (!pc.data) 
-			return 0;
-		
-		strncpy(pc.data, string, slen + 1);
-	}
+	pc.length = slen + 1;
+	pc.data = (void *) string;
 
-        fd = do_connect();
-        if (!fd) {
-		if (pc.data)
-			free(pc.data);
-                return 0;
-	}
+	return show_entries(&pc, is_verbose, is_console);
+}
 
-        if (!_send_parcel(fd, &pc)) {
-		if (pc.data)
-			free(pc.data);
-                close(fd);
-                return 0;
-        }
+int get_entry_fuzzy(char *string, unsigned int limit, int is_verbose, int is_console) {
+	struct parcel pc;
+	struct fuzzy_query *q;
+	unsigned int size;
+	int rv;
 
-	if (pc.data)
-		free(pc.data);
+	if (!string || !*string)
+		return get_entry(string, is_verbose, is_console);
 
-        pc.data = malloc(sizeof(char) * MAX_PARCEL_LEN);
-        if (!pc.data) {
-                close(fd);
-                return 0;
-        }
+	if (strlen(string) >= MAX_RECORD_LEN)
+		return 0;
 
-        if (!_get_parcel(fd, &pc)) {
-                close(fd);
-                free(pc.data);
-                return 0;
-        }
+	size = sizeof(*q) + strlen(string) + 1;
+	q = malloc(size);
+	if (!q) {
+		fprintf(stderr, "Memory allocation error\n");
+		return 0;
+	}
 
-        close(fd);
+	q->limit = limit;
+	strcpy(q->pattern, string);
 
-        if (!pc.length) {
-                printf("Entry not found\n");
-                free(pc.data);
-                return 1;
-        }
+	pc.type = PT_FUZZY;
+	pc.length = size;
+	pc.data = (void *) q;
 
-	if (pc.length % sizeof(struct db_entry) || pc.type != PT_REPLY) {
-		fprintf(stderr, "Communication error");
-		free(pc.data);
-		return 0;
-        }
+	rv = show_entries(&pc, is_verbose, is_console);
+	free(q);
 
-        nums = pc.length / sizeof(struct db_entry);
+	return rv;
+}
 
-	if (nums > 1) {
-		pretty_output((struct db_entry *) pc.data, nums, is_verbose);
-		choice = ask_entry();
-		if (choice > nums || !choice) {
-			fprintf(stderr, "Invalid input\n");
-			free(pc.data);
-			return 0;
-		}
+/* Blocks until the daemon has synced every change made so far */
+int wait_durable(void) {
+	struct parcel pc;
+	unsigned long long seq;
+	unsigned int len;
+	int fd;
 
-		de = ((struct db_entry *) pc.data) + (choice - 1);
+	pc.type = PT_DURABLE;
+	pc.length = 0;
+	pc.data = NULL;
 
-	} else {
-		de = (struct db_entry *) pc.data;
-	}
+	fd = do_connect();
+	if (!fd)
+		return 0;
 
-	free(pc.data);
-	if (!do_password(de->name, de->password, is_console)) {
-		fprintf(stderr, "Failed to process password\n");
+	if (!_send_parcel(fd, &pc))
+		return 0;
+
+	if (recv(fd, &len, sizeof(len), MSG_WAITALL) != sizeof(len) || len != sizeof(seq) ||
+			recv(fd, &seq, sizeof(seq), MSG_WAITALL) != sizeof(seq) || !is_ok_reply(fd)) {
+		close(fd);
 		return 0;
 	}
 
+	close(fd);
+	printf("Durable generation: %llu\n", seq);
+
 	return 1;
 }
 
+int get_entry_id(unsigned long long id, int is_verbose, int is_console) {
+	struct parcel pc;
 
-struct db_entry *find_free_slot(void) {
-	struct db_entry *de;
-	int i;
+	pc.type = PT_GET_ID;
+	pc.length = sizeof(id);
+	pc.data = (void *) &id;
 
-	if (!mapped_db || !dh) 
-		return NULL;
+	return show_entries(&pc, is_verbose, is_console);
+}
 
-	de = (struct db_entry *) mapped_db;
-	for (i = 0; i < dh->num_entries; i++) {
-		if (de->name[0] == '\0') 
-			return de;
-		de++;	
-	}
 
-	return NULL;
-}
+int find_free_slot(void) {
+	if (!num_free)
+		return -1;
 
+	return free_slots[--num_free];
+}
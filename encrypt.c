@@ -23,171 +23,235 @@
 
 static unsigned char ivec[] = "A1B2C3D4E5X6Y7Z8abcefdpoqDEFEND1";
 
+/* Ciphertext goes out CRYPT_BATCH bytes per write */
 int encrypt_db(FILE *f, char *ibuf, char *key, unsigned int size) {
-	unsigned int blocksize;
-	EVP_CIPHER_CTX ctx;
-	unsigned char *read_buf;
-	unsigned char *cipher_buf, *cp;
-	int out_len, total_buf_size, total_len, len;
-
-	EVP_CipherInit(&ctx, EVP_aes_256_cbc(), key, ivec, 1);
-        blocksize = EVP_CIPHER_CTX_block_size(&ctx);
-        total_buf_size = CHUNK_SIZE + blocksize;
-        cipher_buf = malloc(total_buf_size);
+	unsigned int blocksize, done, len;
+	EVP_CIPHER_CTX *ctx;
+	unsigned char *cipher_buf;
+	int out_len, rv = 0;
+
+	ctx = EVP_CIPHER_CTX_new();
+	if (!ctx) {
+		syslog(LOG_ERR, "Failed to alloc cipher context");
+		return 0;
+	}
+
+	EVP_CipherInit(ctx, EVP_aes_256_cbc(), key, ivec, 1);
+	blocksize = EVP_CIPHER_CTX_block_size(ctx);
+	cipher_buf = malloc(CRYPT_BATCH + blocksize);
 	if (!cipher_buf) {
 		syslog(LOG_ERR, "Failed to alloc memory");
+		EVP_CIPHER_CTX_free(ctx);
 		return 0;
 	}
 
-	total_len = 0;
-	cp = ibuf;
-	while (1) {
-		len = (total_len + CHUNK_SIZE >= size) ? (size - total_len) : CHUNK_SIZE;	
-		if (!EVP_CipherUpdate(&ctx, cipher_buf, &out_len, cp, len)) {
+	for (done = 0; done < size; done += len) {
+		len = size - done < CRYPT_BATCH ? size - done : CRYPT_BATCH;
+		if (!EVP_CipherUpdate(ctx, cipher_buf, &out_len, (unsigned char *) ibuf + done, len)) {
 			syslog(LOG_ERR, "Failed to update cipher");
-			EVP_CIPHER_CTX_cleanup(&ctx);
-			free(cipher_buf);
-			return 0;
+			goto out;
 		}
 
-		if (!fwrite(cipher_buf, sizeof(unsigned char), out_len, f)) {
+		if (fwrite(cipher_buf, 1, out_len, f) != (size_t) out_len) {
 			syslog(LOG_ERR, "File write error");
-			EVP_CIPHER_CTX_cleanup(&ctx);
-			free(cipher_buf);
-			return 0;
+			goto out;
 		}
-
-		cp += len;
-		total_len += len;
-
-		if (len != CHUNK_SIZE)
-			break;
-		
 	}
-		
-	if (!EVP_CipherFinal(&ctx, cipher_buf, &out_len)) {
+
+	if (!EVP_CipherFinal(ctx, cipher_buf, &out_len)) {
 		syslog(LOG_ERR, "Failed to encrypt");
-		free(cipher_buf);
-		EVP_CIPHER_CTX_cleanup(&ctx);
-		return 0;
+		goto out;
 	}
 
-	if (!fwrite(cipher_buf, sizeof(unsigned char), out_len, f)) {
+	if (fwrite(cipher_buf, 1, out_len, f) != (size_t) out_len) {
 		syslog(LOG_ERR, "File write error");
-		free(cipher_buf);
-		EVP_CIPHER_CTX_cleanup(&ctx);
-		return 0;
+		goto out;
 	}
-	
-	EVP_CIPHER_CTX_cleanup(&ctx);
+
+	rv = 1;
+out:
+	EVP_CIPHER_CTX_free(ctx);
 	free(cipher_buf);
 
-	return 1;
+	return rv;
 }
 
-
+/*
+ * The file is mapped and decrypted in one go into a buffer sized from
+ * its length, there is no staging copy of the plain text.
+ */
 char *decrypt_db(FILE *f, char *key, unsigned int *size) {
 	unsigned int blocksize;
-	EVP_CIPHER_CTX ctx;
-	unsigned char *read_buf;
-	unsigned char *cipher_buf, *cp, *tmp, *base;
-	int out_len, total_buf_size, total_out_len;
-	int ft = 1;
-
-	read_buf = malloc(CHUNK_SIZE);
-	if (!read_buf) {
-		syslog(LOG_ERR, "Failed to alloc memory");
+	EVP_CIPHER_CTX *ctx;
+	unsigned char *map, *out;
+	int out_len, final_len;
+	struct stat st;
+
+	if (fstat(fileno(f), &st) < 0) {
+		syslog(LOG_ERR, "Failed to read from db");
+		return NULL;
+	}
+
+	if (st.st_size > INT_MAX) {
+		syslog(LOG_ERR, "Database is too large");
 		return NULL;
 	}
 
+	ctx = EVP_CIPHER_CTX_new();
+	if (!ctx) {
+		syslog(LOG_ERR, "Failed to alloc cipher context");
+		return NULL;
+	}
 
-	EVP_CipherInit(&ctx, EVP_aes_256_cbc(), key, ivec, 0);
-	blocksize = EVP_CIPHER_CTX_block_size(&ctx);
-	total_buf_size = CHUNK_SIZE + blocksize;
-	cipher_buf = malloc(total_buf_size);
-	if (!cipher_buf) {
+	EVP_CipherInit(ctx, EVP_aes_256_cbc(), key, ivec, 0);
+	blocksize = EVP_CIPHER_CTX_block_size(ctx);
+
+	out = secure_alloc(st.st_size + blocksize);
+	if (!out) {
 		syslog(LOG_ERR, "Failed to alloc memory");
-		free(read_buf);
-		EVP_CIPHER_CTX_cleanup(&ctx);
+		EVP_CIPHER_CTX_free(ctx);
 		return NULL;
 	}
 
-	cp = malloc(total_buf_size);
-	if (!cp) {
-		syslog(LOG_ERR, "Failed to alloc memory");
-		free(cipher_buf);
-		free(read_buf);
-		EVP_CIPHER_CTX_cleanup(&ctx);
+	*size = 0;
+	if (!st.st_size) {
+		EVP_CIPHER_CTX_free(ctx);
+		return (char *) out;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+	if (map == MAP_FAILED) {
+		syslog(LOG_ERR, "Failed to read from db: %s", strerror(errno));
+		secure_free(out);
+		EVP_CIPHER_CTX_free(ctx);
 		return NULL;
 	}
 
-	out_len = total_out_len = 0;
-	while (1) {
-		int numRead = fread(read_buf, sizeof(unsigned char), CHUNK_SIZE, f);
-		if (numRead < 0) {
-			syslog(LOG_ERR, "Failed to read from db");
-			free(cp);
-			free(read_buf);
-			free(cipher_buf);
-			EVP_CIPHER_CTX_cleanup(&ctx);
-			return NULL;
-		}
+	if (!EVP_CipherUpdate(ctx, out, &out_len, map, st.st_size) ||
+			!EVP_CipherFinal(ctx, out + out_len, &final_len)) {
+		syslog(LOG_ERR, "Failed to decrypt db");
+		munmap(map, st.st_size);
+		secure_free(out);
+		EVP_CIPHER_CTX_free(ctx);
+		return NULL;
+	}
 
-		if (!numRead && ft)
-			break;
-	
-		ft = 0;
-		if (!EVP_CipherUpdate(&ctx, cipher_buf, &out_len, read_buf, numRead)) {
-			syslog(LOG_ERR, "Failed to decrypt db");
-			free(cp);
-			free(read_buf);
-			free(cipher_buf);
-			EVP_CIPHER_CTX_cleanup(&ctx);
-			return NULL;
-		}
+	munmap(map, st.st_size);
+	EVP_CIPHER_CTX_free(ctx);
 
-		total_buf_size += out_len;
+	*size = out_len + final_len;
 
-		tmp = realloc(cp, total_buf_size);
-		if (!tmp) {
-			syslog(LOG_ERR, "Failed to realloc memory");
-			free(cp);
-			free(read_buf);
-			free(cipher_buf);
-			EVP_CIPHER_CTX_cleanup(&ctx);
-			return NULL;
-		}		
+	return (char *) out;
+}
 
-		cp = tmp;
-		memcpy(cp + total_out_len, cipher_buf, out_len);
-		total_out_len += out_len;
 
-		if (numRead < CHUNK_SIZE)
-			break;
 
-	}
 
-	if (!ft && !EVP_CipherFinal(&ctx, cipher_buf, &out_len)) {
-		syslog(LOG_ERR, "Failed to decrypt db");
-		free(cp);
-		free(read_buf);
-		free(cipher_buf);
-		EVP_CIPHER_CTX_cleanup(&ctx);
-		return NULL;
 
+
+/*
+ * Authenticated encryption of a single small buffer (journal records).
+ * Output layout is nonce | ciphertext | tag, i.e. len + SEAL_OVERHEAD bytes.
+ */
+static int seal_tagged(unsigned char *out, unsigned char *in, unsigned int len,
+		unsigned char *aad, unsigned int aad_len, char *key, unsigned int tag_len) {
+	EVP_CIPHER_CTX *ctx;
+	int out_len, rv = 0;
+
+	if (RAND_bytes(out, SEAL_NONCE_LEN) != 1) {
+		syslog(LOG_ERR, "Failed to generate nonce");
+		return 0;
 	}
 
-	free(read_buf);
-	free(cipher_buf);
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	ctx = EVP_CIPHER_CTX_new();
+	if (!ctx) {
+		syslog(LOG_ERR, "Failed to alloc cipher context");
+		return 0;
+	}
+
+	if (!EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, out))
+		goto out;
 
-	total_out_len += out_len;
-	*size = total_out_len;
-	
-	return cp;
+	if (aad_len && !EVP_EncryptUpdate(ctx, NULL, &out_len, aad, aad_len))
+		goto out;
+
+	if (!EVP_EncryptUpdate(ctx, out + SEAL_NONCE_LEN, &out_len, in, len))
+		goto out;
+
+	if (!EVP_EncryptFinal_ex(ctx, out + SEAL_NONCE_LEN + out_len, &out_len))
+		goto out;
+
+	if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, tag_len, out + SEAL_NONCE_LEN + len))
+		goto out;
+
+	rv = 1;
+out:
+	if (!rv)
+		syslog(LOG_ERR, "Failed to seal data");
+
+	EVP_CIPHER_CTX_free(ctx);
+	return rv;
 }
 
+/*
+ * Reverse of seal_data(). len is the sealed length (including overhead).
+ * Returns 0 if the tag does not verify.
+ */
+static int open_tagged(unsigned char *out, unsigned char *in, unsigned int len,
+		unsigned char *aad, unsigned int aad_len, char *key, unsigned int tag_len) {
+	EVP_CIPHER_CTX *ctx;
+	int out_len, rv = 0;
+	unsigned int clen;
 
+	if (len < SEAL_NONCE_LEN + tag_len)
+		return 0;
 
+	clen = len - SEAL_NONCE_LEN - tag_len;
 
+	ctx = EVP_CIPHER_CTX_new();
+	if (!ctx) {
+		syslog(LOG_ERR, "Failed to alloc cipher context");
+		return 0;
+	}
+
+	if (!EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, in))
+		goto out;
+
+	if (aad_len && !EVP_DecryptUpdate(ctx, NULL, &out_len, aad, aad_len))
+		goto out;
+
+	if (!EVP_DecryptUpdate(ctx, out, &out_len, in + SEAL_NONCE_LEN, clen))
+		goto out;
+
+	if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, tag_len, in + SEAL_NONCE_LEN + clen))
+		goto out;
+
+	if (EVP_DecryptFinal_ex(ctx, out + out_len, &out_len) <= 0)
+		goto out;
+
+	rv = 1;
+out:
+	EVP_CIPHER_CTX_free(ctx);
+	return rv;
+}
+
+int seal_data(unsigned char *out, unsigned char *in, unsigned int len,
+		unsigned char *aad, unsigned int aad_len, char *key) {
+	return seal_tagged(out, in, len, aad, aad_len, key, SEAL_TAG_LEN);
+}
+
+int open_data(unsigned char *out, unsigned char *in, unsigned int len,
+		unsigned char *aad, unsigned int aad_len, char *key) {
+	return open_tagged(out, in, len, aad, aad_len, key, SEAL_TAG_LEN);
+}
+
+/* Pages up to 0x206 give 4 bytes of the tag to their checksum, see PAGE_TAG_LEN */
+int seal_page(unsigned char *out, unsigned char *in, unsigned int len,
+		unsigned char *aad, unsigned int aad_len, char *key) {
+	return seal_tagged(out, in, len, aad, aad_len, key, PAGE_TAG_LEN);
+}
 
+int open_page(unsigned char *out, unsigned char *in, unsigned int len,
+		unsigned char *aad, unsigned int aad_len, char *key) {
+	return open_tagged(out, in, len, aad, aad_len, key, PAGE_TAG_LEN);
+}
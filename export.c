@@ -0,0 +1,470 @@
+/*
+ * opm - Open Password Manager.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Alexander Miroch
+ *    Email: <alexander.miroch@gmail.com>
+ */
+
+/*
+ * Export. The daemon streams the entries in frames which are written
+ * out as CSV or JSON one at a time, so neither side ever holds more
+ * than a frame.
+ *
+ * An export can be sealed with a passphrase of its own: the key comes
+ * from PBKDF2 and the output is cut into chunks, each sealed with the
+ * header, its index and whether it is the last one as additional data,
+ * so chunks can't be reordered, dropped or cut off unnoticed. Sealed
+ * files are read back by --import.
+ *
+ * Sealed data can't be compressed any more, so the text is deflated
+ * before it is cut into chunks (OPMSEAL2). Exports of OPMSEAL1 are
+ * read as they are.
+ */
+
+#include "opm.h"
+
+struct sealed_header {
+	char magic[8];
+	unsigned char salt[SEALED_SALT_LEN];
+	unsigned int iterations;
+} __attribute__((packed));
+
+struct sealed_aad {
+	struct sealed_header h;
+	unsigned long long index;
+	unsigned int word;
+} __attribute__((packed));
+
+struct sealed_stream {
+	FILE *f;
+	struct sealed_header h;
+	unsigned char key[SEALED_KEY_LEN];
+	unsigned long long index;
+	unsigned char plain[SEALED_CHUNK];
+	unsigned char sealed[SEALED_CHUNK + SEAL_OVERHEAD];
+	unsigned int len, pos;
+	int done;
+	int *complete;		/* writing, whether to end the stream on close */
+	int deflated;
+	z_stream z;
+};
+
+static int sealed_chunk(struct sealed_stream *s, int last) {
+	struct sealed_aad aad;
+	unsigned int word = (s->len + SEAL_OVERHEAD) | (last ? SEALED_LAST : 0);
+
+	aad.h = s->h;
+	aad.index = s->index++;
+	aad.word = word;
+
+	if (!seal_data(s->sealed, s->plain, s->len, (unsigned char *) &aad, sizeof(aad), (char *) s->key) ||
+			fwrite(&word, sizeof(word), 1, s->f) != 1 ||
+			fwrite(s->sealed, s->len + SEAL_OVERHEAD, 1, s->f) != 1)
+		return 0;
+
+	memset(s->plain, 0, s->len);
+	s->len = 0;
+
+	return 1;
+}
+
+/* Deflate into the chunk buffer, sealing the chunks that fill up */
+static int sealed_deflate(struct sealed_stream *s, int flush) {
+	int rv;
+
+	do {
+		if (s->len == SEALED_CHUNK && !sealed_chunk(s, 0))
+			return 0;
+
+		s->z.next_out = s->plain + s->len;
+		s->z.avail_out = SEALED_CHUNK - s->len;
+		rv = deflate(&s->z, flush);
+		s->len = SEALED_CHUNK - s->z.avail_out;
+
+		if (rv == Z_STREAM_ERROR)
+			return 0;
+	} while (s->z.avail_in || (flush == Z_FINISH && rv != Z_STREAM_END));
+
+	return 1;
+}
+
+static ssize_t sealed_write(void *cookie, const char *buf, size_t size) {
+	struct sealed_stream *s = cookie;
+	size_t n, done = 0;
+
+	if (s->deflated) {
+		s->z.next_in = (unsigned char *) buf;
+		s->z.avail_in = size;
+
+		return sealed_deflate(s, Z_NO_FLUSH) ? (ssize_t) size : -1;
+	}
+
+	while (done < size) {
+		if (s->len == SEALED_CHUNK && !sealed_chunk(s, 0))
+			return -1;
+
+		n = SEALED_CHUNK - s->len;
+		if (n > size - done)
+			n = size - done;
+
+		memcpy(s->plain + s->len, buf + done, n);
+		s->len += n;
+		done += n;
+	}
+
+	return done;
+}
+
+/* Open the next chunk into the plain buffer */
+static int sealed_next(struct sealed_stream *s) {
+	struct sealed_aad aad;
+	unsigned int word, len;
+
+	if (fread(&word, sizeof(word), 1, s->f) != 1)
+		return 0;
+
+	len = word & ~SEALED_LAST;
+	if (len < SEAL_OVERHEAD || len > sizeof(s->sealed) ||
+			fread(s->sealed, len, 1, s->f) != 1)
+		return 0;
+
+	aad.h = s->h;
+	aad.index = s->index++;
+	aad.word = word;
+
+	if (!open_data(s->plain, s->sealed, len, (unsigned char *) &aad, sizeof(aad), (char *) s->key))
+		return 0;
+
+	s->len = len - SEAL_OVERHEAD;
+	s->pos = 0;
+	s->done = !!(word & SEALED_LAST);
+
+	return 1;
+}
+
+/* The deflate stream has to end right with the last chunk */
+static ssize_t sealed_inflate(struct sealed_stream *s, char *buf, size_t size) {
+	size_t n;
+	int rv;
+
+	while (1) {
+		if (s->pos == s->len && !s->done && !sealed_next(s))
+			return -1;
+
+		s->z.next_in = s->plain + s->pos;
+		s->z.avail_in = s->len - s->pos;
+		s->z.next_out = (unsigned char *) buf;
+		s->z.avail_out = size;
+
+		rv = inflate(&s->z, Z_NO_FLUSH);
+		s->pos = s->len - s->z.avail_in;
+		n = size - s->z.avail_out;
+
+		if (rv == Z_STREAM_END && (s->pos != s->len || !s->done))
+			return -1;
+
+		if (n || rv == Z_STREAM_END)
+			return n;
+
+		if ((rv != Z_OK && rv != Z_BUF_ERROR) || (s->pos == s->len && s->done))
+			return -1;
+	}
+}
+
+static ssize_t sealed_read(void *cookie, char *buf, size_t size) {
+	struct sealed_stream *s = cookie;
+	ssize_t rv;
+	size_t n;
+
+	if (s->deflated) {
+		rv = sealed_inflate(s, buf, size);
+		if (rv < 0)
+			goto bad;
+
+		return rv;
+	}
+
+	if (s->pos == s->len) {
+		if (s->done)
+			return 0;
+
+		if (!sealed_next(s))
+			goto bad;
+	}
+
+	n = s->len - s->pos;
+	if (n > size)
+		n = size;
+
+	memcpy(buf, s->plain + s->pos, n);
+	s->pos += n;
+
+	return n;
+bad:
+	errno = EBADMSG;
+	return -1;
+}
+
+static void sealed_end(struct sealed_stream *s) {
+	if (!s->deflated)
+		return;
+
+	if (s->complete)
+		deflateEnd(&s->z);
+	else
+		inflateEnd(&s->z);
+	s->deflated = 0;
+}
+
+static int sealed_close(void *cookie) {
+	struct sealed_stream *s = cookie;
+	int rv = 0;
+
+	/* the last chunk marks the end, even when empty */
+	if (s->complete && *s->complete &&
+			((s->deflated && !sealed_deflate(s, Z_FINISH)) || !sealed_chunk(s, 1)))
+		rv = -1;
+
+	sealed_end(s);
+	memset(s, 0, sizeof(*s));
+	free(s);
+
+	return rv;
+}
+
+/* Whether the file starts like a sealed export, it must be seekable */
+int is_sealed(FILE *f) {
+	char magic[sizeof(SEALED_MAGIC) - 1];
+	int rv;
+
+	rv = fread(magic, sizeof(magic), 1, f) == 1 && (!memcmp(magic, SEALED_MAGIC, sizeof(magic)) ||
+		!memcmp(magic, SEALED_DEFLATE_MAGIC, sizeof(magic)));
+	rewind(f);
+
+	return rv;
+}
+
+/*
+ * Wrap f into a stream that opens what is read from it or, with
+ * 'complete' given, seals what is written into it. The end of the
+ * stream is only sealed on close if *complete is set by then, so an
+ * export that failed halfway can't pass for a whole one. Closing the
+ * stream leaves f open.
+ */
+FILE *sealed_open(FILE *f, int *complete, char *passphrase) {
+	cookie_io_functions_t io = { sealed_read, sealed_write, NULL, sealed_close };
+	struct sealed_stream *s;
+	FILE *sf;
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		fprintf(stderr, "Memory allocation error\n");
+		return NULL;
+	}
+
+	s->z.zalloc = secure_zalloc;
+	s->z.zfree = secure_zfree;
+	s->complete = complete;
+
+	if (complete) {
+		memcpy(s->h.magic, SEALED_DEFLATE_MAGIC, sizeof(s->h.magic));
+		s->h.iterations = SEALED_KDF_ITER;
+		if (RAND_bytes(s->h.salt, sizeof(s->h.salt)) != 1 ||
+				fwrite(&s->h, sizeof(s->h), 1, f) != 1) {
+			fprintf(stderr, "Can't write export header\n");
+			goto err;
+		}
+	} else {
+		if (fread(&s->h, sizeof(s->h), 1, f) != 1 ||
+				(memcmp(s->h.magic, SEALED_MAGIC, sizeof(s->h.magic)) &&
+				memcmp(s->h.magic, SEALED_DEFLATE_MAGIC, sizeof(s->h.magic))) ||
+				!s->h.iterations || s->h.iterations > SEALED_KDF_MAX_ITER) {
+			fprintf(stderr, "Not a sealed export\n");
+			goto err;
+		}
+	}
+
+	if (!memcmp(s->h.magic, SEALED_DEFLATE_MAGIC, sizeof(s->h.magic))) {
+		if ((complete ? deflateInit(&s->z, Z_BEST_SPEED) : inflateInit(&s->z)) != Z_OK) {
+			fprintf(stderr, "Compression error\n");
+			goto err;
+		}
+		s->deflated = 1;
+	}
+
+	if (!PKCS5_PBKDF2_HMAC(passphrase, strlen(passphrase), s->h.salt, sizeof(s->h.salt),
+			s->h.iterations, EVP_sha256(), sizeof(s->key), s->key)) {
+		fprintf(stderr, "Key derivation failed\n");
+		goto err;
+	}
+
+	s->f = f;
+
+	sf = fopencookie(s, complete ? "w" : "r", io);
+	if (!sf)
+		goto err;
+
+	return sf;
+err:
+	sealed_end(s);
+	memset(s, 0, sizeof(*s));
+	free(s);
+	return NULL;
+}
+
+static void csv_put(FILE *f, char *s, int last) {
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"')
+			fputc('"', f);
+		fputc(*s, f);
+	}
+	fputc('"', f);
+	fputc(last ? '\n' : ',', f);
+}
+
+static void json_put(FILE *f, char *key, char *s, int last) {
+	unsigned char c;
+
+	fprintf(f, "\"%s\": \"", key);
+	for (; *s; s++) {
+		c = *s;
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c == '\n')
+			fputs("\\n", f);
+		else if (c == '\t')
+			fputs("\\t", f);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputs(last ? "\"}" : "\", ", f);
+}
+
+static void export_entry(FILE *f, struct db_entry *de, int format, unsigned long long n) {
+	if (format == EXPORT_CSV) {
+		csv_put(f, de->name, 0);
+		csv_put(f, de->url, 0);
+		csv_put(f, de->login, 0);
+		csv_put(f, de->password, 0);
+		csv_put(f, de->notes, 1);
+		return;
+	}
+
+	fputs(n ? ",\n  {" : "\n  {", f);
+	json_put(f, "name", de->name, 0);
+	json_put(f, "url", de->url, 0);
+	json_put(f, "username", de->login, 0);
+	json_put(f, "password", de->password, 0);
+	json_put(f, "notes", de->notes, 1);
+}
+
+int export_db(char *path, int format, int seal) {
+	struct entry_stream es;
+	struct parcel pc;
+	struct db_entry *de;
+	unsigned long long n = 0;
+	char *pass = NULL, *again;
+	FILE *f, *out;
+	int fd, rv, complete = 0;
+
+	if (seal) {
+		pass = ask_secret("Export passphrase: ");
+		again = ask_secret("Export passphrase (one more time): ");
+		rv = !*pass || strcmp(pass, again);
+		memset(again, 0, strlen(again));
+		free(again);
+		if (rv) {
+			fprintf(stderr, *pass ? "Passphrase mismatch\n" : "Passphrase is required\n");
+			memset(pass, 0, strlen(pass));
+			free(pass);
+			return 0;
+		}
+	}
+
+	if (strcmp(path, "-")) {
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		f = fd < 0 ? NULL : fdopen(fd, "w");
+	} else {
+		f = stdout;
+	}
+
+	if (!f) {
+		fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+		rv = 0;
+		goto out;
+	}
+
+	out = f;
+	if (seal) {
+		out = sealed_open(f, &complete, pass);
+		if (!out) {
+			rv = 0;
+			goto out;
+		}
+	}
+
+	pc.type = PT_EXPORT;
+	pc.length = 0;
+	pc.data = NULL;
+
+	rv = stream_open(&es, &pc);
+	if (rv) {
+		if (format == EXPORT_CSV)
+			fputs("name,url,username,password,notes\n", out);
+		else
+			fputc('[', out);
+
+		while ((de = stream_next(&es))) {
+			export_entry(out, de, format, n++);
+			if (!(n % 1000))
+				fprintf(stderr, "\rExported %llu entries", n);
+		}
+
+		if (format == EXPORT_JSON)
+			fputs(n ? "\n]\n" : "]\n", out);
+
+		rv = !es.error;
+		stream_close(&es);
+	}
+
+	if (ferror(out))
+		rv = 0;
+
+	complete = rv;
+	if (out != f && fclose(out))
+		rv = 0;
+out:
+	if (f && (f == stdout ? fflush(f) : fclose(f)))
+		rv = 0;
+
+	if (pass) {
+		memset(pass, 0, strlen(pass));
+		free(pass);
+	}
+
+	if (!rv) {
+		fprintf(stderr, "Export failed\n");
+		return 0;
+	}
+
+	fprintf(stderr, "\rExported %llu entries\n", n);
+
+	return 1;
+}
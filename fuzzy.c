@@ -0,0 +1,206 @@
+/*
+ * opm - Open Password Manager.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Alexander Miroch
+ *    Email: <alexander.miroch@gmail.com>
+ */
+
+/*
+ * Fuzzy matching: the pattern has to appear in the field as a
+ * case-insensitive subsequence. Among all the ways it does, the best
+ * scoring one counts, where matched characters earn more at the start
+ * of the field, at word starts and right after the previous match, and
+ * skipped characters cost a little.
+ */
+
+#include "opm.h"
+
+#define FZ_MATCH	16
+#define FZ_PREFIX	12
+#define FZ_BOUNDARY	8
+#define FZ_CONSECUTIVE	6
+#define FZ_GAP		1
+
+/* two rows of the score table, fields never exceed a record */
+static int fz_rows[2 * MAX_RECORD_LEN];
+
+static inline unsigned char fz_fold(unsigned char c) {
+	return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+static int fz_bonus(const char *hay, size_t i) {
+	unsigned char c = hay[i], prev;
+
+	if (!i)
+		return FZ_PREFIX + FZ_BOUNDARY;
+
+	prev = hay[i - 1];
+	if (!isalnum(prev) && isalnum(c))
+		return FZ_BOUNDARY;
+
+	/* camelCase */
+	if (islower(prev) && isupper(c))
+		return FZ_BOUNDARY;
+
+	return 0;
+}
+
+/* Cheap check before scoring */
+static int fz_subsequence(const char *hay, size_t hlen, const char *needle, size_t nlen) {
+	size_t i, j = 0;
+
+	for (i = 0; i < hlen && j < nlen; i++) {
+		if (fz_fold(hay[i]) == fz_fold(needle[j]))
+			j++;
+	}
+
+	return j == nlen;
+}
+
+/*
+ * Returns FUZZY_NONE when there is no match. row[i] is the best score
+ * of the needle prefix matched so far with its last character at hay[i].
+ */
+int fuzzy_score(const char *hay, size_t hlen, const char *needle, size_t nlen) {
+	int *prev, *cur, *tmp, run, best;
+	size_t i, j;
+
+	if (!nlen || nlen > hlen || hlen > MAX_RECORD_LEN ||
+			!fz_subsequence(hay, hlen, needle, nlen))
+		return FUZZY_NONE;
+
+	prev = fz_rows;
+	cur = fz_rows + hlen;
+
+	for (i = 0; i < hlen; i++) {
+		prev[i] = FUZZY_NONE;
+		if (fz_fold(hay[i]) == fz_fold(needle[0]))
+			prev[i] = FZ_MATCH + fz_bonus(hay, i);
+	}
+
+	for (j = 1; j < nlen; j++) {
+		run = FUZZY_NONE;
+		cur[0] = FUZZY_NONE;
+
+		for (i = 1; i < hlen; i++) {
+			/* best match of the previous character before i - 1, gaps paid */
+			if (i >= 2 && prev[i - 2] != FUZZY_NONE && prev[i - 2] > run)
+				run = prev[i - 2];
+
+			cur[i] = FUZZY_NONE;
+			if (fz_fold(hay[i]) == fz_fold(needle[j])) {
+				best = FUZZY_NONE;
+				if (prev[i - 1] != FUZZY_NONE)
+					best = prev[i - 1] + FZ_CONSECUTIVE;
+				if (run != FUZZY_NONE && run - FZ_GAP > best)
+					best = run - FZ_GAP;
+
+				if (best != FUZZY_NONE)
+					cur[i] = best + FZ_MATCH + fz_bonus(hay, i);
+			}
+
+			if (run != FUZZY_NONE)
+				run -= FZ_GAP;
+		}
+
+		tmp = prev;
+		prev = cur;
+		cur = tmp;
+	}
+
+	best = FUZZY_NONE;
+	for (i = 0; i < hlen; i++) {
+		if (prev[i] != FUZZY_NONE && prev[i] > best)
+			best = prev[i];
+	}
+
+	if (best == FUZZY_NONE)
+		return FUZZY_NONE;
+
+	/* prefer short fields among equal matches */
+	return best - (int) (hlen - nlen) / 8;
+}
+
+/* Bounded min-heap: the weakest of the best k sits on top */
+static int fz_worse(struct fuzzy_hit *a, struct fuzzy_hit *b) {
+	if (a->score != b->score)
+		return a->score < b->score;
+
+	return a->slot > b->slot;
+}
+
+static void fz_sift_down(struct fuzzy_hit *h, unsigned int n, unsigned int i) {
+	struct fuzzy_hit t;
+	unsigned int c;
+
+	while ((c = 2 * i + 1) < n) {
+		if (c + 1 < n && fz_worse(&h[c + 1], &h[c]))
+			c++;
+		if (!fz_worse(&h[c], &h[i]))
+			break;
+
+		t = h[i];
+		h[i] = h[c];
+		h[c] = t;
+		i = c;
+	}
+}
+
+static void fz_sift_up(struct fuzzy_hit *h, unsigned int i) {
+	struct fuzzy_hit t;
+	unsigned int p;
+
+	while (i) {
+		p = (i - 1) / 2;
+		if (!fz_worse(&h[i], &h[p]))
+			break;
+
+		t = h[i];
+		h[i] = h[p];
+		h[p] = t;
+		i = p;
+	}
+}
+
+void fuzzy_offer(struct fuzzy_top *top, int score, unsigned int slot) {
+	struct fuzzy_hit hit = { score, slot };
+
+	if (top->count < top->k) {
+		top->hits[top->count] = hit;
+		fz_sift_up(top->hits, top->count++);
+		return;
+	}
+
+	if (!fz_worse(&top->hits[0], &hit))
+		return;
+
+	top->hits[0] = hit;
+	fz_sift_down(top->hits, top->count, 0);
+}
+
+/* Empty the heap into slots, best first */
+void fuzzy_drain(struct fuzzy_top *top, unsigned int *slots) {
+	unsigned int n = top->count;
+
+	while (top->count) {
+		slots[--top->count] = top->hits[0].slot;
+		top->hits[0] = top->hits[top->count];
+		fz_sift_down(top->hits, top->count, 0);
+	}
+
+	top->count = n;
+}
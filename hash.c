@@ -0,0 +1,183 @@
+/*
+ * opm - Open Password Manager.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Alexander Miroch
+ *    Email: <alexander.miroch@gmail.com>
+ */
+
+/*
+ * Entry id to slot index. Open addressing with linear probing, kept at
+ * most half full; removal shifts the following run back instead of
+ * leaving tombstones. Id 0 marks an empty bucket.
+ */
+
+#include "opm.h"
+
+struct id_bucket {
+	unsigned long long id;
+	unsigned int slot;
+};
+
+static struct id_bucket *buckets = NULL;
+static unsigned int id_mask = 0, id_count = 0;
+
+static unsigned int id_hash(unsigned long long id) {
+	id ^= id >> 33;
+	id *= 0xff51afd7ed558ccdULL;
+	id ^= id >> 33;
+
+	return (unsigned int) id & id_mask;
+}
+
+static int id_index_grow(void) {
+	struct id_bucket *old = buckets;
+	unsigned int i, n = old ? id_mask + 1 : 0, size;
+
+	size = n ? n * 2 : ID_INDEX_MIN;
+	buckets = calloc(size, sizeof(struct id_bucket));
+	if (!buckets) {
+		syslog(LOG_ERR, "Memory allocation error");
+		buckets = old;
+		return 0;
+	}
+
+	id_mask = size - 1;
+	id_count = 0;
+
+	for (i = 0; i < n; i++) {
+		if (old[i].id)
+			id_index_put(old[i].id, old[i].slot);
+	}
+
+	free(old);
+
+	return 1;
+}
+
+/* Grow now so that 'n' more ids go in without an allocation */
+int id_index_reserve(unsigned int n) {
+	while (!buckets || (id_count + n) * 2 > id_mask + 1) {
+		if (!id_index_grow())
+			return 0;
+	}
+
+	return 1;
+}
+
+int id_index_put(unsigned long long id, unsigned int slot) {
+	unsigned int h;
+
+	if (!buckets || (id_count + 1) * 2 > id_mask + 1) {
+		if (!id_index_grow())
+			return 0;
+	}
+
+	for (h = id_hash(id); buckets[h].id; h = (h + 1) & id_mask) {
+		if (buckets[h].id == id) {
+			buckets[h].slot = slot;
+			return 1;
+		}
+	}
+
+	buckets[h].id = id;
+	buckets[h].slot = slot;
+	id_count++;
+
+	return 1;
+}
+
+/* Returns the slot of the entry or -1 */
+int id_index_get(unsigned long long id) {
+	unsigned int h;
+
+	if (!buckets || !id)
+		return -1;
+
+	for (h = id_hash(id); buckets[h].id; h = (h + 1) & id_mask) {
+		if (buckets[h].id == id)
+			return buckets[h].slot;
+	}
+
+	return -1;
+}
+
+void id_index_del(unsigned long long id) {
+	unsigned int h, j, home;
+
+	if (!buckets || !id)
+		return;
+
+	for (h = id_hash(id); buckets[h].id; h = (h + 1) & id_mask) {
+		if (buckets[h].id == id)
+			break;
+	}
+
+	if (!buckets[h].id)
+		return;
+
+	/* pull back every entry of the run that may not sit behind the hole */
+	for (j = (h + 1) & id_mask; buckets[j].id; j = (j + 1) & id_mask) {
+		home = id_hash(buckets[j].id);
+		if (((j - home) & id_mask) < ((j - h) & id_mask))
+			continue;
+
+		buckets[h] = buckets[j];
+		h = j;
+	}
+
+	buckets[h].id = 0;
+	id_count--;
+}
+
+void id_index_clear(void) {
+	free(buckets);
+	buckets = NULL;
+	id_mask = id_count = 0;
+}
+
+struct id_state {
+	struct id_bucket *buckets;
+	unsigned int mask, count;
+};
+
+int id_index_park(struct vault *v) {
+	struct id_state *s = v->ids;
+
+	if (!s) {
+		s = malloc(sizeof(*s));
+		if (!s) {
+			syslog(LOG_ERR, "Memory allocation error");
+			return 0;
+		}
+		v->ids = s;
+	}
+
+	s->buckets = buckets;
+	s->mask = id_mask;
+	s->count = id_count;
+
+	buckets = NULL;
+	id_mask = id_count = 0;
+
+	return 1;
+}
+
+void id_index_resume(struct vault *v) {
+	buckets = v->ids->buckets;
+	id_mask = v->ids->mask;
+	id_count = v->ids->count;
+}
@@ -0,0 +1,404 @@
+/*
+ * opm - Open Password Manager.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Alexander Miroch
+ *    Email: <alexander.miroch@gmail.com>
+ */
+
+/*
+ * Revision history. When an entry is changed, the fields of the old
+ * version that differ from the new one go into a revision, stored
+ * under id | BT_HISTORY with the older revisions behind it. Each
+ * revision only holds what differs from the next newer version, so a
+ * new one goes in front without touching the others, and any version
+ * is rebuilt by applying the revisions to the current entry in turn.
+ *
+ * Revisions are pushed into the file by checkpoints and journal
+ * replay, like the entries themselves. At most keep_revisions of them
+ * are kept, compaction drops the ones beyond that.
+ */
+
+#include "opm.h"
+
+unsigned int keep_revisions = DEFAULT_KEEP_REVISIONS;
+
+/* Histories saved while the file is rewritten: id, length, revisions */
+static unsigned char *saved = NULL;
+static unsigned int saved_len = 0, saved_size = 0;
+
+/*
+ * Encode the fields of 'old' that differ from 'new' as a revision.
+ * Returns the length, 0 if nothing differs or it does not fit.
+ */
+unsigned int revision_make(struct db_entry *old, struct db_entry *new, unsigned char *buf) {
+	struct revision r;
+	struct db_entry d;
+	char **f;
+	int i;
+
+	memset(&d, 0, sizeof(d));
+	r.mask = 0;
+
+	for (i = 0; i < RECORD_FIELDS; i++) {
+		f = record_fields(old, i);
+		if (strcmp(*f, *record_fields(new, i))) {
+			r.mask |= 1 << i;
+			*record_fields(&d, i) = *f;
+		}
+	}
+
+	if (!r.mask)
+		return 0;
+
+	r.len = record_encode(&d, buf + sizeof(r), MAX_RECORD_LEN - sizeof(r));
+	if (!r.len)
+		return 0;
+
+	r.time = time(NULL);
+	memcpy(buf, &r, sizeof(r));
+
+	return sizeof(r) + r.len;
+}
+
+/*
+ * Turn 'de' into the version before the revision at rev, its fields
+ * may then point into rev. Returns the length of the revision.
+ */
+static unsigned int revision_apply(unsigned char *rev, unsigned int len, struct db_entry *de) {
+	struct revision r;
+	struct db_entry d;
+	int i;
+
+	if (len < sizeof(r))
+		return 0;
+
+	memcpy(&r, rev, sizeof(r));
+	if (r.len > len - sizeof(r) || record_decode(rev + sizeof(r), r.len, &d) != r.len)
+		return 0;
+
+	for (i = 0; i < RECORD_FIELDS; i++) {
+		if (r.mask & (1 << i))
+			*record_fields(de, i) = *record_fields(&d, i);
+	}
+
+	return sizeof(r) + r.len;
+}
+
+/* Copy whole revisions from src as long as they fit, at most 'count' */
+static unsigned int history_copy(unsigned char *dst, unsigned int room, unsigned char *src,
+		unsigned int len, unsigned int count) {
+	struct revision r;
+	unsigned int off = 0, n;
+
+	for (; count && len - off >= sizeof(r); count--) {
+		memcpy(&r, src + off, sizeof(r));
+		n = sizeof(r) + r.len;
+		if (n > len - off || n > room - off)
+			break;
+		off += n;
+	}
+
+	memcpy(dst, src, off);
+
+	return off;
+}
+
+/* Put the revision in front of the history of the entry, in a transaction */
+int history_push(unsigned long long id, unsigned char *rev, unsigned int len) {
+	unsigned char old[MAX_RECORD_LEN], buf[MAX_RECORD_LEN];
+	unsigned int olen;
+	int rv;
+
+	if (bt_version < HISTORY_VERSION_CODE || !keep_revisions || len > sizeof(buf))
+		return 1;
+
+	olen = bt_get(id | BT_HISTORY, old);
+	memcpy(buf, rev, len);
+	len += history_copy(buf + len, sizeof(buf) - len, old, olen, keep_revisions - 1);
+
+	rv = bt_put(id | BT_HISTORY, buf, len);
+	memset(old, 0, sizeof(old));
+	memset(buf, 0, sizeof(buf));
+
+	return rv;
+}
+
+static int save_history(unsigned long long key, unsigned char *val, unsigned int len) {
+	unsigned long long id = key & ~BT_HISTORY;
+	unsigned int size = saved_size ? saved_size : CHUNK_SIZE;
+	unsigned char *tmp;
+
+	while (saved_len + sizeof(id) + sizeof(len) + len > size)
+		size *= 2;
+
+	if (size != saved_size) {
+		tmp = secure_realloc(saved, size);
+		if (!tmp) {
+			syslog(LOG_ERR, "Memory allocation error");
+			return 0;
+		}
+		saved = tmp;
+		saved_size = size;
+	}
+
+	memcpy(saved + saved_len, &id, sizeof(id));
+	memcpy(saved + saved_len + sizeof(id), &len, sizeof(len));
+	memcpy(saved + saved_len + sizeof(id) + sizeof(len), val, len);
+	saved_len += sizeof(id) + sizeof(len) + len;
+
+	return 1;
+}
+
+void history_drop(void) {
+	secure_free(saved);
+	saved = NULL;
+	saved_len = saved_size = 0;
+}
+
+/* Read all histories in before the file is rewritten */
+int history_save(void) {
+	int rv;
+
+	history_drop();
+
+	/* 0x101 databases have no paged file to read from */
+	if (bt_version < HISTORY_VERSION_CODE || !keep_revisions || !bt_meta.root)
+		return 1;
+
+	if (!bt_begin())
+		return 0;
+
+	rv = bt_walk(BT_HISTORY, BT_SECRET, save_history);
+	bt_abort();
+
+	if (!rv)
+		history_drop();
+
+	return rv;
+}
+
+/* Put the saved histories of live entries into the new file, trimmed */
+int history_load(void) {
+	unsigned char buf[MAX_RECORD_LEN];
+	unsigned long long id;
+	unsigned int off, len, n;
+	int rv = 1;
+
+	for (off = 0; off < saved_len && rv; off += sizeof(id) + sizeof(len) + len) {
+		memcpy(&id, saved + off, sizeof(id));
+		memcpy(&len, saved + off + sizeof(id), sizeof(len));
+
+		if (id_index_get(id) < 0)
+			continue;
+
+		n = history_copy(buf, sizeof(buf), saved + off + sizeof(id) + sizeof(len), len, keep_revisions);
+		if (n)
+			rv = bt_put(id | BT_HISTORY, buf, n);
+	}
+
+	memset(buf, 0, sizeof(buf));
+	history_drop();
+
+	return rv;
+}
+
+static int history_request(void *data, unsigned int len, struct history_request *hr, int *slot) {
+	if (!data || len != sizeof(*hr)) {
+		syslog(LOG_ERR, "Invalid history request");
+		return 0;
+	}
+
+	memcpy(hr, data, sizeof(*hr));
+
+	*slot = id_index_get(hr->id);
+	if (*slot < 0) {
+		syslog(LOG_ERR, "No entry with id %llu", hr->id);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * One frame per revision, newest first: the revision header and the
+ * version before it, without password and notes.
+ */
+int pt_history(void *data, unsigned int len, int csk) {
+	unsigned char cur[MAX_RECORD_LEN], hist[MAX_RECORD_LEN];
+	unsigned char buf[sizeof(struct revision) + MAX_RECORD_LEN];
+	struct history_request hr;
+	struct db_entry de, v;
+	unsigned int clen, hlen, off, n, size;
+	int slot, rv = 0;
+
+	if (!history_request(data, len, &hr, &slot))
+		return 0;
+
+	clen = db_full_record(slot, cur);
+	if (!clen || !db_history(hr.id, hist, &hlen))
+		goto out;
+
+	record_decode(cur, clen, &de);
+
+	for (off = 0; off < hlen; off += n) {
+		n = revision_apply(hist + off, hlen - off, &de);
+		if (!n) {
+			syslog(LOG_ERR, "History of entry %llu is corrupted", hr.id);
+			goto out;
+		}
+
+		v = de;
+		v.password = v.notes = "";
+		memcpy(buf, hist + off, sizeof(struct revision));
+		size = sizeof(struct revision) + record_encode(&v, buf + sizeof(struct revision), MAX_RECORD_LEN);
+
+		if (!send_reply(csk, &size, sizeof(size)) || !send_reply(csk, buf, size))
+			goto out;
+	}
+
+	size = 0;
+	rv = send_reply(csk, &size, sizeof(size));
+out:
+	memset(cur, 0, sizeof(cur));
+	memset(hist, 0, sizeof(hist));
+	memset(buf, 0, sizeof(buf));
+
+	return rv;
+}
+
+/* Bring back the version before revision hr.rev, the current one becomes a revision */
+int pt_restore(void *data, unsigned int len, int csk) {
+	unsigned char cur[MAX_RECORD_LEN], hist[MAX_RECORD_LEN], buf[MAX_RECORD_LEN];
+	struct history_request hr;
+	struct db_entry de;
+	unsigned int clen, hlen, off, n, i;
+	int slot, rv = 0;
+
+	if (!history_request(data, len, &hr, &slot))
+		return 0;
+
+	clen = db_full_record(slot, cur);
+	if (!clen || !db_history(hr.id, hist, &hlen))
+		goto out;
+
+	record_decode(cur, clen, &de);
+
+	for (i = 0, off = 0; i < hr.rev && off < hlen; i++, off += n) {
+		n = revision_apply(hist + off, hlen - off, &de);
+		if (!n) {
+			syslog(LOG_ERR, "History of entry %llu is corrupted", hr.id);
+			goto out;
+		}
+	}
+
+	if (!hr.rev || i < hr.rev) {
+		syslog(LOG_ERR, "Entry %llu has no revision %u", hr.id, hr.rev);
+		goto out;
+	}
+
+	n = record_encode(&de, buf, sizeof(buf));
+	rv = n && db_update(slot, hr.id, buf, n);
+out:
+	memset(cur, 0, sizeof(cur));
+	memset(hist, 0, sizeof(hist));
+	memset(buf, 0, sizeof(buf));
+
+	return rv;
+}
+
+static void changed_fields(unsigned int mask) {
+	static char *names[RECORD_FIELDS] = { "name", "url", "login", "password", "notes" };
+	int i, n = 0;
+
+	for (i = 0; i < RECORD_FIELDS; i++) {
+		if (mask & (1 << i))
+			printf("%s%s", n++ ? ", " : "", names[i]);
+	}
+}
+
+int show_history(unsigned long long id, int is_verbose) {
+	unsigned char buf[MAX_PARCEL_LEN];
+	struct history_request hr;
+	struct revision r;
+	struct parcel pc;
+	struct db_entry de;
+	unsigned int len, n = 0;
+	char when[32];
+	time_t t;
+	int fd, rv = 0;
+
+	hr.id = id;
+	hr.rev = 0;
+
+	pc.type = PT_HISTORY;
+	pc.length = sizeof(hr);
+	pc.data = (void *) &hr;
+
+	fd = do_connect();
+	if (!fd || !_send_parcel(fd, &pc))
+		return 0;
+
+	while (_get_frame(fd, buf, &len)) {
+		if (!len) {
+			rv = is_ok_reply(fd);
+			break;
+		}
+
+		memcpy(&r, buf, sizeof(r));
+		if (len < sizeof(r) || record_decode(buf + sizeof(r), len - sizeof(r), &de) != len - sizeof(r))
+			break;
+
+		t = r.time;
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&t));
+		printf("%3u  %s  ", ++n, when);
+		changed_fields(r.mask);
+		if (is_verbose)
+			printf("  %s (%s %s)", de.name, de.login, de.url);
+		printf("\n");
+	}
+
+	close(fd);
+
+	if (!rv) {
+		fprintf(stderr, "Can't get history of entry %llu\n", id);
+		return 0;
+	}
+
+	if (!n)
+		printf("No revisions\n");
+
+	return 1;
+}
+
+int restore_revision(unsigned long long id, unsigned int rev) {
+	struct history_request hr;
+	struct parcel pc;
+
+	hr.id = id;
+	hr.rev = rev;
+
+	pc.type = PT_RESTORE;
+	pc.length = sizeof(hr);
+	pc.data = (void *) &hr;
+
+	if (!send_parcel(&pc)) {
+		fprintf(stderr, "Can't restore revision %u of entry %llu\n", rev, id);
+		return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,630 @@
+/*
+ * opm - Open Password Manager.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Alexander Miroch
+ *    Email: <alexander.miroch@gmail.com>
+ */
+
+/*
+ * Bulk import of password manager exports. CSV files need a header
+ * line naming the columns (browser and KeePass exports have one), JSON
+ * files are searched for arrays of objects, with the members of nested
+ * objects (e.g. "login": {"username": ...}) belonging to the entry too.
+ * The file is read one entry at a time and the entries go to the
+ * daemon in full parcels, which stages them and adds them all at once
+ * when the last one arrives. Sealed exports (see export.c) are opened
+ * on the fly.
+ */
+
+#include "opm.h"
+
+enum {
+	IF_NAME,
+	IF_URL,
+	IF_LOGIN,
+	IF_PASSWORD,
+	IF_NOTES
+};
+
+#define MAX_CSV_COLUMNS	64
+#define MAX_JSON_DEPTH	32
+
+static const struct {
+	const char *key;
+	int field;
+} import_keys[] = {
+	{ "name", IF_NAME },
+	{ "title", IF_NAME },
+	{ "account", IF_NAME },
+	{ "url", IF_URL },
+	{ "uri", IF_URL },
+	{ "web site", IF_URL },
+	{ "website", IF_URL },
+	{ "login_uri", IF_URL },
+	{ "login", IF_LOGIN },
+	{ "username", IF_LOGIN },
+	{ "user name", IF_LOGIN },
+	{ "login name", IF_LOGIN },
+	{ "login_username", IF_LOGIN },
+	{ "email", IF_LOGIN },
+	{ "password", IF_PASSWORD },
+	{ "login_password", IF_PASSWORD },
+	{ "notes", IF_NOTES },
+	{ "note", IF_NOTES },
+	{ "comments", IF_NOTES },
+	{ "extra", IF_NOTES },
+	{ NULL, 0 }
+};
+
+struct import_entry {
+	char fields[RECORD_FIELDS][MAX_RECORD_LEN];
+	int depth[RECORD_FIELDS];	/* where a JSON value came from, -1 if unset */
+	int truncated;
+};
+
+struct import_state {
+	FILE *f;
+	struct import_entry entry;
+	unsigned char *batch;
+	unsigned int len;
+	unsigned int session;
+	unsigned int read, skipped, sent;
+	struct timespec start;
+};
+
+static int import_key(char *key) {
+	int i;
+
+	for (i = 0; import_keys[i].key; i++) {
+		if (!strcasecmp(key, import_keys[i].key))
+			return import_keys[i].field;
+	}
+
+	return -1;
+}
+
+static void entry_clear(struct import_entry *e) {
+	int i;
+
+	memset(e->fields, 0, sizeof(e->fields));
+	for (i = 0; i < RECORD_FIELDS; i++)
+		e->depth[i] = -1;
+	e->truncated = 0;
+}
+
+static double import_elapsed(struct import_state *st) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - st->start.tv_sec) + (now.tv_nsec - st->start.tv_nsec) / 1e9;
+}
+
+/* The daemon replies with an import_result to the last batch only */
+static int send_batch(struct import_state *st, unsigned int flags, struct import_result *res) {
+	struct import_batch *b = (struct import_batch *) st->batch;
+	struct parcel pc;
+	unsigned int len;
+	double t;
+	int fd, rv;
+
+	b->session = st->session;
+	b->flags = flags | (st->sent ? 0 : IMPORT_BEGIN);
+
+	pc.type = PT_IMPORT;
+	pc.length = st->len;
+	pc.data = st->batch;
+
+	fd = do_connect();
+	if (!fd)
+		return 0;
+
+	if (!_send_parcel(fd, &pc))
+		return 0;
+
+	rv = 1;
+	if (flags & IMPORT_COMMIT)
+		rv = recv(fd, &len, sizeof(len), MSG_WAITALL) == sizeof(len) && len == sizeof(*res) &&
+			recv(fd, res, sizeof(*res), MSG_WAITALL) == sizeof(*res);
+
+	rv = rv && is_ok_reply(fd);
+	close(fd);
+	if (!rv)
+		return 0;
+
+	st->sent++;
+	memset(st->batch + sizeof(*b), 0, st->len - sizeof(*b));
+	st->len = sizeof(*b);
+
+	t = import_elapsed(st);
+	fprintf(stderr, "\rRead %u entries, %.0f entries/s", st->read, t > 0 ? st->read / t : 0.0);
+
+	return 1;
+}
+
+/* "https://www.example.com/login" -> "example.com" */
+static void name_from_url(struct import_entry *e) {
+	char *p = e->fields[IF_URL], *end;
+	size_t n;
+
+	end = strstr(p, "://");
+	if (end)
+		p = end + 3;
+
+	if (!strncasecmp(p, "www.", 4))
+		p += 4;
+
+	n = strcspn(p, "/:?#");
+	memcpy(e->fields[IF_NAME], p, n);
+	e->fields[IF_NAME][n] = '\0';
+}
+
+static int import_entry_done(struct import_state *st) {
+	struct import_entry *e = &st->entry;
+	unsigned char rec[MAX_RECORD_LEN];
+	struct db_entry de;
+	unsigned int len;
+
+	st->read++;
+
+	if (!e->fields[IF_NAME][0])
+		name_from_url(e);
+
+	de.name = e->fields[IF_NAME];
+	de.url = e->fields[IF_URL];
+	de.login = e->fields[IF_LOGIN];
+	de.password = e->fields[IF_PASSWORD];
+	de.notes = e->fields[IF_NOTES];
+
+	len = 0;
+	if (!e->truncated && de.name[0] && de.password[0])
+		len = record_encode(&de, rec, sizeof(rec));
+
+	entry_clear(e);
+
+	if (!len) {
+		st->skipped++;
+		return 1;
+	}
+
+	if (st->len + len > MAX_PARCEL_LEN && !send_batch(st, 0, NULL)) {
+		memset(rec, 0, len);
+		return 0;
+	}
+
+	memcpy(st->batch + st->len, rec, len);
+	st->len += len;
+	memset(rec, 0, len);
+
+	return 1;
+}
+
+static void field_put(struct import_entry *e, int field, int *pos, int c) {
+	if (field < 0)
+		return;
+
+	if (*pos + 1 >= MAX_RECORD_LEN) {
+		e->truncated = 1;
+		return;
+	}
+
+	e->fields[field][(*pos)++] = c;
+}
+
+/*
+ * Read one CSV field into the entry field (or into 'key' for the
+ * header). Returns '\n' at the end of a record, ',' at the end of a
+ * field and EOF when there is nothing left. *n is the number of
+ * characters the field took.
+ */
+static int csv_field(FILE *f, struct import_entry *e, int field, char *key, int ksize, int *n) {
+	int c, pos = 0, quoted = 0;
+
+	for (*n = 0; (c = getc(f)) != EOF; (*n)++) {
+		if (quoted) {
+			if (c == '"') {
+				c = getc(f);
+				if (c != '"') {
+					quoted = 0;
+					if (c == EOF)
+						break;
+					ungetc(c, f);
+					continue;
+				}
+			}
+		} else if (c == '"') {
+			quoted = 1;
+			continue;
+		} else if (c == ',') {
+			break;
+		} else if (c == '\r') {
+			continue;
+		} else if (c == '\n') {
+			break;
+		}
+
+		if (key) {
+			if (pos + 1 < ksize)
+				key[pos++] = c;
+			continue;
+		}
+
+		field_put(e, field, &pos, c);
+	}
+
+	if (key)
+		key[pos] = '\0';
+
+	if (c == EOF)
+		return *n ? '\n' : EOF;
+
+	return c;
+}
+
+static int import_csv(struct import_state *st) {
+	int columns[MAX_CSV_COLUMNS];
+	char key[64];
+	int c, n, col = 0, ncols = 0, known = 0;
+
+	/* header */
+	do {
+		c = csv_field(st->f, NULL, -1, key, sizeof(key), &n);
+		if (c == EOF)
+			break;
+
+		if (ncols < MAX_CSV_COLUMNS) {
+			columns[ncols] = import_key(key);
+			known |= columns[ncols] == IF_PASSWORD;
+			ncols++;
+		}
+	} while (c != '\n');
+
+	if (!known) {
+		if (!ferror(st->f))
+			fprintf(stderr, "No password column in the CSV header\n");
+		return 0;
+	}
+
+	while ((c = csv_field(st->f, &st->entry, col < ncols ? columns[col] : -1, NULL, 0, &n)) != EOF) {
+		/* blank line */
+		if (c == '\n' && !col && !n)
+			continue;
+
+		col++;
+		if (c != '\n')
+			continue;
+
+		if (!import_entry_done(st))
+			return 0;
+		col = 0;
+	}
+
+	/* the file ended right after a comma */
+	if (col)
+		return import_entry_done(st);
+
+	return 1;
+}
+
+static int json_skip_ws(FILE *f) {
+	int c;
+
+	do {
+		c = getc(f);
+	} while (c == ' ' || c == '\t' || c == '\n' || c == '\r');
+
+	return c;
+}
+
+static void utf8_put(struct import_entry *e, int field, int *pos, char *key, int ksize, unsigned int cp) {
+	unsigned char u[4];
+	int n, i;
+
+	if (cp < 0x80) {
+		u[0] = cp;
+		n = 1;
+	} else if (cp < 0x800) {
+		u[0] = 0xc0 | cp >> 6;
+		u[1] = 0x80 | (cp & 0x3f);
+		n = 2;
+	} else if (cp < 0x10000) {
+		u[0] = 0xe0 | cp >> 12;
+		u[1] = 0x80 | (cp >> 6 & 0x3f);
+		u[2] = 0x80 | (cp & 0x3f);
+		n = 3;
+	} else {
+		u[0] = 0xf0 | cp >> 18;
+		u[1] = 0x80 | (cp >> 12 & 0x3f);
+		u[2] = 0x80 | (cp >> 6 & 0x3f);
+		u[3] = 0x80 | (cp & 0x3f);
+		n = 4;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!key)
+			field_put(e, field, pos, u[i]);
+		else if (*pos + 1 < ksize)
+			key[(*pos)++] = u[i];
+	}
+}
+
+static int json_hex4(FILE *f, unsigned int *cp) {
+	int i, c;
+
+	*cp = 0;
+	for (i = 0; i < 4; i++) {
+		c = getc(f);
+		if (!isxdigit(c))
+			return 0;
+		*cp = *cp << 4 | (isdigit(c) ? c - '0' : (c | 0x20) - 'a' + 10);
+	}
+
+	return 1;
+}
+
+/*
+ * The opening quote has been read. The string goes into 'key', into
+ * the entry field or nowhere (field < 0). A field that already holds a
+ * value from a shallower or the same depth is left alone.
+ */
+static int json_string(FILE *f, struct import_entry *e, int field, int depth, char *key, int ksize) {
+	unsigned int cp, lo;
+	int c, pos = 0;
+
+	if (field >= 0) {
+		if (e->depth[field] >= 0 && e->depth[field] <= depth)
+			field = -1;
+		else {
+			memset(e->fields[field], 0, MAX_RECORD_LEN);
+			e->depth[field] = depth;
+		}
+	}
+
+	while ((c = getc(f)) != '"') {
+		if (c < 0x20)
+			return 0;
+
+		if (c == '\\') {
+			c = getc(f);
+			switch (c) {
+				case 'b': c = '\b'; break;
+				case 'f': c = '\f'; break;
+				case 'n': c = '\n'; break;
+				case 'r': c = '\r'; break;
+				case 't': c = '\t'; break;
+				case '"': case '\\': case '/': break;
+				case 'u':
+					if (!json_hex4(f, &cp))
+						return 0;
+
+					/* surrogate pair */
+					if (cp >= 0xd800 && cp < 0xdc00) {
+						if (getc(f) != '\\' || getc(f) != 'u' || !json_hex4(f, &lo) ||
+								lo < 0xdc00 || lo >= 0xe000)
+							return 0;
+						cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+					}
+
+					/* no zeros inside fields */
+					if (!cp)
+						cp = ' ';
+
+					utf8_put(e, field, &pos, key, ksize, cp);
+					continue;
+				default:
+					return 0;
+			}
+		}
+
+		if (key) {
+			if (pos + 1 < ksize)
+				key[pos++] = c;
+			continue;
+		}
+
+		field_put(e, field, &pos, c);
+	}
+
+	if (key)
+		key[pos] = '\0';
+
+	return 1;
+}
+
+/* numbers, true, false and null */
+static int json_scalar(FILE *f, int c) {
+	while (c != EOF && (isalnum(c) || c == '-' || c == '+' || c == '.'))
+		c = getc(f);
+
+	if (c != EOF)
+		ungetc(c, f);
+
+	return 1;
+}
+
+/*
+ * Parse the value starting with c. depth counts the objects and arrays
+ * around it, record is the depth of the entry object it belongs to (0
+ * if none); objects sitting right in an array start an entry.
+ */
+static int json_value(struct import_state *st, int c, int depth, int record, int field, int in_array) {
+	char key[64];
+	int first, is_record;
+
+	if (depth > MAX_JSON_DEPTH) {
+		fprintf(stderr, "JSON nested too deep\n");
+		return 0;
+	}
+
+	if (c == '"')
+		return json_string(st->f, &st->entry, record ? field : -1, depth - record, NULL, 0);
+
+	if (c == '[') {
+		for (first = 1; ; first = 0) {
+			c = json_skip_ws(st->f);
+			if (c == ']' && first)
+				return 1;
+
+			if (!json_value(st, c, depth + 1, record, field, 1))
+				return 0;
+
+			c = json_skip_ws(st->f);
+			if (c == ']')
+				return 1;
+			if (c != ',')
+				return 0;
+		}
+	}
+
+	if (c != '{')
+		return json_scalar(st->f, c);
+
+	is_record = !record && in_array;
+	if (is_record)
+		record = depth + 1;
+
+	for (first = 1; ; first = 0) {
+		c = json_skip_ws(st->f);
+		if (c == '}' && first)
+			break;
+
+		if (c != '"' || !json_string(st->f, NULL, -1, 0, key, sizeof(key)) ||
+				json_skip_ws(st->f) != ':')
+			return 0;
+
+		if (!json_value(st, json_skip_ws(st->f), depth + 1, record, import_key(key), 0))
+			return 0;
+
+		c = json_skip_ws(st->f);
+		if (c == '}')
+			break;
+		if (c != ',')
+			return 0;
+	}
+
+	if (is_record)
+		return import_entry_done(st);
+
+	return 1;
+}
+
+static int import_json(struct import_state *st) {
+	if (!json_value(st, json_skip_ws(st->f), 0, 0, -1, 0)) {
+		if (!ferror(st->f))
+			fprintf(stderr, "Invalid JSON after %u entries\n", st->read);
+		return 0;
+	}
+
+	if (json_skip_ws(st->f) != EOF) {
+		fprintf(stderr, "Trailing data after JSON\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+int import_file(char *path) {
+	struct import_state *st;
+	struct import_result res;
+	FILE *f;
+	char *pass;
+	double t;
+	int c, rv = 0;
+
+	st = calloc(1, sizeof(*st));
+	if (!st) {
+		fprintf(stderr, "Memory allocation error\n");
+		return 0;
+	}
+
+	st->batch = secure_alloc(MAX_PARCEL_LEN);
+	if (!st->batch) {
+		fprintf(stderr, "Memory allocation error\n");
+		free(st);
+		return 0;
+	}
+
+	f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (!f) {
+		fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+		goto out;
+	}
+
+	st->f = f;
+	if (f != stdin && is_sealed(f)) {
+		pass = ask_secret("Export passphrase: ");
+		st->f = sealed_open(f, NULL, pass);
+		memset(pass, 0, strlen(pass));
+		free(pass);
+		if (!st->f)
+			goto out;
+	}
+
+	st->len = sizeof(struct import_batch);
+	st->session = getpid() ^ time(NULL);
+	entry_clear(&st->entry);
+	clock_gettime(CLOCK_MONOTONIC, &st->start);
+
+	c = json_skip_ws(st->f);
+	if (c != EOF)
+		ungetc(c, st->f);
+
+	if (c == '[' || c == '{')
+		rv = import_json(st);
+	else
+		rv = import_csv(st);
+
+	if (ferror(st->f)) {
+		fprintf(stderr, "%sCan't read %s: %s\n", st->sent ? "\n" : "", path,
+			errno == EBADMSG ? "wrong passphrase or damaged file" : strerror(errno));
+		rv = 0;
+	}
+
+	if (rv)
+		rv = send_batch(st, IMPORT_COMMIT, &res);
+
+	/* let the daemon drop what it has staged */
+	if (!rv && st->sent) {
+		st->len = sizeof(struct import_batch);
+		send_batch(st, IMPORT_ABORT, NULL);
+	}
+
+	if (st->sent)
+		fprintf(stderr, "\n");
+
+	if (!rv) {
+		fprintf(stderr, "Nothing imported\n");
+		goto out;
+	}
+
+	t = import_elapsed(st);
+	printf("Imported %u of %u entries in %.2fs (%.0f entries/s), %u duplicates, "
+		"%u without name or password\n", res.added, st->read, t,
+		t > 0 ? st->read / t : 0.0, res.duplicates, st->skipped);
+out:
+	if (st->f && st->f != f)
+		fclose(st->f);
+
+	if (f && f != stdin)
+		fclose(f);
+
+	entry_clear(&st->entry);
+	secure_free(st->batch);
+	free(st);
+
+	return rv;
+}
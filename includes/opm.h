@@ -19,6 +19,7 @@
  *    Email: <alexander.miroch@gmail.com>
  */
 
+#define _GNU_SOURCE
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -41,10 +42,18 @@
 #include <ctype.h>
 #include <openssl/evp.h>
 #include <openssl/aes.h>
+#include <openssl/rand.h>
+#include <zlib.h>
 #include <libgen.h>
 #include <linux/limits.h>
 #include <pwd.h>
 #include <sys/epoll.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <limits.h>
 
 extern char short_options[];
 extern struct option long_options[];
@@ -59,13 +68,34 @@ void usage(int);
 #define MAX_NOTES_LEN	  256
 #define MAX_ENTRY_LEN	  MAX_NOTES_LEN
 
-struct db_entry {
+/* Fixed-size entry layout of VERSION_CODE 0x101 and 0x200 databases */
+struct db_entry_v1 {
 	char name[MAX_DB_RECORD_LEN];
 	char url[MAX_DB_RECORD_LEN];
 	char login[MAX_LOGIN_LEN], password[MAX_PASSWORD_LEN];
 	char notes[MAX_NOTES_LEN];	
 };
 
+/* Decoded entry, the fields point into an encoded record (see record.c) */
+struct db_entry {
+	unsigned long long id;
+	char *name;
+	char *url;
+	char *login;
+	char *password;
+	char *notes;
+};
+
+#define RECORD_FIELDS	5
+#define MAX_RECORD_LEN	BT_MAX_VALUE
+
+char **record_fields(struct db_entry *, int);
+unsigned int record_size(struct db_entry *);
+unsigned int record_encode(struct db_entry *, unsigned char *, unsigned int);
+unsigned int record_decode(unsigned char *, unsigned int, struct db_entry *);
+unsigned int record_from_v1(struct db_entry_v1 *, unsigned char *);
+struct db_entry *record_decode_all(unsigned char *, unsigned int, unsigned int *);
+
 
 void emsg(const char *, ...);
 
@@ -79,6 +109,14 @@ void handle_client(int);
 void send_error(int);
 void send_ok(int);
 int do_connect(void);
+void group_commit(void);
+void answer_waiters(void);
+int pt_durable(void *, unsigned int, int);
+
+#define DEFAULT_COMMIT_WINDOW	0
+#define DEFAULT_COMMIT_OPS	64
+
+extern unsigned int commit_window, commit_ops;
 
 #define USOCKET_NAME "/com/opm/opmsock"
 #define MSEC_WAIT_FOR_DAEMON 100
@@ -91,49 +129,290 @@ void show_password(unsigned char *, unsigned char *);
 void ask_password(int);
 unsigned int ask_entry(void);
 void add_entry(void);
+void update_entry(unsigned long long);
 void init_term(void);
 void get_input_entry(char *, char *, int);
+char *input_entry(char *);
+char *ask_secret(char *);
 int is_empty(char *);
-void pretty_output(struct db_entry *, int, int);
+void pretty_entry(struct db_entry *, unsigned int, int);
 
 extern unsigned char password[MAX_PASSWORD_LEN];
 
 
 extern char *database_file;
-extern char *mapped_db;
-extern unsigned int num_entries;
 
 #define DATABASE_SIGNATURE "OPMDBDEX"
-#define VERSION_CODE 0x101
+#define PAGED_SIGNATURE "OPMDBPAG"
+#define LEGACY_VERSION_CODE 0x101
+#define FIXED_RECORD_VERSION_CODE 0x200
+#define RECORD_VERSION_CODE 0x201
+#define SPLIT_VERSION_CODE 0x202
+#define HISTORY_VERSION_CODE 0x203
+#define CHECKSUM_VERSION_CODE 0x204
+#define KDF_VERSION_CODE 0x205
+#define ENVELOPE_VERSION_CODE 0x206
+#define FULL_TAG_VERSION_CODE 0x207
+#define VERSION_CODE 0x207
 
 struct db_header {
 	unsigned char signature[8];
 	unsigned int version;
 	unsigned int num_entries;
 	unsigned int entry_size;
-	unsigned char reserved[16384];
+	unsigned long long journal_seq;
+	unsigned char reserved[16376];
+} __attribute__((packed));
+
+/*
+ * In-memory entry table, records live in an arena; len 0 is a free
+ * slot. A lazy slot only holds the index part of its entry.
+ */
+struct db_record {
+	unsigned long long id;
+	unsigned int off;
+	unsigned int len : 31;
+	unsigned int lazy : 1;
+};
+
+/* Key of the secret part of an entry, see db_store() */
+#define BT_SECRET	(1ULL << 63)
+/* Key of the revisions of an entry, see history.c */
+#define BT_HISTORY	(1ULL << 62)
+#define SECRET_CACHE_SIZE	32
+
+#define ARENA_COMPACT_MIN	65536
+#define RECORDS_PACK_MIN	256
+#define DEFAULT_COMPACT_RATIO	25
+
+extern unsigned int compact_ratio;
+
+extern struct db_record *records;
+extern unsigned int num_records;
+
+void init_records(void);
+void db_init(void);
+
+#define DB_PAGE_SIZE	4096
+#define DB_KEY_LEN	32
+#define KDF_SALT_LEN	16
+#define SEAL_NONCE_LEN	12
+#define SEAL_TAG_LEN	16
+#define SEAL_OVERHEAD	(SEAL_NONCE_LEN + SEAL_TAG_LEN)
+#define PAGE_DATA_SIZE	(DB_PAGE_SIZE - SEAL_OVERHEAD)
+/*
+ * From CHECKSUM_VERSION_CODE on, every page ends with the CRC32C of the
+ * rest of it. Up to 0x206 the tag of the sealed page data was shortened
+ * to PAGE_TAG_LEN to make room, from FULL_TAG_VERSION_CODE on the tag is
+ * kept whole and only PAGE_NODE_SIZE bytes of the node are sealed.
+ */
+#define PAGE_CRC_LEN	4
+#define PAGE_TAG_LEN	(SEAL_TAG_LEN - PAGE_CRC_LEN)
+#define PAGE_NODE_SIZE	(PAGE_DATA_SIZE - PAGE_CRC_LEN)
+#define BT_FIRST_PAGE	2
+#define BT_BULK_BATCH	4096
+#define BT_CRYPT_BATCH	256	/* pages sealed or opened together */
+#define BT_CRYPT_STEP	8	/* pages a thread takes at a time */
+#define BT_CRYPT_MIN_PAGES	32	/* per thread */
+#define BT_CRYPT_MAX_THREADS	8
+#define BT_KEY_SLOTS	4
+
+enum {
+	BT_NONE,
+	BT_BRANCH,
+	BT_LEAF
+};
+
+struct bt_node {
+	unsigned short type;
+	unsigned short count;
+	unsigned int used;
+} __attribute__((packed));
+
+struct bt_cell {
+	unsigned long long key;
+	unsigned short len;
+} __attribute__((packed));
+
+struct bt_branch_ent {
+	unsigned long long key;
+	unsigned long long child;
+} __attribute__((packed));
+
+#define BT_LEAF_CAP	(PAGE_NODE_SIZE - sizeof(struct bt_node))
+#define BT_OLD_LEAF_CAP	(PAGE_DATA_SIZE - sizeof(struct bt_node))	/* before 0x207 */
+#define BT_BRANCH_MAX	((BT_LEAF_CAP - sizeof(unsigned long long)) / sizeof(struct bt_branch_ent))
+#define BT_MAX_VALUE	(BT_LEAF_CAP / 2 - sizeof(struct bt_cell))
+
+/* plaintext part of the meta pages */
+struct bt_meta_hdr {
+	unsigned char signature[8];
+	unsigned int version;	/* VERSION_CODE | BT_FLAG_* */
+	unsigned int page_size;
+} __attribute__((packed));
+
+/*
+ * Flags above the version code. Older software takes them for a newer
+ * version and refuses the file.
+ */
+#define BT_VERSION_MASK	0xffff
+#define BT_FLAG_DEFLATE	0x10000	/* values may be stored deflated */
+#define BT_FLAGS	BT_FLAG_DEFLATE
+
+enum {
+	KDF_NONE,	/* the passphrase buffer is the key, before KDF_VERSION_CODE */
+	KDF_SCRYPT,
+	KDF_PBKDF2
+};
+
+/* follows the header from KDF_VERSION_CODE on */
+struct bt_kdf {
+	unsigned int alg;
+	unsigned int cost;	/* log2 N for scrypt, iterations for PBKDF2 */
+	unsigned int r, p;
+	unsigned char salt[KDF_SALT_LEN];
+} __attribute__((packed));
+
+/*
+ * From ENVELOPE_VERSION_CODE on, BT_KEY_SLOTS of these follow the header
+ * instead: db_key is random and each slot holds it sealed with a key
+ * derived from a passphrase. alg is KDF_NONE in an unused slot.
+ */
+struct bt_keyslot {
+	struct bt_kdf kdf;
+	unsigned char wrapped[DB_KEY_LEN + SEAL_OVERHEAD];
 } __attribute__((packed));
 
-void init_header(void);
+/* sealed part of the meta pages */
+struct bt_meta {
+	unsigned long long txn;
+	unsigned long long root;
+	unsigned long long npages;
+	unsigned long long nkeys;
+	unsigned long long next_id;
+	unsigned long long journal_seq;
+	unsigned int depth;
+	unsigned long long ndeleted;	/* removals since the file was written out */
+	unsigned char reserved[248];
+} __attribute__((packed));
+
+/* end of the meta pages from CHECKSUM_VERSION_CODE on, copies for --verify */
+struct bt_meta_tail {
+	unsigned long long txn;
+	unsigned long long npages;
+	unsigned int crc;
+} __attribute__((packed));
+
+extern struct bt_meta bt_meta;
+extern unsigned int bt_version;
+extern unsigned char db_key[DB_KEY_LEN];
+
+void bt_crypt_start(void);
+int bt_probe(char *);
+int bt_page_intact(unsigned char *);
+void bt_plain_key(void);
+int bt_rekey_due(void);
+int bt_rekey(void);
+int bt_rewrap_due(void);
+int bt_passwd(char *, char *);
+int bt_open(char *);
+int bt_create(char *);
+int bt_rename(char *);
+int bt_begin(void);
+void bt_abort(void);
+int bt_commit(unsigned long long, unsigned long long);
+int bt_put(unsigned long long, unsigned char *, unsigned int);
+int bt_del(unsigned long long);
+unsigned int bt_get(unsigned long long, unsigned char *);
+int bt_walk(unsigned long long, unsigned long long,
+	int (*)(unsigned long long, unsigned char *, unsigned int));
+void bt_close(void);
 
 #define DEFAULT_DATABASE_FILE ".opm.db"
 #define CHUNK_SIZE 4096
+#define CRYPT_BATCH (1024 * 1024)
 int load_database(int);
 char *decrypt_db(FILE *, char *, unsigned int *);
 int encrypt_db(FILE *, char *, char *, unsigned int);
 int db_add_entry(struct db_entry *);
+int db_put_slot(int, unsigned long long, unsigned char *, unsigned int);
+int db_store(unsigned long long, unsigned char *, unsigned int);
+int db_unstore(unsigned long long);
+unsigned int db_full_record(int, unsigned char *);
+int db_history(unsigned long long, unsigned char *, unsigned int *);
+int db_update(int, unsigned long long, unsigned char *, unsigned int);
+
+#define DEFAULT_KEEP_REVISIONS	10
+#define MAX_KEEP_REVISIONS	1000
+
+/* A revision, followed by the fields that differ from the next newer version */
+struct revision {
+	unsigned long long time;
+	unsigned int mask;	/* which fields, by record order */
+	unsigned short len;	/* of the record that follows */
+} __attribute__((packed));
+
+/* PT_HISTORY and PT_RESTORE request, rev counts from 1 (the newest) */
+struct history_request {
+	unsigned long long id;
+	unsigned int rev;
+} __attribute__((packed));
+
+extern unsigned int keep_revisions;
+
+unsigned int revision_make(struct db_entry *, struct db_entry *, unsigned char *);
+int history_push(unsigned long long, unsigned char *, unsigned int);
+int history_save(void);
+int history_load(void);
+void history_drop(void);
+int pt_history(void *, unsigned int, int);
+int pt_restore(void *, unsigned int, int);
+int show_history(unsigned long long, int);
+int restore_revision(unsigned long long, unsigned int);
+void db_del_slot(int);
+int db_decode_slot(int, struct db_entry *);
+int legacy_put_slot(unsigned int, struct db_entry_v1 *);
+int legacy_del_slot(unsigned int);
+int db_changed(unsigned long long, int);
+int db_convert(void);
+
+extern unsigned long long next_entry_id;
 void init_handlers(void);
-int pt_add_entry(void *, int);
-int pt_remove_entry(void *, int);
-int pt_get_entry(void *, int);
-int pt_get_db(void *, int);
-int pt_stop(void *, int);
-int pt_copy(void *, int);
-struct db_entry *find_free_slot(void);
+int pt_add_entry(void *, unsigned int, int);
+int pt_remove_entry(void *, unsigned int, int);
+int pt_get_entry(void *, unsigned int, int);
+int pt_get_db(void *, unsigned int, int);
+int pt_stop(void *, unsigned int, int);
+int pt_copy(void *, unsigned int, int);
+int pt_get_id(void *, unsigned int, int);
+int pt_update_id(void *, unsigned int, int);
+int pt_remove_id(void *, unsigned int, int);
+int pt_fuzzy(void *, unsigned int, int);
+int pt_import(void *, unsigned int, int);
+int pt_export(void *, unsigned int, int);
+int pt_open(void *, unsigned int, int);
+int pt_vaults(void *, unsigned int, int);
+int pt_close(void *, unsigned int, int);
+int pt_passwd(void *, unsigned int, int);
+int find_free_slot(void);
 int sync_db(void);
 int list_db(int);
 int remove_entry(int);
+int remove_entry_id(unsigned long long);
+int db_update_entry(unsigned long long, struct db_entry *);
 int get_entry(unsigned char *, int, int);
+int get_entry_id(unsigned long long, int, int);
+int get_entry_fuzzy(char *, unsigned int, int, int);
+int wait_durable(void);
+int db_checkpoint(unsigned char *, unsigned int, unsigned long long, unsigned long long);
+int db_compact(void);
+void db_close(void);
+
+/* Checkpoint snapshot entry, followed by the record; len 0 is a removal */
+struct checkpoint_entry {
+	unsigned long long id;
+	unsigned int len;
+} __attribute__((packed));
 
 enum {
 	PT_NONE,
@@ -144,10 +423,23 @@ enum {
 	PT_REPLY,
 	PT_STOP,
 	PT_COPY,
+	PT_GET_ID,
+	PT_UPDATE_ID,
+	PT_REMOVE_ID,
+	PT_FUZZY,
+	PT_DURABLE,
+	PT_IMPORT,
+	PT_EXPORT,
+	PT_OPEN,
+	PT_VAULTS,
+	PT_CLOSE,
+	PT_HISTORY,
+	PT_RESTORE,
+	PT_PASSWD,
 	PT_MAX
 };
 
-extern int (*handlers[PT_MAX])(void *, int);
+extern int (*handlers[PT_MAX])(void *, unsigned int, int);
 
 struct parcel {
 	unsigned int type;
@@ -160,12 +452,274 @@ struct parcel {
 
 int send_parcel(struct parcel *);
 int _send_parcel(int csk, struct parcel *pc);
-int _get_parcel(int csk, struct parcel *pc);
+int _get_frame(int, unsigned char *, unsigned int *);
 int is_ok_reply(int);
 int send_reply(int, void *, int);
+struct db_entry *query_entries(struct parcel *, unsigned int *);
+void free_reply(struct parcel *);
+
+/* Client side of a streamed reply */
+struct entry_stream {
+	int fd;
+	int error;
+	unsigned char *buf;		/* the current frame */
+	struct db_entry *entries;
+	unsigned int count, next;
+};
 
+int stream_open(struct entry_stream *, struct parcel *);
+struct db_entry *stream_next(struct entry_stream *);
+void stream_close(struct entry_stream *);
+
+#define ID_INDEX_MIN	1024
+
+int id_index_reserve(unsigned int);
+int id_index_put(unsigned long long, unsigned int);
+int id_index_get(unsigned long long);
+void id_index_del(unsigned long long);
+void id_index_clear(void);
+
+#define TG_TABLE_MIN	4096
+
+extern int tg_valid;
+
+void tg_add(struct db_entry *);
+void tg_del(struct db_entry *);
+void tg_clear(void);
+int tg_query(char *, unsigned long long **, unsigned int *);
+
+extern int (*ci_search)(const char *, size_t, const char *, size_t);
+extern const char *ci_search_impl;
+
+void search_init(void);
+int ci_search_scalar(const char *, size_t, const char *, size_t);
+int ci_search_sse2(const char *, size_t, const char *, size_t);
+int ci_search_avx2(const char *, size_t, const char *, size_t);
+
+#define FUZZY_NONE		INT_MIN
+#define DEFAULT_FUZZY_LIMIT	10
+#define MAX_FUZZY_LIMIT		1000
+#define FUZZY_LOGIN_PENALTY	8
+
+/* PT_FUZZY request, the pattern is zero-terminated */
+struct fuzzy_query {
+	unsigned int limit;
+	char pattern[];
+} __attribute__((packed));
+
+struct fuzzy_hit {
+	int score;
+	unsigned int slot;
+};
+
+struct fuzzy_top {
+	unsigned int k, count;
+	struct fuzzy_hit *hits;
+};
+
+int fuzzy_score(const char *, size_t, const char *, size_t);
+void fuzzy_offer(struct fuzzy_top *, int, unsigned int);
+void fuzzy_drain(struct fuzzy_top *, unsigned int *);
+
+#define IMPORT_BEGIN	1
+#define IMPORT_COMMIT	2
+#define IMPORT_ABORT	4
+#define MAX_IMPORT_SIZE	(64 << 20)
+
+/* PT_IMPORT request, followed by back-to-back records */
+struct import_batch {
+	unsigned int session;
+	unsigned int flags;
+} __attribute__((packed));
+
+/* Reply to the IMPORT_COMMIT batch */
+struct import_result {
+	unsigned int added;
+	unsigned int duplicates;
+} __attribute__((packed));
+
+int import_file(char *);
+
+enum {
+	EXPORT_CSV,
+	EXPORT_JSON
+};
+
+#define SEALED_MAGIC		"OPMSEAL1"
+#define SEALED_DEFLATE_MAGIC	"OPMSEAL2"
+#define SEALED_SALT_LEN		16
+#define SEALED_KEY_LEN		32
+#define SEALED_CHUNK		65536
+#define SEALED_LAST		0x80000000U
+#define SEALED_KDF_ITER		600000
+#define SEALED_KDF_MAX_ITER	100000000
+
+int export_db(char *, int, int);
+int is_sealed(FILE *);
+FILE *sealed_open(FILE *, int *, char *);
+
+int seal_data(unsigned char *, unsigned char *, unsigned int, unsigned char *, unsigned int, char *);
+int open_data(unsigned char *, unsigned char *, unsigned int, unsigned char *, unsigned int, char *);
+int seal_page(unsigned char *, unsigned char *, unsigned int, unsigned char *, unsigned int, char *);
+int open_page(unsigned char *, unsigned char *, unsigned int, unsigned char *, unsigned int, char *);
+
+#define KDF_SCRYPT_COST		15	/* 32 MiB with r 8 */
+#define KDF_SCRYPT_MIN_COST	14
+#define KDF_SCRYPT_MAX_COST	24
+#define KDF_SCRYPT_R		8
+#define KDF_SCRYPT_MAX_R	32
+#define KDF_SCRYPT_MAX_P	64
+#define KDF_MAX_MEM		(1ULL << 30)
+#define KDF_PBKDF2_ITER		600000
+#define KDF_PBKDF2_MIN_ITER	100000
+#define KDF_PBKDF2_MAX_ITER	100000000
+#define KDF_MAX_MSEC		60000
+
+extern struct bt_kdf kdf_tuned;
+extern int kdf_calibrated;
+
+void kdf_defaults(struct bt_kdf *);
+int kdf_derive(char *, struct bt_kdf *, unsigned char *);
+int kdf_calibrate(unsigned int, struct bt_kdf *);
+
+unsigned int crc32c(unsigned int, const void *, size_t);
+int crc32c_hw(void);
+
+#define VERIFY_MAX_THREADS	8
+#define VERIFY_BATCH		64	/* pages per read */
+
+int verify_database(char *);
+
+#define JOURNAL_SUFFIX		".journal"
+#define JOURNAL_MAGIC		0x4c4e524a
+#define JOURNAL_COMPACT_SIZE	(1024 * 1024)
+
+enum {
+	JOURNAL_NONE,
+	JOURNAL_PUT_SLOT,
+	JOURNAL_DEL_SLOT,
+	JOURNAL_PUT,
+	JOURNAL_DEL,
+	JOURNAL_REV
+};
+
+struct journal_record {
+	unsigned int magic;
+	unsigned int length;
+	unsigned long long seq;
+} __attribute__((packed));
+
+/* JOURNAL_PUT/JOURNAL_DEL/JOURNAL_REV are followed by the entry id */
+struct journal_op {
+	unsigned int op;
+	unsigned int slot;
+} __attribute__((packed));
+
+extern unsigned long long journal_seq;
+extern off_t journal_size;
+extern unsigned int journal_pending;
+
+char *journal_path(void);
+int journal_reserve(unsigned int, unsigned int);
+int journal_append(unsigned int, unsigned long long, unsigned char *, unsigned int);
+unsigned char *journal_take(unsigned int *);
+int journal_write(unsigned char *, unsigned int);
+int journal_sync(void);
+int journal_truncate(void);
+int journal_replay(void);
+int journal_reset(void);
+void journal_close(void);
 
 int do_password(unsigned char *, unsigned char *, int);
 int setup_signals(void);
 void s_handler(int, siginfo_t *, void *);
 void process_x11_event(void *, char *);
+
+enum {
+	FSYNC_ALWAYS,
+	FSYNC_INTERVAL,
+	FSYNC_NEVER
+};
+
+#define FSYNC_INTERVAL_MS	1000
+
+extern int fsync_policy;
+extern int writer_fd;
+
+int sync_dir(char *);
+int writer_start(void);
+void writer_journal(void);
+int writer_checkpoint(unsigned char *, unsigned int, unsigned long long, unsigned long long);
+void writer_sync(void);
+void writer_wait_idle(void);
+void writer_covered(unsigned long long);
+int writer_status(unsigned long long *, unsigned long long *, unsigned long long *);
+
+#define MAX_VAULTS	16
+
+struct db_state;
+struct bt_state;
+struct journal_state;
+struct id_state;
+struct tg_state;
+struct writer_state;
+
+/* Unlocked database in the daemon, the current one lives in the globals */
+struct vault {
+	unsigned int handle;
+	char *path;
+	struct db_state *db;
+	struct bt_state *bt;
+	struct journal_state *journal;
+	struct id_state *ids;
+	struct tg_state *tg;
+	struct writer_state *writer;
+};
+
+/* PT_VAULTS reply frame */
+struct vault_info {
+	unsigned int handle;
+	char path[];
+} __attribute__((packed));
+
+extern struct vault *current_vault;
+extern unsigned int vault_handle;
+extern int all_vaults;
+
+int vault_add(char *);
+int vault_switch(unsigned int);
+void vault_sync_all(void);
+char *vault_path(char *);
+int open_vault(int);
+int close_vault(void);
+int change_passwd(void);
+int get_vaults(struct vault_info ***, unsigned int *);
+void free_vaults(struct vault_info **, unsigned int);
+int list_vaults(void);
+
+int db_park(struct vault *);
+void db_resume(struct vault *);
+int bt_park(struct vault *);
+void bt_resume(struct vault *);
+int journal_park(struct vault *);
+void journal_resume(struct vault *);
+int id_index_park(struct vault *);
+void id_index_resume(struct vault *);
+int tg_park(struct vault *);
+void tg_resume(struct vault *);
+int writer_park(struct vault *);
+void writer_resume(struct vault *);
+
+/* Locked memory for plain text, see secure.c */
+#define SECURE_MIN_CLASS	6	/* 64 bytes */
+#define SECURE_MAX_CLASS	16	/* 64K, larger buffers get their own region */
+#define SECURE_SLAB_SIZE	(256 * 1024)
+#define SECURE_MAX_STATIC	8
+
+void *secure_alloc(size_t);
+void *secure_realloc(void *, size_t);
+void secure_free(void *);
+void secure_lock(void *, size_t);
+void secure_relock(void);
+void *secure_zalloc(void *, unsigned int, unsigned int);
+void secure_zfree(void *, void *);
@@ -22,28 +22,82 @@
 
 #include "opm.h"
 
-char short_options[]="AD:HhLvR:cS";
+char short_options[]="AD:HhLvR:cSC:i:r:U:zk:W:N:F:wI:E:f:eaVxy:Y:K:Tm:P";
 
 struct option long_options[] = {
     {"verbose",      0, 0, 'v'},
     {"list",     0, 0, 'L'},
     {"add",    0, 0, 'A'},
     {"remove", 1, 0, 'R' },
+    {"id",     1, 0, 'i' },
+    {"remove-id", 1, 0, 'r' },
+    {"update", 1, 0, 'U' },
+    {"history", 1, 0, 'y' },
+    {"restore", 1, 0, 'Y' },
+    {"keep",	   1, 0, 'K' },
+    {"verify",	   0, 0, 'T' },
+    {"calibrate",  1, 0, 'm' },
+    {"passwd",	   0, 0, 'P' },
     {"console", 0, 0, 'c' },
     {"database",    1, 0, 'D'},
     {"stop",	   0, 0, 'S' },
+    {"all",	   0, 0, 'a' },
+    {"vaults",	   0, 0, 'V' },
+    {"close",	   0, 0, 'x' },
+    {"compact",	   1, 0, 'C' },
+    {"commit-window", 1, 0, 'W' },
+    {"commit-ops", 1, 0, 'N' },
+    {"fsync",	   1, 0, 'F' },
+    {"wait-durable", 0, 0, 'w' },
+    {"import",	   1, 0, 'I' },
+    {"export",	   1, 0, 'E' },
+    {"format",	   1, 0, 'f' },
+    {"seal",	   0, 0, 'e' },
+    {"fuzzy",	   0, 0, 'z' },
+    {"top",	   1, 0, 'k' },
     {"help",      0, 0, 'H'},
     {0, 0, 0, 0}
 };
 
 char help_string[] = 
 "OPM is a console password manager\n"
-"Usage: opm [-vHc] [-D database] [-L | -A | -S | -R number] [service-pattern]\n"
+"Usage: opm [-vHczea] [-k number] [-f format] [-D database] [-C percent] [-W msec] [-N number] [-F policy] [-K number] [-L | -A | -S | -V | -x | -w | -T | -m msec | -P | -I file | -E file | -R number | -i id | -r id | -U id | -y id [-Y revision]] [service-pattern]\n"
 "\t-L, --list\t\tlist records in database\n"
 "\t-A, --add\t\tadd item to database\n"
+"\t-I, --import <file>\timport a CSV or JSON export (- for stdin), skipping\n"
+"\t\t\t\titems with the name and login of an existing one\n"
+"\t-E, --export <file>\texport the database (- for stdout)\n"
+"\t-f, --format <format>\texport format: csv (default) or json\n"
+"\t-e, --seal\t\tencrypt the export with a passphrase of its own\n"
 "\t-R, --remove <itemno>\tremove item from database\n"
+"\t-i, --id <id>\t\tget the item with this id (see -Lv)\n"
+"\t-r, --remove-id <id>\tremove the item with this id\n"
+"\t-U, --update <id>\tchange the item with this id\n"
+"\t-y, --history <id>\tlist the earlier versions of the item with this id\n"
+"\t-Y, --restore <revision>\twith -y, bring back the version of this number\n"
 "\t-D, --database <file>\tspecify database filename\n"
 "\t-S, --stop\t\tstop daemon\n"
+"\t-V, --vaults\t\tlist the databases the daemon holds open\n"
+"\t-x, --close\t\tlock the database, the daemon stops with the last one\n"
+"\t-T, --verify\t\tcheck the page checksums of the database file, needs neither\n"
+"\t\t\t\tthe passphrase nor the daemon\n"
+"\t-m, --calibrate <msec>\tmeasure the key derivation here, start the daemon with costs\n"
+"\t\t\t\tthat take about this long to unlock and rekey the database\n"
+"\t\t\t\tto them (the daemon must not be running)\n"
+"\t-P, --passwd\t\tchange the passphrase of the database\n"
+"\t-a, --all\t\tlist or search every open database\n"
 "\t-c, --console\t\tuse console output rather than Xserver\n"
+"\t-C, --compact <percent>\tcompact database when this share of entries is removed\n"
+"\t\t\t\t(default 25, 0 disables, applies when the daemon starts)\n"
+"\t-K, --keep <number>\tkeep this many earlier versions of an item (default 10,\n"
+"\t\t\t\t0 disables, applies when the daemon starts)\n"
+"\t-W, --commit-window <msec>\tlet changes from other clients join a commit for this long\n"
+"\t\t\t\t(default 0, applies when the daemon starts)\n"
+"\t-N, --commit-ops <number>\tcommit once this many changes are waiting (default 64)\n"
+"\t-F, --fsync <policy>\tsync changes to disk: always, interval (every second) or never\n"
+"\t\t\t\t(default always, applies when the daemon starts)\n"
+"\t-w, --wait-durable\twait until all changes so far are synced to disk\n"
+"\t-z, --fuzzy\t\tfuzzy search, best matches first\n"
+"\t-k, --top <number>\tshow at most this many fuzzy matches (default 10, implies -z)\n"
 "\t-v, --verbose\t\tverbose output\n"
 "\t-h, --help\t\tthis help\n";
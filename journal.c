@@ -0,0 +1,429 @@
+/*
+ * opm - Open Password Manager.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Alexander Miroch
+ *    Email: <alexander.miroch@gmail.com>
+ */
+
+/*
+ * Append-only journal of database mutations.
+ *
+ * Every add/remove is sealed into its own record and appended to
+ * <database>.journal instead of touching the database file. Records
+ * are collected in memory first and handed to the writer thread (see
+ * writer.c) in groups, which writes each group with one write. The
+ * database keeps the sequence number of the last record it contains,
+ * so replay skips everything older. Once the journal grows past
+ * JOURNAL_COMPACT_SIZE the pending changes are checkpointed into the
+ * database (see sync_db()) and the journal starts over.
+ *
+ * Records written by 0x101 databases address entries by slot, newer
+ * ones by entry id.
+ */
+
+#include "opm.h"
+
+#define MAX_JOURNAL_PAYLOAD \
+	(sizeof(struct journal_op) + sizeof(unsigned long long) + MAX_RECORD_LEN)
+
+unsigned long long journal_seq = 0;
+off_t journal_size = 0;
+
+/* Sealed records not handed to the writer yet */
+static unsigned char *pending = NULL;
+static unsigned int pending_len = 0, pending_max = 0;
+unsigned int journal_pending = 0;
+
+/* Used by the writer thread only */
+static int journal_fd = -1, journal_created = 0;
+
+char *journal_path(void) {
+	char *path;
+
+	path = malloc(strlen(database_file) + strlen(JOURNAL_SUFFIX) + 1);
+	if (!path) {
+		syslog(LOG_ERR, "No memory");
+		return NULL;
+	}
+
+	strcpy(path, database_file);
+	strcat(path, JOURNAL_SUFFIX);
+
+	return path;
+}
+
+static int pending_reserve(unsigned int len) {
+	unsigned char *tmp;
+	unsigned int max;
+
+	if (pending_len + len <= pending_max)
+		return 1;
+
+	max = pending_max ? pending_max : CHUNK_SIZE;
+	while (max < pending_len + len)
+		max *= 2;
+
+	tmp = realloc(pending, max);
+	if (!tmp) {
+		syslog(LOG_ERR, "No memory");
+		return 0;
+	}
+
+	pending = tmp;
+	pending_max = max;
+
+	return 1;
+}
+
+/* Room for 'n' more records with 'len' bytes of entries between them */
+int journal_reserve(unsigned int n, unsigned int len) {
+	return pending_reserve(n * (sizeof(struct journal_record) + sizeof(struct journal_op) +
+		sizeof(unsigned long long) + SEAL_OVERHEAD) + len);
+}
+
+/* Queue a record, see journal_take() */
+int journal_append(unsigned int op, unsigned long long id, unsigned char *rec, unsigned int len) {
+	struct journal_record *jr;
+	struct journal_op *jo;
+	unsigned char plain[MAX_JOURNAL_PAYLOAD];
+	unsigned char *buf;
+	unsigned int plen, total;
+
+	jo = (struct journal_op *) plain;
+	jo->op = op;
+	jo->slot = 0;
+	plen = sizeof(struct journal_op);
+
+	memcpy(plain + plen, &id, sizeof(id));
+	plen += sizeof(id);
+
+	if (op == JOURNAL_PUT || op == JOURNAL_REV) {
+		if (len > MAX_RECORD_LEN)
+			return 0;
+
+		memcpy(plain + plen, rec, len);
+		plen += len;
+	}
+
+	total = sizeof(struct journal_record) + plen + SEAL_OVERHEAD;
+	if (!pending_reserve(total))
+		return 0;
+
+	buf = pending + pending_len;
+	jr = (struct journal_record *) buf;
+	jr->magic = JOURNAL_MAGIC;
+	jr->length = plen + SEAL_OVERHEAD;
+	jr->seq = journal_seq + 1;
+
+	if (!seal_data(buf + sizeof(*jr), plain, plen, buf, sizeof(*jr), db_key)) {
+		memset(plain, 0, sizeof(plain));
+		return 0;
+	}
+
+	memset(plain, 0, sizeof(plain));
+
+	pending_len += total;
+	journal_pending++;
+	journal_seq++;
+	journal_size += total;
+
+	return 1;
+}
+
+/* Hand the queued records over, the caller frees the buffer */
+unsigned char *journal_take(unsigned int *len) {
+	unsigned char *buf = pending;
+
+	*len = pending_len;
+	pending = NULL;
+	pending_len = pending_max = 0;
+	journal_pending = 0;
+
+	return buf;
+}
+
+/*
+ * Append sealed records to the file. On failure whatever made it to
+ * the file is cut off again, so that no torn record stays behind.
+ */
+int journal_write(unsigned char *buf, unsigned int len) {
+	struct stat st;
+	char *path;
+
+	if (journal_fd < 0) {
+		path = journal_path();
+		if (!path)
+			return 0;
+
+		journal_created = access(path, F_OK) < 0;
+		journal_fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+		free(path);
+		if (journal_fd < 0) {
+			syslog(LOG_ERR, "Can't open journal: %s", strerror(errno));
+			return 0;
+		}
+	}
+
+	if (fstat(journal_fd, &st) < 0) {
+		syslog(LOG_ERR, "Can't stat journal: %s", strerror(errno));
+		return 0;
+	}
+
+	if (write(journal_fd, buf, len) != len) {
+		syslog(LOG_ERR, "Journal write error: %s", strerror(errno));
+		ftruncate(journal_fd, st.st_size);
+		return 0;
+	}
+
+	return 1;
+}
+
+int journal_sync(void) {
+	if (journal_fd < 0)
+		return 1;
+
+	if (fdatasync(journal_fd) < 0) {
+		syslog(LOG_ERR, "Can't sync journal: %s", strerror(errno));
+		return 0;
+	}
+
+	/* a new file is only there for good once its directory is synced */
+	if (journal_created) {
+		if (!sync_dir(database_file))
+			return 0;
+		journal_created = 0;
+	}
+
+	return 1;
+}
+
+static int journal_apply(unsigned char *plain, unsigned int len) {
+	struct journal_op *jo = (struct journal_op *) plain;
+	unsigned long long id;
+	unsigned int hlen = sizeof(struct journal_op) + sizeof(id);
+
+	if (len < sizeof(struct journal_op))
+		return 0;
+
+	switch (jo->op) {
+		case JOURNAL_PUT_SLOT:
+			if (len != sizeof(struct journal_op) + sizeof(struct db_entry_v1))
+				return 0;
+
+			return legacy_put_slot(jo->slot, (struct db_entry_v1 *) (plain + sizeof(*jo)));
+		case JOURNAL_DEL_SLOT:
+			return legacy_del_slot(jo->slot);
+		case JOURNAL_PUT:
+			if (len <= hlen)
+				return 0;
+
+			memcpy(&id, plain + sizeof(*jo), sizeof(id));
+			if (id >= next_entry_id)
+				next_entry_id = id + 1;
+
+			return db_store(id, plain + hlen, len - hlen);
+		case JOURNAL_DEL:
+			if (len != hlen)
+				return 0;
+
+			memcpy(&id, plain + sizeof(*jo), sizeof(id));
+			return db_unstore(id);
+		case JOURNAL_REV:
+			if (len <= hlen)
+				return 0;
+
+			memcpy(&id, plain + sizeof(*jo), sizeof(id));
+			return history_push(id, plain + hlen, len - hlen);
+	}
+
+	return 0;
+}
+
+/*
+ * Re-apply journal records newer than the loaded database. Slot
+ * records go to the in-memory table, id records to the open B+tree
+ * transaction. A torn or unauthenticated tail (e.g. crash in the
+ * middle of an append) ends the replay and is cut off so that later
+ * appends stay readable.
+ */
+int journal_replay(void) {
+	struct journal_record jr;
+	unsigned char sealed[MAX_JOURNAL_PAYLOAD + SEAL_OVERHEAD];
+	unsigned char plain[MAX_JOURNAL_PAYLOAD];
+	off_t off = 0;
+	char *path;
+	int fd, rv = 1, count = 0;
+
+	journal_size = 0;
+
+	path = journal_path();
+	if (!path)
+		return 0;
+
+	fd = open(path, O_RDWR);
+	free(path);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 1;
+
+		syslog(LOG_ERR, "Can't open journal: %s", strerror(errno));
+		return 0;
+	}
+
+	while (1) {
+		ssize_t n;
+
+		n = pread(fd, &jr, sizeof(jr), off);
+		if (!n)
+			break;
+
+		if (n != sizeof(jr) || jr.magic != JOURNAL_MAGIC ||
+				jr.length > sizeof(sealed) || jr.length <= SEAL_OVERHEAD) {
+			syslog(LOG_WARNING, "Truncated journal record, dropping tail");
+			ftruncate(fd, off);
+			break;
+		}
+
+		n = pread(fd, sealed, jr.length, off + sizeof(jr));
+		if (n != jr.length ||
+				!open_data(plain, sealed, jr.length, (unsigned char *) &jr, sizeof(jr), db_key)) {
+			syslog(LOG_WARNING, "Corrupted journal record, dropping tail");
+			ftruncate(fd, off);
+			break;
+		}
+
+		off += sizeof(jr) + jr.length;
+		if (jr.seq <= journal_seq)
+			continue;
+
+		if (!journal_apply(plain, jr.length - SEAL_OVERHEAD)) {
+			syslog(LOG_ERR, "Invalid journal record %llu", jr.seq);
+			rv = 0;
+			break;
+		}
+
+		journal_seq = jr.seq;
+		count++;
+	}
+
+	memset(plain, 0, sizeof(plain));
+	close(fd);
+
+	journal_size = off;
+	if (count)
+		syslog(LOG_INFO, "Replayed %d journal records", count);
+
+	return rv;
+}
+
+/* Everything in the journal is in the database now */
+int journal_truncate(void) {
+	char *path;
+
+	path = journal_path();
+	if (!path)
+		return 0;
+
+	if (truncate(path, 0) < 0 && errno != ENOENT) {
+		syslog(LOG_ERR, "Can't truncate journal: %s", strerror(errno));
+		free(path);
+		return 0;
+	}
+
+	free(path);
+
+	return 1;
+}
+
+/* Same, queued records included */
+int journal_reset(void) {
+	pending_len = 0;
+	journal_pending = 0;
+	journal_size = 0;
+
+	return journal_truncate();
+}
+
+struct journal_state {
+	unsigned long long seq;
+	off_t size;
+	unsigned char *pending;
+	unsigned int pending_len, pending_max, count;
+	int fd, created;
+};
+
+/* Move the journal state into the vault, see vault.c */
+int journal_park(struct vault *v) {
+	struct journal_state *s = v->journal;
+
+	if (!s) {
+		s = malloc(sizeof(*s));
+		if (!s) {
+			syslog(LOG_ERR, "No memory");
+			return 0;
+		}
+		v->journal = s;
+	}
+
+	s->seq = journal_seq;
+	s->size = journal_size;
+	s->pending = pending;
+	s->pending_len = pending_len;
+	s->pending_max = pending_max;
+	s->count = journal_pending;
+	s->fd = journal_fd;
+	s->created = journal_created;
+
+	journal_seq = 0;
+	journal_size = 0;
+	pending = NULL;
+	pending_len = pending_max = journal_pending = 0;
+	journal_fd = -1;
+	journal_created = 0;
+
+	return 1;
+}
+
+void journal_resume(struct vault *v) {
+	struct journal_state *s = v->journal;
+
+	journal_seq = s->seq;
+	journal_size = s->size;
+	pending = s->pending;
+	pending_len = s->pending_len;
+	pending_max = s->pending_max;
+	journal_pending = s->count;
+	journal_fd = s->fd;
+	journal_created = s->created;
+}
+
+void journal_close(void) {
+	if (journal_fd >= 0)
+		close(journal_fd);
+
+	if (pending) {
+		memset(pending, 0, pending_max);
+		free(pending);
+	}
+
+	journal_seq = 0;
+	journal_size = 0;
+	pending = NULL;
+	pending_len = pending_max = journal_pending = 0;
+	journal_fd = -1;
+	journal_created = 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * opm - Open Password Manager.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Alexander Miroch
+ *    Email: <alexander.miroch@gmail.com>
+ */
+
+/*
+ * Key derivation for paged databases. The passphrase goes through scrypt,
+ * or PBKDF2-SHA256 where the crypto library has no scrypt, with a random
+ * salt; algorithm, costs and salt are kept in the meta pages. --calibrate
+ * measures this machine and picks the costs for a given unlock time.
+ */
+
+#include "opm.h"
+
+struct bt_kdf kdf_tuned;
+int kdf_calibrated = 0;
+
+/* what OpenSSL checks against maxmem: B is 128 * r * p, V 128 * r * (N + 2) */
+static unsigned long long scrypt_mem(struct bt_kdf *kdf) {
+	return 128ULL * kdf->r * ((1ULL << kdf->cost) + 2 + kdf->p);
+}
+
+static int kdf_valid(struct bt_kdf *kdf) {
+	switch (kdf->alg) {
+	case KDF_SCRYPT:
+		return kdf->cost >= KDF_SCRYPT_MIN_COST && kdf->cost <= KDF_SCRYPT_MAX_COST &&
+			kdf->r && kdf->r <= KDF_SCRYPT_MAX_R && kdf->p && kdf->p <= KDF_SCRYPT_MAX_P &&
+			scrypt_mem(kdf) <= KDF_MAX_MEM;
+	case KDF_PBKDF2:
+		return kdf->cost >= KDF_PBKDF2_MIN_ITER && kdf->cost <= KDF_PBKDF2_MAX_ITER;
+	}
+
+	return 0;
+}
+
+void kdf_defaults(struct bt_kdf *kdf) {
+	memset(kdf, 0, sizeof(*kdf));
+	kdf->alg = KDF_SCRYPT;
+	kdf->cost = KDF_SCRYPT_COST;
+	kdf->r = KDF_SCRYPT_R;
+	kdf->p = 1;
+}
+
+int kdf_derive(char *pass, struct bt_kdf *kdf, unsigned char *key) {
+	if (!kdf_valid(kdf))
+		return 0;
+
+	if (kdf->alg == KDF_SCRYPT)
+		return EVP_PBE_scrypt(pass, strlen(pass), kdf->salt, KDF_SALT_LEN,
+			1ULL << kdf->cost, kdf->r, kdf->p, scrypt_mem(kdf), key, DB_KEY_LEN) == 1;
+
+	return PKCS5_PBKDF2_HMAC(pass, strlen(pass), kdf->salt, KDF_SALT_LEN,
+		kdf->cost, EVP_sha256(), DB_KEY_LEN, key) == 1;
+}
+
+/* Milliseconds one derivation takes, -1 if it fails */
+static long kdf_time(struct bt_kdf *kdf) {
+	unsigned char key[DB_KEY_LEN];
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!kdf_derive("calibration", kdf, key))
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+static void kdf_print(char *prefix, struct bt_kdf *kdf, long t) {
+	if (kdf->alg == KDF_SCRYPT)
+		printf("%sscrypt N=2^%u r=%u p=%u (%llu MiB): %ld ms\n", prefix,
+			kdf->cost, kdf->r, kdf->p, scrypt_mem(kdf) >> 20, t);
+	else
+		printf("%sPBKDF2-SHA256 %u iterations: %ld ms\n", prefix, kdf->cost, t);
+}
+
+static int calibrate_pbkdf2(unsigned int msec, struct bt_kdf *kdf) {
+	unsigned long long iter;
+	long t;
+
+	kdf->alg = KDF_PBKDF2;
+	kdf->cost = KDF_PBKDF2_MIN_ITER;
+	kdf->r = kdf->p = 0;
+
+	t = kdf_time(kdf);
+	if (t < 0) {
+		fprintf(stderr, "Key derivation does not work\n");
+		return 0;
+	}
+	kdf_print("", kdf, t);
+
+	iter = (unsigned long long) kdf->cost * msec / (t ? t : 1);
+	kdf->cost = iter < KDF_PBKDF2_MIN_ITER ? KDF_PBKDF2_MIN_ITER :
+		iter > KDF_PBKDF2_MAX_ITER ? KDF_PBKDF2_MAX_ITER : iter;
+
+	t = kdf_time(kdf);
+	if (t < 0) {
+		fprintf(stderr, "Key derivation does not work\n");
+		return 0;
+	}
+	kdf_print("Picked ", kdf, t);
+
+	return 1;
+}
+
+/*
+ * Double scrypt's memory while a derivation takes less than half of
+ * 'msec', up to KDF_MAX_MEM; past that only p is raised. Costs never go
+ * below KDF_SCRYPT_MIN_COST, however slow the machine is.
+ */
+int kdf_calibrate(unsigned int msec, struct bt_kdf *kdf) {
+	unsigned int cost, best_cost = 0, p;
+	long t, best = -1;
+
+	memset(kdf, 0, sizeof(*kdf));
+	kdf->alg = KDF_SCRYPT;
+	kdf->r = KDF_SCRYPT_R;
+	kdf->p = 1;
+
+	for (cost = KDF_SCRYPT_MIN_COST; cost <= KDF_SCRYPT_MAX_COST; cost++) {
+		kdf->cost = cost;
+		if (scrypt_mem(kdf) > KDF_MAX_MEM)
+			break;
+
+		t = kdf_time(kdf);
+		if (t < 0)
+			break;
+		kdf_print("", kdf, t);
+
+		best = t;
+		best_cost = cost;
+		if (t * 2 > msec)
+			break;
+	}
+
+	if (best < 0) {
+		printf("scrypt is not available, calibrating PBKDF2\n");
+		return calibrate_pbkdf2(msec, kdf);
+	}
+
+	kdf->cost = best_cost;
+
+	/* memory is capped, spend the rest of the time in more passes */
+	if (best * 2 <= msec) {
+		p = msec / (best ? best : 1);
+		kdf->p = p > KDF_SCRYPT_MAX_P ? KDF_SCRYPT_MAX_P : p;
+	}
+
+	t = kdf_time(kdf);
+	if (t < 0) {
+		fprintf(stderr, "Key derivation does not work\n");
+		return 0;
+	}
+	kdf_print("Picked ", kdf, t);
+
+	return 1;
+}
@@ -38,6 +38,19 @@ void emsg(const char *format, ...) {
 	exit(255);
 }
 
+static unsigned long long parse_id(char *arg) {
+	unsigned long long id;
+	char *end;
+
+	id = strtoull(arg, &end, 10);
+	if (!id || *end) {
+		fprintf(stderr, "Invalid id: %s\n", arg);
+		exit(1);
+	}
+
+	return id;
+}
+
 int main(int argc, char *argv[]) {
 	int opt, option_index;
 	int opt_add_entry = 0;
@@ -46,7 +59,17 @@ int main(int argc, char *argv[]) {
 	int opt_console = 0;
 	int opt_remove_entry = 0;
 	int opt_stop = 0;
-	char *string;
+	int opt_fuzzy = 0;
+	int opt_durable = 0;
+	int opt_vaults = 0, opt_close = 0, opt_verify = 0, opt_passwd = 0;
+	unsigned int opt_calibrate = 0;
+	char *opt_import = NULL, *opt_export = NULL;
+	int opt_format = EXPORT_CSV, opt_seal = 0;
+	unsigned int opt_top = DEFAULT_FUZZY_LIMIT;
+	unsigned long long opt_get_id = 0, opt_remove_id = 0, opt_update_id = 0;
+	unsigned long long opt_history = 0;
+	unsigned int opt_restore = 0;
+	char *string, *default_file = NULL;
 
 	while ((opt = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1) {
 		switch (opt) {
@@ -61,6 +84,28 @@ int main(int argc, char *argv[]) {
 			case 'R':
 				opt_remove_entry = atoi(optarg);
 				break;
+			case 'i':
+				opt_get_id = parse_id(optarg);
+				break;
+			case 'r':
+				opt_remove_id = parse_id(optarg);
+				break;
+			case 'U':
+				opt_update_id = parse_id(optarg);
+				break;
+			case 'y':
+				opt_history = parse_id(optarg);
+				break;
+			case 'Y':
+				opt_restore = atoi(optarg);
+				if (!opt_restore)
+					usage(1);
+				break;
+			case 'K':
+				keep_revisions = atoi(optarg);
+				if (keep_revisions > MAX_KEEP_REVISIONS)
+					usage(1);
+				break;
 			case 'D':
 				database_file = optarg;
 				break;
@@ -70,6 +115,78 @@ int main(int argc, char *argv[]) {
 			case 'S':
 				opt_stop = 1;
 				break;
+			case 'a':
+				all_vaults = 1;
+				break;
+			case 'V':
+				opt_vaults = 1;
+				break;
+			case 'x':
+				opt_close = 1;
+				break;
+			case 'T':
+				opt_verify = 1;
+				break;
+			case 'P':
+				opt_passwd = 1;
+				break;
+			case 'm':
+				opt_calibrate = atoi(optarg);
+				if (!opt_calibrate || opt_calibrate > KDF_MAX_MSEC)
+					usage(1);
+				break;
+			case 'C':
+				compact_ratio = atoi(optarg);
+				if (compact_ratio > 100)
+					usage(1);
+				break;
+			case 'W':
+				commit_window = atoi(optarg);
+				break;
+			case 'N':
+				commit_ops = atoi(optarg);
+				if (!commit_ops)
+					usage(1);
+				break;
+			case 'F':
+				if (!strcmp(optarg, "always"))
+					fsync_policy = FSYNC_ALWAYS;
+				else if (!strcmp(optarg, "interval"))
+					fsync_policy = FSYNC_INTERVAL;
+				else if (!strcmp(optarg, "never"))
+					fsync_policy = FSYNC_NEVER;
+				else
+					usage(1);
+				break;
+			case 'w':
+				opt_durable = 1;
+				break;
+			case 'I':
+				opt_import = optarg;
+				break;
+			case 'E':
+				opt_export = optarg;
+				break;
+			case 'f':
+				if (!strcmp(optarg, "csv"))
+					opt_format = EXPORT_CSV;
+				else if (!strcmp(optarg, "json"))
+					opt_format = EXPORT_JSON;
+				else
+					usage(1);
+				break;
+			case 'e':
+				opt_seal = 1;
+				break;
+			case 'z':
+				opt_fuzzy = 1;
+				break;
+			case 'k':
+				opt_top = atoi(optarg);
+				if (!opt_top || opt_top > MAX_FUZZY_LIMIT)
+					usage(1);
+				opt_fuzzy = 1;
+				break;
 			case 'v':
 				opt_verbose = 1;
 				break;
@@ -95,22 +212,44 @@ int main(int argc, char *argv[]) {
 			exit(1);
 		}
 		
-		database_file = (char *) malloc(sizeof(char) * strlen(pw->pw_dir) + strlen(DEFAULT_DATABASE_FILE) + 1);
-		if (!database_file) {
+		default_file = (char *) malloc(sizeof(char) * strlen(pw->pw_dir) + strlen(DEFAULT_DATABASE_FILE) + 2);
+		if (!default_file) {
 			fprintf(stderr, "Memory allocation error\n");
 			exit(1);
 		}
 
-		strcpy(database_file, pw->pw_dir);
-		strcat(database_file, "/");
-		strcat(database_file, DEFAULT_DATABASE_FILE);
+		strcpy(default_file, pw->pw_dir);
+		strcat(default_file, "/");
+		strcat(default_file, DEFAULT_DATABASE_FILE);
+		database_file = default_file;
 	}
 
+	database_file = vault_path(database_file);
+	free(default_file);
 	if (strlen(database_file) >= PATH_MAX) {
 		fprintf(stderr, "Too long path for database\n");
 		exit(1);
 	}
 
+	if (opt_verify)
+		exit(verify_database(database_file) ? 0 : 1);
+
+	if (opt_calibrate) {
+		if (is_daemon_started()) {
+			fprintf(stderr, "Daemon is running, stop it first (-S)\n");
+			exit(1);
+		}
+
+		if (!kdf_calibrate(opt_calibrate, &kdf_tuned))
+			exit(1);
+
+		/* the daemon inherits them */
+		kdf_calibrated = 1;
+		start_daemon();
+		wait_for_daemon();
+		exit(0);
+	}
+
 	if (opt_stop) {
 		if (!is_daemon_started()) {
 			fprintf(stderr, "Daemon is not started\n");
@@ -122,16 +261,73 @@ int main(int argc, char *argv[]) {
 		exit(0);
 	}
 
+	if (opt_vaults) {
+		if (!is_daemon_started()) {
+			fprintf(stderr, "Daemon is not started\n");
+			exit(1);
+		}
+
+		if (!list_vaults()) {
+			fprintf(stderr, "Failed to list databases\n");
+			exit(1);
+		}
+		exit(0);
+	}
+
+	if (opt_close) {
+		if (!is_daemon_started() || !open_vault(0)) {
+			fprintf(stderr, "Database is not open\n");
+			exit(1);
+		}
+
+		close_vault();
+		printf("Database closed\n");
+		exit(0);
+	}
+
 	if (!is_daemon_started()) {
 		start_daemon();
 		wait_for_daemon();
 	}
 
+	/* --all does without a vault of its own */
+	if (!open_vault(!all_vaults) && !all_vaults)
+		exit(1);
+
+	if (opt_passwd) {
+		if (!change_passwd()) {
+			fprintf(stderr, "Failed to change passphrase\n");
+			exit(1);
+		}
+		printf("Passphrase changed\n");
+		exit(0);
+	}
+
 	if (opt_add_entry) {
 		add_entry();
 		exit(0);
 	}
 
+	if (opt_import) {
+		if (!import_file(opt_import))
+			exit(1);
+		exit(0);
+	}
+
+	if (opt_export) {
+		if (!export_db(opt_export, opt_format, opt_seal))
+			exit(1);
+		exit(0);
+	}
+
+	if (opt_durable) {
+		if (!wait_durable()) {
+			fprintf(stderr, "Failed to sync database\n");
+			exit(1);
+		}
+		exit(0);
+	}
+
 	if (opt_list) {
 		if (!list_db(opt_verbose)) {
 			fprintf(stderr, "Failed to list password database\n");
@@ -148,6 +344,45 @@ int main(int argc, char *argv[]) {
 		exit(0);
 	}
 
+	if (opt_remove_id) {
+		if (!remove_entry_id(opt_remove_id)) {
+			fprintf(stderr, "Failed to remove entry from database\n");
+			exit(1);
+		}
+		exit(0);
+	}
+
+	if (opt_update_id) {
+		update_entry(opt_update_id);
+		exit(0);
+	}
+
+	if (opt_restore && !opt_history)
+		usage(1);
+
+	if (opt_history) {
+		if (opt_restore ? !restore_revision(opt_history, opt_restore) :
+				!show_history(opt_history, opt_verbose))
+			exit(1);
+		exit(0);
+	}
+
+	if (opt_get_id) {
+		if (!get_entry_id(opt_get_id, opt_verbose, opt_console)) {
+			fprintf(stderr, "Failed to get entry\n");
+			exit(1);
+		}
+		exit(0);
+	}
+
+	if (opt_fuzzy) {
+		if (!get_entry_fuzzy(string, opt_top, opt_verbose, opt_console)) {
+			fprintf(stderr, "Failed to get entry\n");
+			exit(1);
+		}
+		exit(0);
+	}
+
 	if (!get_entry(string, opt_verbose, opt_console)) {
 		fprintf(stderr, "Failed to get entry\n");
 		exit(1);
@@ -76,8 +76,9 @@ int xdaemon(int *fds, pid_t *rpid) {
 	pid_t pid;
 	Window win;
         Display *dpy;
-	ssize_t size, rcv_size;
-	char rpassword[MAX_PASSWORD_LEN];
+	ssize_t size;
+	int rcv_size;
+	char rpassword[MAX_RECORD_LEN + 1];
 	int x11_fd, efd;
 	struct epoll_event ee, events[MAX_EVENTS];
 
@@ -142,7 +143,7 @@ int xdaemon(int *fds, pid_t *rpid) {
 		return 0;
 	}
 	
-	memset(rpassword, 0, MAX_PASSWORD_LEN);
+	memset(rpassword, 0, sizeof(rpassword));
 	while (1) {
 		int n, i;
 
@@ -160,7 +161,7 @@ int xdaemon(int *fds, pid_t *rpid) {
 					continue;
 				}
 
-				if (rcv_size > MAX_PASSWORD_LEN) {
+				if (rcv_size < 0 || rcv_size > MAX_RECORD_LEN) {
 					syslog(LOG_WARNING, "Corrupter data received");
 					continue;
 				}
@@ -258,9 +259,7 @@ int setup_signals(void) {
 #else
 
 
-int xdaemon(int *fds) {
-	close(fds[0]);
-	close(fds[1]);
+int xdaemon(int *fds, pid_t *rpid) {
 	return 0;
 }
 
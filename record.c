@@ -0,0 +1,169 @@
+/*
+ * opm - Open Password Manager.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Alexander Miroch
+ *    Email: <alexander.miroch@gmail.com>
+ */
+
+/*
+ * Entry encoding shared by the database file, the journal, the daemon
+ * memory and the socket protocol. Each field (name, url, login,
+ * password, notes) is a 16-bit length followed by the bytes and a
+ * terminating zero, so a decoded entry just points into the buffer.
+ */
+
+#include "opm.h"
+
+char **record_fields(struct db_entry *de, int i) {
+	switch (i) {
+		case 0: return &de->name;
+		case 1: return &de->url;
+		case 2: return &de->login;
+		case 3: return &de->password;
+	}
+
+	return &de->notes;
+}
+
+unsigned int record_size(struct db_entry *de) {
+	unsigned int size = 0;
+	char *f;
+	int i;
+
+	for (i = 0; i < RECORD_FIELDS; i++) {
+		f = *record_fields(de, i);
+		size += sizeof(unsigned short) + (f ? strlen(f) : 0) + 1;
+	}
+
+	return size;
+}
+
+/* Returns the encoded length or 0 if it does not fit into max */
+unsigned int record_encode(struct db_entry *de, unsigned char *buf, unsigned int max) {
+	unsigned int off = 0;
+	unsigned short len;
+	char *f;
+	int i;
+
+	if (record_size(de) > max)
+		return 0;
+
+	for (i = 0; i < RECORD_FIELDS; i++) {
+		f = *record_fields(de, i);
+		len = f ? strlen(f) : 0;
+
+		memcpy(buf + off, &len, sizeof(len));
+		off += sizeof(len);
+		if (len)
+			memcpy(buf + off, f, len);
+		off += len;
+		buf[off++] = '\0';
+	}
+
+	return off;
+}
+
+/*
+ * Point the fields of 'de' into an encoded record. Returns the number
+ * of bytes the record takes or 0 if it is malformed.
+ */
+unsigned int record_decode(unsigned char *buf, unsigned int size, struct db_entry *de) {
+	unsigned int off = 0;
+	unsigned short len;
+	int i;
+
+	for (i = 0; i < RECORD_FIELDS; i++) {
+		if (off + sizeof(len) > size)
+			return 0;
+
+		memcpy(&len, buf + off, sizeof(len));
+		off += sizeof(len);
+
+		if (off + len + 1 > size || buf[off + len] || memchr(buf + off, '\0', len))
+			return 0;
+
+		*record_fields(de, i) = (char *) buf + off;
+		off += len + 1;
+	}
+
+	return off;
+}
+
+/* Encode an entry of the fixed-size layout used up to VERSION_CODE 0x200 */
+unsigned int record_from_v1(struct db_entry_v1 *old, unsigned char *buf) {
+	char name[sizeof(old->name) + 1], url[sizeof(old->url) + 1];
+	char login[sizeof(old->login) + 1], password[sizeof(old->password) + 1];
+	char notes[sizeof(old->notes) + 1];
+	struct db_entry de;
+	unsigned int len;
+
+	memcpy(name, old->name, sizeof(old->name));
+	name[sizeof(old->name)] = '\0';
+	memcpy(url, old->url, sizeof(old->url));
+	url[sizeof(old->url)] = '\0';
+	memcpy(login, old->login, sizeof(old->login));
+	login[sizeof(old->login)] = '\0';
+	memcpy(password, old->password, sizeof(old->password));
+	password[sizeof(old->password)] = '\0';
+	memcpy(notes, old->notes, sizeof(old->notes));
+	notes[sizeof(old->notes)] = '\0';
+
+	de.name = name;
+	de.url = url;
+	de.login = login;
+	de.password = password;
+	de.notes = notes;
+
+	len = record_encode(&de, buf, MAX_RECORD_LEN);
+	memset(password, 0, sizeof(password));
+
+	return len;
+}
+
+/*
+ * Decode a reply made of back-to-back entries, each an id followed by
+ * a record. The entries point into buf, which must outlive them.
+ */
+struct db_entry *record_decode_all(unsigned char *buf, unsigned int size, unsigned int *count) {
+	struct db_entry de, *entries;
+	unsigned int off, len, n = 0;
+	unsigned long long id;
+
+	for (off = 0; off < size; off += sizeof(id) + len, n++) {
+		if (size - off <= sizeof(id))
+			return NULL;
+
+		len = record_decode(buf + off + sizeof(id), size - off - sizeof(id), &de);
+		if (!len)
+			return NULL;
+	}
+
+	entries = malloc((n ? n : 1) * sizeof(struct db_entry));
+	if (!entries)
+		return NULL;
+
+	for (off = 0, n = 0; off < size; n++) {
+		memcpy(&id, buf + off, sizeof(id));
+		off += sizeof(id);
+		off += record_decode(buf + off, size - off, &entries[n]);
+		entries[n].id = id;
+	}
+
+	*count = n;
+
+	return entries;
+}
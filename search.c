@@ -0,0 +1,222 @@
+/*
+ * opm - Open Password Manager.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Alexander Miroch
+ *    Email: <alexander.miroch@gmail.com>
+ */
+
+/*
+ * ASCII case-insensitive substring search.
+ *
+ * The vector versions compare the first and the last character of the
+ * needle against 16 (SSE2) or 32 (AVX2) positions of the haystack at
+ * once and only look at the rest of the needle where both match. The
+ * implementation is picked once by search_init() from what the CPU
+ * supports. The haystack must be zero-terminated.
+ */
+
+#include "opm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+int (*ci_search)(const char *, size_t, const char *, size_t) = ci_search_scalar;
+const char *ci_search_impl = "scalar";
+
+static inline unsigned char fold(unsigned char c) {
+	return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+static inline int ci_equal(const char *a, const char *b, size_t len) {
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (fold(a[i]) != fold(b[i]))
+			return 0;
+	}
+
+	return 1;
+}
+
+int ci_search_scalar(const char *hay, size_t hlen, const char *needle, size_t nlen) {
+	unsigned char first, last;
+	size_t i;
+
+	if (!nlen)
+		return 1;
+
+	if (nlen > hlen)
+		return 0;
+
+	first = fold(needle[0]);
+	last = fold(needle[nlen - 1]);
+
+	for (i = 0; i + nlen <= hlen; i++) {
+		if (fold(hay[i]) == first && fold(hay[i + nlen - 1]) == last &&
+				ci_equal(hay + i + 1, needle + 1, nlen - 1))
+			return 1;
+	}
+
+	return 0;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/*
+ * The haystack is read in aligned blocks. An aligned load never crosses
+ * a page, so the bytes past the terminating zero it may pick up are
+ * harmless, but sanitizers would complain about them.
+ */
+#define CI_KERNEL __attribute__((no_sanitize_address))
+
+/* 'A'..'Z' -> 'a'..'z', signed compares only, so shift the range first */
+static inline __m128i fold_sse2(__m128i v) {
+	__m128i t = _mm_add_epi8(v, _mm_set1_epi8(0x80 - 'A'));
+	__m128i upper = _mm_cmplt_epi8(t, _mm_set1_epi8(-128 + 26));
+
+	return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+/*
+ * Bit i of the result is set when position i of the block starting at
+ * p holds the first needle character and position i + nlen - 1 holds
+ * the last one. The latter may be in the next block, which is only
+ * read when the string reaches into it.
+ */
+CI_KERNEL int ci_search_sse2(const char *hay, size_t hlen, const char *needle, size_t nlen) {
+	const char *p, *end = hay + hlen, *last_pos;
+	__m128i first, last, v;
+	unsigned long long fm, lm, nlm, m;
+	int bit;
+
+	if (nlen < 2 || nlen > hlen || nlen - 1 > 16)
+		return ci_search_scalar(hay, hlen, needle, nlen);
+
+	first = _mm_set1_epi8(fold(needle[0]));
+	last = _mm_set1_epi8(fold(needle[nlen - 1]));
+	last_pos = end - nlen;
+
+	p = (const char *) ((unsigned long) hay & ~15UL);
+	v = fold_sse2(_mm_load_si128((const __m128i *) p));
+	fm = _mm_movemask_epi8(_mm_cmpeq_epi8(v, first));
+	lm = _mm_movemask_epi8(_mm_cmpeq_epi8(v, last));
+	fm &= ~0ULL << (hay - p);
+
+	while (p <= last_pos) {
+		nlm = 0;
+		if (p + 16 <= end) {
+			v = fold_sse2(_mm_load_si128((const __m128i *) (p + 16)));
+			nlm = _mm_movemask_epi8(_mm_cmpeq_epi8(v, last));
+		}
+
+		m = fm & ((lm | nlm << 16) >> (nlen - 1));
+		if (last_pos < p + 16)
+			m &= (2ULL << (last_pos - p)) - 1;
+
+		while (m) {
+			bit = __builtin_ctzll(m);
+			if (ci_equal(p + bit + 1, needle + 1, nlen - 2))
+				return 1;
+			m &= m - 1;
+		}
+
+		p += 16;
+		fm = _mm_movemask_epi8(_mm_cmpeq_epi8(v, first));
+		lm = nlm;
+	}
+
+	return 0;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i fold_avx2(__m256i v) {
+	__m256i t = _mm256_add_epi8(v, _mm256_set1_epi8(0x80 - 'A'));
+	__m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26), t);
+
+	return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+CI_KERNEL int ci_search_avx2(const char *hay, size_t hlen, const char *needle, size_t nlen) {
+	const char *p, *end = hay + hlen, *last_pos;
+	__m256i first, last, v;
+	unsigned long long fm, lm, nlm, m;
+	int bit;
+
+	if (nlen < 2 || nlen > hlen || nlen - 1 > 32)
+		return ci_search_scalar(hay, hlen, needle, nlen);
+
+	first = _mm256_set1_epi8(fold(needle[0]));
+	last = _mm256_set1_epi8(fold(needle[nlen - 1]));
+	last_pos = end - nlen;
+
+	p = (const char *) ((unsigned long) hay & ~31UL);
+	v = fold_avx2(_mm256_load_si256((const __m256i *) p));
+	fm = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, first));
+	lm = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, last));
+	fm &= ~0ULL << (hay - p);
+
+	while (p <= last_pos) {
+		nlm = 0;
+		if (p + 32 <= end) {
+			v = fold_avx2(_mm256_load_si256((const __m256i *) (p + 32)));
+			nlm = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, last));
+		}
+
+		m = fm & ((lm | nlm << 32) >> (nlen - 1));
+		if (last_pos < p + 32)
+			m &= (2ULL << (last_pos - p)) - 1;
+
+		while (m) {
+			bit = __builtin_ctzll(m);
+			if (ci_equal(p + bit + 1, needle + 1, nlen - 2))
+				return 1;
+			m &= m - 1;
+		}
+
+		p += 32;
+		fm = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, first));
+		lm = nlm;
+	}
+
+	return 0;
+}
+
+#endif
+
+void search_init(void) {
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		ci_search = ci_search_avx2;
+		ci_search_impl = "avx2";
+		return;
+	}
+
+	if (__builtin_cpu_supports("sse2")) {
+		ci_search = ci_search_sse2;
+		ci_search_impl = "sse2";
+		return;
+	}
+#endif
+
+	ci_search = ci_search_scalar;
+	ci_search_impl = "scalar";
+}
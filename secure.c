@@ -0,0 +1,325 @@
+/*
+ * opm - Open Password Manager.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Alexander Miroch
+ *    Email: <alexander.miroch@gmail.com>
+ */
+
+#include "opm.h"
+
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/lsan_interface.h>
+/* LeakSanitizer does not look into our mappings */
+#define ROOT_ADD(p, len)	__lsan_register_root_region(p, len)
+#define ROOT_DEL(p, len)	__lsan_unregister_root_region(p, len)
+#else
+#define ROOT_ADD(p, len)
+#define ROOT_DEL(p, len)
+#endif
+
+/*
+ * Memory for buffers that hold plain text. It comes from mmap'ed regions
+ * that are locked in RAM, left out of core dumps and fenced by PROT_NONE
+ * guard pages. Small buffers are carved from slabs by power-of-two size
+ * class and go back to a free list of their class, so the per-request
+ * buffers are reused instead of being handed back to the system. Large
+ * ones get a region of their own, placed right before the trailing guard
+ * page. Everything is wiped on free, so an allocation is always zeroed.
+ *
+ * If the pages can not be locked (RLIMIT_MEMLOCK) it is logged once and
+ * the memory is used unlocked.
+ */
+
+struct secure_region {
+	struct secure_region *prev, *next;
+	size_t len;		/* the mapping, guard pages included */
+};
+
+struct secure_chunk {
+	struct secure_region *region;	/* large chunks only */
+	struct secure_chunk *next;	/* on the free list */
+	size_t size;
+	unsigned int cls;
+	unsigned int magic;
+};
+
+#define CHUNK_USED	0x5ec0a11c
+#define CHUNK_FREE	0x5ec0f4ee
+
+#define NUM_CLASSES	(SECURE_MAX_CLASS - SECURE_MIN_CLASS + 1)
+#define LARGE_CLASS	NUM_CLASSES
+
+#define ALIGN(x, a)	(((x) + (a) - 1) & ~((size_t) (a) - 1))
+
+static struct secure_chunk *free_chunks[NUM_CLASSES];
+static struct secure_region *regions = NULL;
+static pthread_mutex_t secure_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t page_size = 0;
+static int lock_warned = 0;
+
+/* Static buffers, see secure_lock() */
+static struct {
+	void *p;
+	size_t len;
+} statics[SECURE_MAX_STATIC];
+static unsigned int num_statics = 0;
+
+static void lock_pages(void *p, size_t len) {
+	if (mlock(p, len) && !lock_warned) {
+		syslog(LOG_WARNING, "Can not lock memory: %s", strerror(errno));
+		lock_warned = 1;
+	}
+
+	madvise(p, len, MADV_DONTDUMP);
+}
+
+static void page_range(void *p, size_t len, void **start, size_t *plen) {
+	unsigned long a = (unsigned long) p & ~(page_size - 1);
+
+	*start = (void *) a;
+	*plen = ALIGN((unsigned long) p + len - a, page_size);
+}
+
+/* A locked region of 'len' usable bytes between two guard pages, linked in */
+static struct secure_region *region_new(size_t len) {
+	struct secure_region *r;
+	unsigned char *p;
+	size_t total;
+
+	if (!page_size)
+		page_size = sysconf(_SC_PAGESIZE);
+
+	total = ALIGN(len, page_size) + 2 * page_size;
+	p = mmap(NULL, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		syslog(LOG_ERR, "Memory allocation error");
+		return NULL;
+	}
+
+	if (mprotect(p + page_size, total - 2 * page_size, PROT_READ | PROT_WRITE)) {
+		syslog(LOG_ERR, "Memory allocation error");
+		munmap(p, total);
+		return NULL;
+	}
+
+	lock_pages(p + page_size, total - 2 * page_size);
+	ROOT_ADD(p + page_size, total - 2 * page_size);
+
+	r = (struct secure_region *) (p + page_size);
+	r->len = total;
+	r->prev = NULL;
+	r->next = regions;
+	if (regions)
+		regions->prev = r;
+	regions = r;
+
+	return r;
+}
+
+static void region_free(struct secure_region *r) {
+	if (r->prev)
+		r->prev->next = r->next;
+	else
+		regions = r->next;
+	if (r->next)
+		r->next->prev = r->prev;
+
+	ROOT_DEL(r, r->len - 2 * page_size);
+	munmap((unsigned char *) r - page_size, r->len);
+}
+
+/* Cut a new slab into chunks of class 'cls' */
+static int slab_grow(unsigned int cls) {
+	struct secure_region *r;
+	struct secure_chunk *c;
+	size_t stride, off;
+
+	r = region_new(SECURE_SLAB_SIZE);
+	if (!r)
+		return 0;
+
+	stride = sizeof(struct secure_chunk) + ((size_t) 1 << (cls + SECURE_MIN_CLASS));
+	for (off = ALIGN(sizeof(*r), sizeof(*c)); off + stride <= SECURE_SLAB_SIZE; off += stride) {
+		c = (struct secure_chunk *) ((unsigned char *) r + off);
+		c->cls = cls;
+		c->magic = CHUNK_FREE;
+		c->next = free_chunks[cls];
+		free_chunks[cls] = c;
+	}
+
+	return 1;
+}
+
+static struct secure_chunk *large_alloc(size_t size) {
+	struct secure_region *r;
+	struct secure_chunk *c;
+	size_t len, used;
+
+	used = ALIGN(size, sizeof(*c));
+	len = sizeof(*r) + sizeof(*c) + used;
+	r = region_new(len);
+	if (!r)
+		return NULL;
+
+	/* overruns hit the guard page */
+	len = r->len - 2 * page_size;
+	c = (struct secure_chunk *) ((unsigned char *) r + len - used) - 1;
+	c->region = r;
+	c->cls = LARGE_CLASS;
+
+	return c;
+}
+
+static size_t chunk_capacity(struct secure_chunk *c) {
+	if (c->cls == LARGE_CLASS)
+		return (unsigned char *) c->region + c->region->len - 2 * page_size -
+			(unsigned char *) (c + 1);
+
+	return (size_t) 1 << (c->cls + SECURE_MIN_CLASS);
+}
+
+void *secure_alloc(size_t size) {
+	struct secure_chunk *c;
+	unsigned int cls = 0;
+
+	if (size > SIZE_MAX / 2)
+		return NULL;
+
+	while (cls < NUM_CLASSES && ((size_t) 1 << (cls + SECURE_MIN_CLASS)) < size)
+		cls++;
+
+	pthread_mutex_lock(&secure_mutex);
+	if (cls == LARGE_CLASS) {
+		c = large_alloc(size);
+	} else {
+		if (!free_chunks[cls] && !slab_grow(cls))
+			c = NULL;
+		else {
+			c = free_chunks[cls];
+			free_chunks[cls] = c->next;
+			c->next = NULL;
+		}
+	}
+
+	if (c) {
+		c->size = size;
+		c->magic = CHUNK_USED;
+	}
+	pthread_mutex_unlock(&secure_mutex);
+
+	return c ? c + 1 : NULL;
+}
+
+void secure_free(void *p) {
+	struct secure_chunk *c;
+
+	if (!p)
+		return;
+
+	c = (struct secure_chunk *) p - 1;
+	if (c->magic != CHUNK_USED) {
+		syslog(LOG_ERR, "Secure memory is corrupted");
+		abort();
+	}
+
+	memset(p, 0, chunk_capacity(c));
+
+	pthread_mutex_lock(&secure_mutex);
+	if (c->cls == LARGE_CLASS) {
+		region_free(c->region);
+	} else {
+		c->magic = CHUNK_FREE;
+		c->next = free_chunks[c->cls];
+		free_chunks[c->cls] = c;
+	}
+	pthread_mutex_unlock(&secure_mutex);
+}
+
+/* Never leaves an unwiped copy behind, NULL keeps the old buffer */
+void *secure_realloc(void *p, size_t size) {
+	struct secure_chunk *c;
+	void *tmp;
+
+	if (!p)
+		return secure_alloc(size);
+
+	c = (struct secure_chunk *) p - 1;
+	if (size <= chunk_capacity(c)) {
+		if (size < c->size)
+			memset((unsigned char *) p + size, 0, c->size - size);
+		c->size = size;
+		return p;
+	}
+
+	tmp = secure_alloc(size);
+	if (!tmp)
+		return NULL;
+
+	memcpy(tmp, p, c->size);
+	secure_free(p);
+
+	return tmp;
+}
+
+/* Lock the pages of a static buffer too */
+void secure_lock(void *p, size_t len) {
+	void *start;
+	size_t plen;
+
+	if (num_statics == SECURE_MAX_STATIC)
+		return;
+
+	if (!page_size)
+		page_size = sysconf(_SC_PAGESIZE);
+
+	statics[num_statics].p = p;
+	statics[num_statics].len = len;
+	num_statics++;
+
+	page_range(p, len, &start, &plen);
+	lock_pages(start, plen);
+}
+
+/* Memory locks are not inherited, the daemon takes them again after fork() */
+void secure_relock(void) {
+	struct secure_region *r;
+	void *start;
+	size_t plen;
+	unsigned int i;
+
+	pthread_mutex_lock(&secure_mutex);
+	for (r = regions; r; r = r->next)
+		lock_pages(r, r->len - 2 * page_size);
+	pthread_mutex_unlock(&secure_mutex);
+
+	for (i = 0; i < num_statics; i++) {
+		page_range(statics[i].p, statics[i].len, &start, &plen);
+		lock_pages(start, plen);
+	}
+}
+
+/* zlib keeps plain text in its buffers */
+void *secure_zalloc(void *opaque, unsigned int items, unsigned int size) {
+	if (size && items > SIZE_MAX / size)
+		return NULL;
+
+	return secure_alloc((size_t) items * size);
+}
+
+void secure_zfree(void *opaque, void *ptr) {
+	secure_free(ptr);
+}
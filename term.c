@@ -162,30 +162,76 @@ void get_input_entry(char *title, char *output, int maxlen) {
 
 }
 
+/* Read a line of any length, the caller frees it */
+char *input_entry(char *title) {
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+
+	printf("%s", title);
+	len = getline(&line, &size, stdin);
+	if (len < 0) {
+		free(line);
+		return strdup("");
+	}
+
+	if (len > 0 && line[len - 1] == '\n')
+		line[len - 1] = '\0';
+
+	return line;
+}
+
+/* Like input_entry() without echo, the prompt goes to stderr */
+char *ask_secret(char *title) {
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+
+	fprintf(stderr, "%s", title);
+	echo_off();
+	len = getline(&line, &size, stdin);
+	echo_on();
+	fprintf(stderr, "\n");
+
+	if (len < 0) {
+		free(line);
+		return strdup("");
+	}
+
+	if (len > 0 && line[len - 1] == '\n')
+		line[len - 1] = '\0';
+
+	return line;
+}
+
+static void wipe_input(char *line) {
+	memset(line, 0, strlen(line));
+	free(line);
+}
+
 void add_entry(void) {
 	struct db_entry de;
-	char fmt[16], ipassword[MAX_PASSWORD_LEN];
+	char *ipassword;
+	int rv;
 
-	memset((void *) &de, 0, sizeof(struct db_entry));	
-
-	get_input_entry("Enter service name: ", de.name, MAX_DB_RECORD_LEN);
+	de.name = input_entry("Enter service name: ");
 	if (is_empty(de.name)) {
 		fprintf(stderr, "Service name is required\n");
 		exit(1);
 	}
 
-	get_input_entry("Enter service login: ", de.login, MAX_LOGIN_LEN);
+	de.login = input_entry("Enter service login: ");
 	if (is_empty(de.login)) {
 		fprintf(stderr, "Login is required\n");
 		exit(1);
 	}
 
-	get_input_entry("Enter service url (optional): ", de.url, MAX_DB_RECORD_LEN);
+	de.url = input_entry("Enter service url (optional): ");
 
 	echo_off();
-	get_input_entry("Enter service password: ", de.password, MAX_PASSWORD_LEN);
+	de.password = input_entry("Enter service password: ");
 	printf("\n");
-	get_input_entry("Enter service password (one more time): ", ipassword, MAX_PASSWORD_LEN);
+	ipassword = input_entry("Enter service password (one more time): ");
 	printf("\n");
 	echo_on();
 	if (is_empty(de.password)) {
@@ -193,31 +239,122 @@ void add_entry(void) {
 		exit(1);
 	}
 
-	if (strcmp(ipassword, de.password)) {
+	rv = strcmp(ipassword, de.password);
+	wipe_input(ipassword);
+	if (rv) {
+		wipe_input(de.password);
 		fprintf(stderr, "Password mismatch\n");
 		exit(1);
 	}
 
-	get_input_entry("Enter notes (optional): ", de.notes, MAX_NOTES_LEN);
+	de.notes = input_entry("Enter notes (optional): ");
 
-	if (!db_add_entry(&de)) {
+	rv = db_add_entry(&de);
+	wipe_input(de.password);
+	if (!rv) {
 		fprintf(stderr, "Failed to add entry\n");
 		exit(1);
 	}
+
+	free(de.name);
+	free(de.login);
+	free(de.url);
+	free(de.notes);
 }
 
-void pretty_output(struct db_entry *base, int count, int is_verbose) {
-	struct db_entry *de = base;
-	int i;
+/* Ask for a field showing its current value, an empty answer keeps it */
+static char *update_input(char *title, char *cur) {
+	char prompt[64], *line;
 
-#define FMT "%3d    %-20s (%-s %-s) %s\n"
+	if (cur)
+		snprintf(prompt, sizeof(prompt), "%s [%.24s]: ", title, cur);
+	else
+		snprintf(prompt, sizeof(prompt), "%s (empty keeps it): ", title);
 
-        for (i = 0; i < count; i++) {
-		if (is_verbose)
-	                printf("%3d    %-20s (%-s %-s) %s\n", i + 1, de->name, de->login, de->url, de->notes);
-		else
-	                printf("%3d    %s\n", i + 1, de->name);
-                de++;
-        }
+	line = input_entry(prompt);
+	if (*line)
+		return line;
+
+	free(line);
+	return NULL;
+}
+
+void update_entry(unsigned long long id) {
+	struct parcel pc;
+	struct db_entry *cur, de;
+	char *field[RECORD_FIELDS], *ipassword;
+	unsigned int nums, i;
+	int rv;
+
+	pc.type = PT_GET_ID;
+	pc.length = sizeof(id);
+	pc.data = (void *) &id;
+
+	cur = query_entries(&pc, &nums);
+	if (!cur)
+		exit(1);
+
+	if (!nums) {
+		fprintf(stderr, "Entry not found\n");
+		exit(1);
+	}
+
+	field[0] = update_input("Enter service name", cur->name);
+	field[1] = update_input("Enter service login", cur->login);
+	field[2] = update_input("Enter service url", cur->url);
+
+	echo_off();
+	field[3] = update_input("Enter service password", NULL);
+	printf("\n");
+	if (field[3]) {
+		ipassword = input_entry("Enter service password (one more time): ");
+		printf("\n");
+		rv = strcmp(ipassword, field[3]);
+		wipe_input(ipassword);
+		if (rv) {
+			echo_on();
+			wipe_input(field[3]);
+			fprintf(stderr, "Password mismatch\n");
+			exit(1);
+		}
+	}
+	echo_on();
+
+	field[4] = update_input("Enter notes", cur->notes);
+
+	de.name = field[0] ? field[0] : cur->name;
+	de.login = field[1] ? field[1] : cur->login;
+	de.url = field[2] ? field[2] : cur->url;
+	de.password = field[3] ? field[3] : cur->password;
+	de.notes = field[4] ? field[4] : cur->notes;
+
+	if (is_empty(de.name) || is_empty(de.login) || is_empty(de.password)) {
+		fprintf(stderr, "Service name, login and password are required\n");
+		exit(1);
+	}
+
+	rv = db_update_entry(id, &de);
+
+	if (field[3])
+		wipe_input(field[3]);
+	for (i = 0; i < RECORD_FIELDS; i++) {
+		if (i != 3)
+			free(field[i]);
+	}
+
+	free(cur);
+	free_reply(&pc);
+
+	if (!rv) {
+		fprintf(stderr, "Failed to update entry\n");
+		exit(1);
+	}
+}
+
+void pretty_entry(struct db_entry *de, unsigned int n, int is_verbose) {
+	if (is_verbose)
+		printf("%3u  %6llu  %-20s (%-s %-s)\n", n, de->id, de->name, de->login, de->url);
+	else
+		printf("%3u    %s\n", n, de->name);
 }
 
@@ -0,0 +1,327 @@
+/*
+ * opm - Open Password Manager.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Alexander Miroch
+ *    Email: <alexander.miroch@gmail.com>
+ */
+
+/*
+ * Trigram index over the case-folded name and login of every entry.
+ * Each trigram maps to the sorted list of ids of the entries that
+ * contain it. A substring query of three or more characters can only
+ * match entries present in the lists of all its trigrams, so only
+ * those have to be checked. Trigrams never span two fields.
+ */
+
+#include "opm.h"
+
+struct tg_list {
+	unsigned int key;	/* trigram + 1, 0 is a free bucket */
+	unsigned int count, max;
+	unsigned long long *ids;
+};
+
+static struct tg_list *tg_table = NULL;
+static unsigned int tg_mask = 0, tg_used = 0;
+
+/* Cleared when an update could not be indexed, queries then scan */
+int tg_valid = 0;
+
+static unsigned int tg_key(unsigned char *s) {
+	return ((unsigned int) tolower(s[0]) << 16 | (unsigned int) tolower(s[1]) << 8 |
+		(unsigned int) tolower(s[2])) + 1;
+}
+
+static unsigned int tg_hash(unsigned int key) {
+	return (key * 0x9E3779B1U) & tg_mask;
+}
+
+static struct tg_list *tg_find(unsigned int key) {
+	unsigned int h;
+
+	if (!tg_table)
+		return NULL;
+
+	for (h = tg_hash(key); tg_table[h].key; h = (h + 1) & tg_mask) {
+		if (tg_table[h].key == key)
+			return &tg_table[h];
+	}
+
+	return NULL;
+}
+
+static int tg_grow(void) {
+	struct tg_list *old = tg_table, *l;
+	unsigned int i, n = old ? tg_mask + 1 : 0, size, h;
+
+	size = n ? n * 2 : TG_TABLE_MIN;
+	tg_table = calloc(size, sizeof(struct tg_list));
+	if (!tg_table) {
+		syslog(LOG_ERR, "Memory allocation error");
+		tg_table = old;
+		return 0;
+	}
+
+	tg_mask = size - 1;
+	for (i = 0; i < n; i++) {
+		l = &old[i];
+		if (!l->key)
+			continue;
+
+		for (h = tg_hash(l->key); tg_table[h].key; h = (h + 1) & tg_mask)
+			;
+		tg_table[h] = *l;
+	}
+
+	free(old);
+
+	return 1;
+}
+
+static struct tg_list *tg_get(unsigned int key) {
+	struct tg_list *l;
+	unsigned int h;
+
+	l = tg_find(key);
+	if (l)
+		return l;
+
+	if (!tg_table || (tg_used + 1) * 2 > tg_mask + 1) {
+		if (!tg_grow())
+			return NULL;
+	}
+
+	for (h = tg_hash(key); tg_table[h].key; h = (h + 1) & tg_mask)
+		;
+
+	tg_used++;
+	tg_table[h].key = key;
+
+	return &tg_table[h];
+}
+
+/* Position of the first id in the list that is not below 'id' */
+static unsigned int tg_search(struct tg_list *l, unsigned long long id) {
+	unsigned int lo = 0, hi = l->count, mid;
+
+	/* new entries get the highest id so far */
+	if (!l->count || l->ids[l->count - 1] < id)
+		return l->count;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (l->ids[mid] < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int tg_insert(unsigned int key, unsigned long long id) {
+	unsigned long long *tmp;
+	struct tg_list *l;
+	unsigned int pos;
+
+	l = tg_get(key);
+	if (!l)
+		return 0;
+
+	pos = tg_search(l, id);
+	if (pos < l->count && l->ids[pos] == id)
+		return 1;
+
+	if (l->count == l->max) {
+		l->max = l->max ? l->max * 2 : 4;
+		tmp = realloc(l->ids, l->max * sizeof(unsigned long long));
+		if (!tmp) {
+			syslog(LOG_ERR, "Memory allocation error");
+			l->max = l->count;
+			return 0;
+		}
+		l->ids = tmp;
+	}
+
+	memmove(l->ids + pos + 1, l->ids + pos, (l->count - pos) * sizeof(unsigned long long));
+	l->ids[pos] = id;
+	l->count++;
+
+	return 1;
+}
+
+static void tg_remove(unsigned int key, unsigned long long id) {
+	struct tg_list *l;
+	unsigned int pos;
+
+	l = tg_find(key);
+	if (!l)
+		return;
+
+	pos = tg_search(l, id);
+	if (pos == l->count || l->ids[pos] != id)
+		return;
+
+	memmove(l->ids + pos, l->ids + pos + 1, (l->count - pos - 1) * sizeof(unsigned long long));
+	l->count--;
+}
+
+static int tg_fields(struct db_entry *de, int add) {
+	char *field[2] = { de->name, de->login };
+	unsigned char *p;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (!field[i])
+			continue;
+
+		for (p = (unsigned char *) field[i]; p[0] && p[1] && p[2]; p++) {
+			if (!add)
+				tg_remove(tg_key(p), de->id);
+			else if (!tg_insert(tg_key(p), de->id))
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+void tg_add(struct db_entry *de) {
+	if (tg_valid && !tg_fields(de, 1)) {
+		syslog(LOG_WARNING, "Search index disabled");
+		tg_valid = 0;
+	}
+}
+
+void tg_del(struct db_entry *de) {
+	if (tg_valid)
+		tg_fields(de, 0);
+}
+
+void tg_clear(void) {
+	unsigned int i;
+
+	if (tg_table) {
+		for (i = 0; i <= tg_mask; i++)
+			free(tg_table[i].ids);
+		free(tg_table);
+	}
+
+	tg_table = NULL;
+	tg_mask = tg_used = 0;
+	tg_valid = 1;
+}
+
+/*
+ * Ids of the entries that may contain 'needle'. Returns 0 when the
+ * index can't tell (short needle, index disabled or no memory) and the
+ * caller has to look at every entry.
+ */
+int tg_query(char *needle, unsigned long long **ids, unsigned int *count) {
+	struct tg_list **lists, *l, *tmp;
+	unsigned long long *out;
+	unsigned char *p;
+	unsigned int i, j, n = 0, len, k, pos;
+
+	len = strlen(needle);
+	if (!tg_valid || len < 3)
+		return 0;
+
+	lists = malloc((len - 2) * sizeof(struct tg_list *));
+	if (!lists)
+		return 0;
+
+	for (p = (unsigned char *) needle; p[2]; p++) {
+		l = tg_find(tg_key(p));
+		if (!l || !l->count) {
+			free(lists);
+			*ids = NULL;
+			*count = 0;
+			return 1;
+		}
+		lists[n++] = l;
+	}
+
+	/* start from the shortest list */
+	for (i = 1; i < n; i++) {
+		if (lists[i]->count < lists[0]->count) {
+			tmp = lists[0];
+			lists[0] = lists[i];
+			lists[i] = tmp;
+		}
+	}
+
+	out = malloc(lists[0]->count * sizeof(unsigned long long));
+	if (!out) {
+		free(lists);
+		return 0;
+	}
+
+	for (i = 0, k = 0; i < lists[0]->count; i++) {
+		for (j = 1; j < n; j++) {
+			pos = tg_search(lists[j], lists[0]->ids[i]);
+			if (pos == lists[j]->count || lists[j]->ids[pos] != lists[0]->ids[i])
+				break;
+		}
+
+		if (j == n)
+			out[k++] = lists[0]->ids[i];
+	}
+
+	free(lists);
+	*ids = out;
+	*count = k;
+
+	return 1;
+}
+
+struct tg_state {
+	struct tg_list *table;
+	unsigned int mask, used;
+	int valid;
+};
+
+int tg_park(struct vault *v) {
+	struct tg_state *s = v->tg;
+
+	if (!s) {
+		s = malloc(sizeof(*s));
+		if (!s) {
+			syslog(LOG_ERR, "Memory allocation error");
+			return 0;
+		}
+		v->tg = s;
+	}
+
+	s->table = tg_table;
+	s->mask = tg_mask;
+	s->used = tg_used;
+	s->valid = tg_valid;
+
+	tg_table = NULL;
+	tg_mask = tg_used = 0;
+	tg_valid = 0;
+
+	return 1;
+}
+
+void tg_resume(struct vault *v) {
+	tg_table = v->tg->table;
+	tg_mask = v->tg->mask;
+	tg_used = v->tg->used;
+	tg_valid = v->tg->valid;
+}
@@ -0,0 +1,598 @@
+/*
+ * opm - Open Password Manager.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Alexander Miroch
+ *    Email: <alexander.miroch@gmail.com>
+ */
+
+/*
+ * Vaults. The daemon keeps any number of unlocked databases, each
+ * with its own key, file and journal, and every request names the one
+ * it is for by the handle it got from PT_OPEN. The modules keep the
+ * state of the current vault in their globals as they always did; to
+ * serve another vault, the writer is drained and each module moves its
+ * state into the vault it belongs to (park) and takes the other one
+ * out of its vault (resume).
+ */
+
+#include "opm.h"
+
+struct vault *current_vault = NULL;
+
+/* Client side, the vault the requests are for */
+unsigned int vault_handle = 0;
+int all_vaults = 0;
+
+static struct vault *vaults[MAX_VAULTS];
+static unsigned int num_vaults = 0, next_handle = 1;
+
+static struct {
+	int (*park)(struct vault *);
+	void (*resume)(struct vault *);
+} parts[] = {
+	{ db_park, db_resume },
+	{ bt_park, bt_resume },
+	{ journal_park, journal_resume },
+	{ id_index_park, id_index_resume },
+	{ tg_park, tg_resume },
+	{ writer_park, writer_resume },
+};
+
+#define NUM_PARTS (sizeof(parts) / sizeof(parts[0]))
+
+static struct vault *vault_find(unsigned int handle) {
+	unsigned int i;
+
+	for (i = 0; i < num_vaults; i++) {
+		if (vaults[i]->handle == handle)
+			return vaults[i];
+	}
+
+	return NULL;
+}
+
+static struct vault *vault_lookup(char *path) {
+	unsigned int i;
+
+	for (i = 0; i < num_vaults; i++) {
+		if (!strcmp(vaults[i]->path, path))
+			return vaults[i];
+	}
+
+	return NULL;
+}
+
+/* Get everything of the current vault to disk, nothing may be in flight */
+static void vault_drain(void) {
+	group_commit();
+	if (fsync_policy == FSYNC_INTERVAL)
+		writer_sync();
+
+	writer_wait_idle();
+	answer_waiters();
+}
+
+static int vault_park(void) {
+	unsigned int i, j;
+
+	if (!current_vault)
+		return 1;
+
+	vault_drain();
+
+	for (i = 0; i < NUM_PARTS; i++) {
+		if (!parts[i].park(current_vault)) {
+			for (j = 0; j < i; j++)
+				parts[j].resume(current_vault);
+			return 0;
+		}
+	}
+
+	memset(password, 0, sizeof(password));
+	database_file = NULL;
+	current_vault = NULL;
+
+	return 1;
+}
+
+static void vault_resume(struct vault *v) {
+	unsigned int i;
+
+	for (i = 0; i < NUM_PARTS; i++)
+		parts[i].resume(v);
+
+	database_file = v->path;
+	current_vault = v;
+}
+
+static void vault_free(struct vault *v) {
+	/* the parked states are stale copies, the data is gone already */
+	free(v->db);
+	secure_free(v->bt);
+	free(v->journal);
+	free(v->ids);
+	free(v->tg);
+	free(v->writer);
+	free(v->path);
+
+	secure_free(v);
+}
+
+static struct vault *vault_new(char *path) {
+	struct vault *v;
+
+	if (num_vaults == MAX_VAULTS) {
+		syslog(LOG_ERR, "Too many vaults");
+		return NULL;
+	}
+
+	v = secure_alloc(sizeof(*v));
+	if (!v) {
+		syslog(LOG_ERR, "No memory");
+		return NULL;
+	}
+
+	v->path = strdup(path);
+	if (!v->path) {
+		syslog(LOG_ERR, "No memory");
+		secure_free(v);
+		return NULL;
+	}
+
+	return v;
+}
+
+/* The loaded database becomes the current vault */
+static void vault_attach(struct vault *v) {
+	database_file = v->path;
+	v->handle = next_handle++;
+	vaults[num_vaults++] = v;
+	current_vault = v;
+}
+
+/* Register the database loaded at startup, taking over its path */
+int vault_add(char *path) {
+	struct vault *v;
+
+	v = secure_alloc(sizeof(*v));
+	if (!v) {
+		syslog(LOG_ERR, "No memory");
+		return 0;
+	}
+
+	v->path = path;
+	vault_attach(v);
+
+	return 1;
+}
+
+int vault_switch(unsigned int handle) {
+	struct vault *v;
+
+	v = vault_find(handle);
+	if (!v) {
+		syslog(LOG_ERR, "No such vault: %u", handle);
+		return 0;
+	}
+
+	if (v == current_vault)
+		return 1;
+
+	if (!vault_park())
+		return 0;
+
+	vault_resume(v);
+
+	return 1;
+}
+
+static struct vault *vault_load(char *path, char *pass) {
+	struct vault *v, *prev = current_vault;
+
+	if (*path != '/') {
+		syslog(LOG_ERR, "Vault path is not absolute");
+		return NULL;
+	}
+
+	v = vault_new(path);
+	if (!v)
+		return NULL;
+
+	if (!vault_park()) {
+		vault_free(v);
+		return NULL;
+	}
+
+	strcpy((char *) password, pass);
+	database_file = v->path;
+
+	if (!load_database(access(path, F_OK) < 0)) {
+		syslog(LOG_ERR, "Can not load vault %s", path);
+		db_close();
+		memset(password, 0, sizeof(password));
+		database_file = NULL;
+		vault_free(v);
+		if (prev)
+			vault_resume(prev);
+		return NULL;
+	}
+
+	memset(password, 0, sizeof(password));
+	writer_covered(journal_seq);
+	vault_attach(v);
+	syslog(LOG_INFO, "Vault %s opened", path);
+
+	return v;
+}
+
+/* Checkpoint every vault, for the daemon to stop */
+void vault_sync_all(void) {
+	unsigned int i;
+
+	for (i = 0; i < num_vaults; i++) {
+		if (!vault_switch(vaults[i]->handle))
+			continue;
+
+		group_commit();
+		if (!sync_db())
+			syslog(LOG_ERR, "Can not checkpoint %s", vaults[i]->path);
+	}
+
+	writer_wait_idle();
+	answer_waiters();
+}
+
+/*
+ * The path and optionally the passphrase, both zero-terminated. The
+ * reply is the handle of the vault, 0 if it is not open and no
+ * passphrase was given.
+ */
+int pt_open(void *data, unsigned int len, int csk) {
+	char *path = data, *pass = NULL;
+	unsigned int plen, size, handle = 0;
+	struct vault *v;
+
+	if (!len || !data || path[len - 1] != '\0') {
+		syslog(LOG_ERR, "Invalid vault request");
+		return 0;
+	}
+
+	plen = strlen(path) + 1;
+	if (plen < len) {
+		pass = path + plen;
+		if (plen + strlen(pass) + 1 != len || strlen(pass) >= MAX_PASSWORD_LEN) {
+			syslog(LOG_ERR, "Invalid vault request");
+			return 0;
+		}
+	}
+
+	v = vault_lookup(path);
+	if (!v && pass) {
+		v = vault_load(path, pass);
+		if (!v)
+			return 0;
+	}
+
+	if (v)
+		handle = v->handle;
+
+	size = sizeof(handle);
+
+	return send_reply(csk, &size, sizeof(size)) && send_reply(csk, &handle, sizeof(handle));
+}
+
+/* One frame per open vault, see struct vault_info */
+int pt_vaults(void *data, unsigned int len, int csk) {
+	unsigned int i, size;
+
+	for (i = 0; i < num_vaults; i++) {
+		size = sizeof(unsigned int) + strlen(vaults[i]->path) + 1;
+		if (!send_reply(csk, &size, sizeof(size)) ||
+				!send_reply(csk, &vaults[i]->handle, sizeof(unsigned int)) ||
+				!send_reply(csk, vaults[i]->path, size - sizeof(unsigned int)))
+			return 0;
+	}
+
+	size = 0;
+
+	return send_reply(csk, &size, sizeof(size));
+}
+
+/* Lock the current vault, the daemon goes away with the last one */
+int pt_close(void *data, unsigned int len, int csk) {
+	struct vault *v = current_vault;
+	unsigned int i;
+
+	if (num_vaults == 1)
+		return pt_stop(data, len, csk);
+
+	group_commit();
+	if (!sync_db())
+		syslog(LOG_ERR, "Can not checkpoint database");
+
+	writer_wait_idle();
+	answer_waiters();
+	db_close();
+
+	for (i = 0; vaults[i] != v; i++)
+		;
+	vaults[i] = vaults[--num_vaults];
+
+	syslog(LOG_INFO, "Vault %s closed", v->path);
+
+	memset(password, 0, sizeof(password));
+	database_file = NULL;
+	current_vault = NULL;
+	vault_free(v);
+
+	return 1;
+}
+
+/*
+ * The current and the new passphrase, both zero-terminated. The key of
+ * the vault stays as it is and is only sealed anew in the meta pages.
+ */
+int pt_passwd(void *data, unsigned int len, int csk) {
+	char *old = data, *pass;
+	unsigned int olen;
+
+	if (!len || !data || old[len - 1] != '\0') {
+		syslog(LOG_ERR, "Invalid passphrase request");
+		return 0;
+	}
+
+	olen = strlen(old) + 1;
+	pass = old + olen;
+	if (olen >= len || olen > MAX_PASSWORD_LEN || !*pass ||
+			olen + strlen(pass) + 1 != len || strlen(pass) >= MAX_PASSWORD_LEN) {
+		syslog(LOG_ERR, "Invalid passphrase request");
+		return 0;
+	}
+
+	/* the writer must not be at the meta pages meanwhile */
+	vault_drain();
+	if (!bt_passwd(old, pass))
+		return 0;
+
+	syslog(LOG_INFO, "Passphrase of %s changed", current_vault->path);
+
+	return 1;
+}
+
+/* Absolute path of the database, it is opened by the daemon in / */
+char *vault_path(char *file) {
+	char *dir, *base, *rp, *path;
+
+	path = realpath(file, NULL);
+	if (path)
+		return path;
+
+	/* a new database, its directory has to be there */
+	dir = strdup(file);
+	base = strdup(file);
+	rp = dir ? realpath(dirname(dir), NULL) : NULL;
+	if (!rp || !base) {
+		fprintf(stderr, "Can not resolve %s\n", file);
+		exit(1);
+	}
+
+	path = malloc(strlen(rp) + strlen(basename(base)) + 2);
+	if (!path) {
+		fprintf(stderr, "Memory allocation error\n");
+		exit(1);
+	}
+
+	sprintf(path, "%s/%s", strcmp(rp, "/") ? rp : "", basename(base));
+
+	free(dir);
+	free(base);
+	free(rp);
+
+	return path;
+}
+
+static unsigned int query_vault(char *pass) {
+	unsigned char buf[PATH_MAX + MAX_PASSWORD_LEN + 1];
+	unsigned int len, handle;
+	struct parcel pc;
+	int fd;
+
+	len = strlen(database_file) + 1;
+	memcpy(buf, database_file, len);
+	if (pass) {
+		strcpy((char *) buf + len, pass);
+		len += strlen(pass) + 1;
+	}
+
+	pc.type = PT_OPEN;
+	pc.length = len;
+	pc.data = buf;
+
+	fd = do_connect();
+	if (!fd)
+		return 0;
+
+	len = _send_parcel(fd, &pc);
+	memset(buf, 0, sizeof(buf));
+	if (!len)
+		return 0;
+
+	if (recv(fd, &len, sizeof(len), MSG_WAITALL) != sizeof(len) || len != sizeof(handle) ||
+			recv(fd, &handle, sizeof(handle), MSG_WAITALL) != sizeof(handle) || !is_ok_reply(fd))
+		handle = 0;
+
+	close(fd);
+
+	return handle;
+}
+
+/* Get the handle of the database, unlocking it in the daemon if need be */
+int open_vault(int unlock) {
+	vault_handle = query_vault(NULL);
+	if (vault_handle || !unlock)
+		return vault_handle != 0;
+
+	ask_password(access(database_file, F_OK) < 0);
+	vault_handle = query_vault((char *) password);
+	memset(password, 0, sizeof(password));
+
+	if (!vault_handle) {
+		fprintf(stderr, "Can not decrypt or load database\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+int close_vault(void) {
+	struct parcel pc;
+
+	pc.type = PT_CLOSE;
+	pc.length = 0;
+	pc.data = NULL;
+
+	return send_parcel(&pc);
+}
+
+int change_passwd(void) {
+	unsigned char buf[2 * MAX_PASSWORD_LEN];
+	char *old, *pass, *again;
+	unsigned int olen;
+	struct parcel pc;
+	int rv;
+
+	old = ask_secret("Current passphrase: ");
+	pass = ask_secret("New passphrase: ");
+	again = ask_secret("New passphrase (one more time): ");
+
+	rv = 0;
+	if (!*pass)
+		fprintf(stderr, "Passphrase is required\n");
+	else if (strcmp(pass, again))
+		fprintf(stderr, "Passphrase mismatch\n");
+	else if (strlen(old) >= MAX_PASSWORD_LEN || strlen(pass) >= MAX_PASSWORD_LEN)
+		fprintf(stderr, "Passphrase is too long\n");
+	else
+		rv = 1;
+
+	if (rv) {
+		olen = strlen(old) + 1;
+		memcpy(buf, old, olen);
+		strcpy((char *) buf + olen, pass);
+
+		pc.type = PT_PASSWD;
+		pc.length = olen + strlen(pass) + 1;
+		pc.data = buf;
+
+		rv = send_parcel(&pc);
+		memset(buf, 0, sizeof(buf));
+	}
+
+	memset(old, 0, strlen(old));
+	memset(pass, 0, strlen(pass));
+	memset(again, 0, strlen(again));
+	free(old);
+	free(pass);
+	free(again);
+
+	return rv;
+}
+
+/* The open vaults, release them with free_vaults() */
+int get_vaults(struct vault_info ***vlist, unsigned int *count) {
+	struct vault_info **list = NULL, **tmp;
+	struct parcel pc;
+	unsigned char *buf;
+	unsigned int len, n = 0;
+	int fd, rv = 0;
+
+	buf = malloc(MAX_PARCEL_LEN + 1);
+	if (!buf) {
+		fprintf(stderr, "Memory allocation error\n");
+		return 0;
+	}
+
+	pc.type = PT_VAULTS;
+	pc.length = 0;
+	pc.data = NULL;
+
+	fd = do_connect();
+	if (!fd || !_send_parcel(fd, &pc)) {
+		free(buf);
+		return 0;
+	}
+
+	while (_get_frame(fd, buf, &len)) {
+		if (!len) {
+			rv = is_ok_reply(fd);
+			break;
+		}
+
+		if (len <= sizeof(unsigned int))
+			break;
+
+		tmp = realloc(list, (n + 1) * sizeof(*list));
+		if (!tmp)
+			break;
+		list = tmp;
+
+		buf[len] = '\0';
+		list[n] = malloc(len + 1);
+		if (!list[n])
+			break;
+
+		memcpy(list[n++], buf, len + 1);
+	}
+
+	close(fd);
+	free(buf);
+
+	if (!rv) {
+		fprintf(stderr, "Communication error\n");
+		free_vaults(list, n);
+		return 0;
+	}
+
+	*vlist = list;
+	*count = n;
+
+	return 1;
+}
+
+void free_vaults(struct vault_info **list, unsigned int count) {
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		free(list[i]);
+
+	free(list);
+}
+
+int list_vaults(void) {
+	struct vault_info **list;
+	unsigned int i, n;
+
+	if (!get_vaults(&list, &n))
+		return 0;
+
+	for (i = 0; i < n; i++)
+		printf("%u\t%s\n", list[i]->handle, list[i]->path);
+
+	free_vaults(list, n);
+
+	return 1;
+}
@@ -0,0 +1,228 @@
+/*
+ * opm - Open Password Manager.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Alexander Miroch
+ *    Email: <alexander.miroch@gmail.com>
+ */
+
+/*
+ * Check the page checksums of a database file. It needs neither the
+ * passphrase nor the daemon: the file is read directly by a few threads,
+ * each taking the next VERIFY_BATCH pages. The daemon may be writing
+ * free pages meanwhile, so a page that fails is read once more at the end.
+ */
+
+#include "opm.h"
+
+struct verify_state {
+	int fd;
+	unsigned long long next, npages;
+	unsigned long long *bad;
+	unsigned int nbad, max_bad;
+	int error;
+	pthread_mutex_t lock;
+};
+
+static int bad_page(struct verify_state *vs, unsigned long long pgno) {
+	unsigned long long *tmp;
+
+	if (vs->nbad == vs->max_bad) {
+		vs->max_bad = vs->max_bad ? vs->max_bad * 2 : 64;
+		tmp = realloc(vs->bad, vs->max_bad * sizeof(*tmp));
+		if (!tmp)
+			return 0;
+		vs->bad = tmp;
+	}
+
+	vs->bad[vs->nbad++] = pgno;
+
+	return 1;
+}
+
+static void *verify_worker(void *arg) {
+	struct verify_state *vs = arg;
+	unsigned long long pgno, n, i;
+	unsigned char *buf, ok[VERIFY_BATCH];
+	ssize_t len;
+
+	buf = malloc(VERIFY_BATCH * DB_PAGE_SIZE);
+
+	pthread_mutex_lock(&vs->lock);
+	if (!buf)
+		vs->error = 1;
+
+	while (!vs->error && vs->next < vs->npages) {
+		pgno = vs->next;
+		n = vs->npages - pgno < VERIFY_BATCH ? vs->npages - pgno : VERIFY_BATCH;
+		vs->next += n;
+		pthread_mutex_unlock(&vs->lock);
+
+		len = pread(vs->fd, buf, n * DB_PAGE_SIZE, pgno * DB_PAGE_SIZE);
+
+		/* a short read leaves the missing pages bad */
+		for (i = 0; i < n; i++)
+			ok[i] = len >= 0 && (i + 1) * DB_PAGE_SIZE <= (unsigned long long) len &&
+				bt_page_intact(buf + i * DB_PAGE_SIZE);
+
+		pthread_mutex_lock(&vs->lock);
+		if (len < 0) {
+			vs->error = 1;
+			break;
+		}
+
+		for (i = 0; i < n && !vs->error; i++) {
+			if (!ok[i] && !bad_page(vs, pgno + i))
+				vs->error = 1;
+		}
+	}
+	pthread_mutex_unlock(&vs->lock);
+
+	free(buf);
+
+	return NULL;
+}
+
+static int pg_cmp(const void *a, const void *b) {
+	unsigned long long x = *(unsigned long long *) a, y = *(unsigned long long *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* The meta page with the newest transaction, -1 if neither is usable */
+static int verify_meta(int fd, struct bt_meta_tail *meta, unsigned int *version, unsigned int *bad) {
+	unsigned char buf[DB_PAGE_SIZE];
+	struct bt_meta_hdr *mh = (struct bt_meta_hdr *) buf;
+	struct bt_meta_tail *tail = (struct bt_meta_tail *) (buf + DB_PAGE_SIZE - sizeof(*tail));
+	int i, best = -1;
+
+	for (i = 0; i < 2; i++) {
+		if (pread(fd, buf, DB_PAGE_SIZE, i * DB_PAGE_SIZE) != DB_PAGE_SIZE ||
+				memcmp(mh->signature, PAGED_SIGNATURE, sizeof(mh->signature)))
+			continue;
+
+		if ((mh->version & BT_VERSION_MASK) < CHECKSUM_VERSION_CODE) {
+			*version = mh->version & BT_VERSION_MASK;
+			return -1;
+		}
+
+		if (!bt_page_intact(buf)) {
+			printf("Meta page %d is damaged\n", i);
+			(*bad)++;
+			continue;
+		}
+
+		if (best < 0 || tail->txn > meta->txn) {
+			*meta = *tail;
+			*version = mh->version & BT_VERSION_MASK;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+int verify_database(char *path) {
+	struct verify_state vs;
+	struct bt_meta_tail meta;
+	struct timespec start, end;
+	pthread_t threads[VERIFY_MAX_THREADS];
+	unsigned char buf[DB_PAGE_SIZE];
+	unsigned int version = 0, i, n, bad = 0;
+	struct stat st;
+	double t;
+	long cpus;
+
+	if (!bt_probe(path)) {
+		fprintf(stderr, "%s is not a paged database\n", path);
+		return 0;
+	}
+
+	memset(&vs, 0, sizeof(vs));
+	vs.fd = open(path, O_RDONLY);
+	if (vs.fd < 0 || fstat(vs.fd, &st) < 0) {
+		fprintf(stderr, "Can not open %s: %s\n", path, strerror(errno));
+		if (vs.fd >= 0)
+			close(vs.fd);
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (verify_meta(vs.fd, &meta, &version, &bad) < 0) {
+		if (version && version < CHECKSUM_VERSION_CODE)
+			fprintf(stderr, "Database version %x has no checksums, "
+				"they are added when the daemon opens it\n", version);
+		else
+			fprintf(stderr, "No usable meta page, the database is damaged\n");
+		close(vs.fd);
+		return 0;
+	}
+
+	if ((unsigned long long) st.st_size < meta.npages * DB_PAGE_SIZE)
+		printf("File is shorter than its %llu pages\n", meta.npages);
+
+	vs.next = BT_FIRST_PAGE;
+	vs.npages = meta.npages;
+	pthread_mutex_init(&vs.lock, NULL);
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	n = cpus < 1 ? 1 : cpus > VERIFY_MAX_THREADS ? VERIFY_MAX_THREADS : cpus;
+	if (n > (vs.npages - BT_FIRST_PAGE) / VERIFY_BATCH + 1)
+		n = (vs.npages - BT_FIRST_PAGE) / VERIFY_BATCH + 1;
+
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&threads[i], NULL, verify_worker, &vs))
+			break;
+	}
+
+	/* without threads of its own, the caller does it */
+	if (!i)
+		verify_worker(&vs);
+	n = i;
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+
+	if (vs.error) {
+		fprintf(stderr, "Can not read %s\n", path);
+		free(vs.bad);
+		close(vs.fd);
+		pthread_mutex_destroy(&vs.lock);
+		return 0;
+	}
+
+	qsort(vs.bad, vs.nbad, sizeof(*vs.bad), pg_cmp);
+	for (i = 0; i < vs.nbad; i++) {
+		if (pread(vs.fd, buf, DB_PAGE_SIZE, vs.bad[i] * DB_PAGE_SIZE) == DB_PAGE_SIZE &&
+				bt_page_intact(buf))
+			continue;
+
+		printf("Page %llu is damaged\n", vs.bad[i]);
+		bad++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("Checked %llu pages in %.2fs (%s CRC32C, %u threads), %u damaged\n",
+		meta.npages, t, crc32c_hw() ? "hardware" : "software", n ? n : 1, bad);
+
+	free(vs.bad);
+	close(vs.fd);
+	pthread_mutex_destroy(&vs.lock);
+
+	return !bad;
+}
@@ -0,0 +1,507 @@
+/*
+ * opm - Open Password Manager.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Alexander Miroch
+ *    Email: <alexander.miroch@gmail.com>
+ */
+
+/*
+ * Writer thread. The daemon hands it groups of sealed journal records
+ * and checkpoint snapshots, which it writes in order while the daemon
+ * goes on serving clients. Once the daemon is up, only this thread
+ * touches the files, except for db_rewrite() and the reads of secret
+ * parts which run while it is idle.
+ *
+ * Progress is counted in journal sequence numbers (generations):
+ * everything up to 'written' is in the files, everything up to
+ * 'durable' has been synced too. After every task a byte on the notify
+ * pipe wakes the daemon up to answer the clients waiting for either.
+ */
+
+#include "opm.h"
+
+enum {
+	WT_JOURNAL,
+	WT_CHECKPOINT,
+	WT_SYNC
+};
+
+struct writer_task {
+	int type;
+	unsigned char *buf;
+	unsigned int len;
+	unsigned long long seq;
+	unsigned long long next_id;
+	struct writer_task *next;
+};
+
+int fsync_policy = FSYNC_ALWAYS;
+int writer_fd = -1;
+
+static pthread_t writer_thread;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond;
+static struct writer_task *head = NULL, *tail = NULL;
+static int started = 0, busy = 0, notify_fd = -1;
+
+static unsigned long long written = 0, durable = 0, failed = 0;
+static int checkpointed = 0;
+
+/* Failed work, retried before anything newer */
+static unsigned char *retry_buf = NULL;
+static unsigned int retry_len = 0;
+static struct writer_task *retry_ckpt = NULL, *retry_tail = NULL;
+
+static struct timespec last_sync;
+
+int sync_dir(char *path) {
+	char *dir;
+	int fd, rv = 1;
+
+	dir = strdup(path);
+	if (!dir) {
+		syslog(LOG_ERR, "No memory");
+		return 0;
+	}
+
+	fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+	free(dir);
+	if (fd < 0 || fsync(fd) < 0) {
+		syslog(LOG_ERR, "Can't sync directory: %s", strerror(errno));
+		rv = 0;
+	}
+
+	if (fd >= 0)
+		close(fd);
+
+	return rv;
+}
+
+static void free_task(struct writer_task *t) {
+	if (!t)
+		return;
+
+	/* snapshots are plain text, see sync_db() */
+	if (t->type == WT_CHECKPOINT) {
+		secure_free(t->buf);
+	} else if (t->buf) {
+		memset(t->buf, 0, t->len);
+		free(t->buf);
+	}
+
+	free(t);
+}
+
+/* Glue 'len' bytes of 'buf' to the end of *dst, taking over 'buf' */
+static int append_buf(unsigned char **dst, unsigned int *dlen, unsigned char *buf, unsigned int len) {
+	unsigned char *tmp;
+
+	if (!*dst) {
+		*dst = buf;
+		*dlen = len;
+		return 1;
+	}
+
+	tmp = realloc(*dst, *dlen + len);
+	if (!tmp) {
+		syslog(LOG_ERR, "No memory");
+		return 0;
+	}
+
+	memcpy(tmp + *dlen, buf, len);
+	memset(buf, 0, len);
+	free(buf);
+
+	*dst = tmp;
+	*dlen += len;
+
+	return 1;
+}
+
+static int do_sync(unsigned long long seq) {
+	clock_gettime(CLOCK_MONOTONIC, &last_sync);
+
+	if (!journal_sync())
+		return 0;
+
+	pthread_mutex_lock(&writer_lock);
+	if (seq > durable)
+		durable = seq;
+	pthread_mutex_unlock(&writer_lock);
+
+	return 1;
+}
+
+static void do_journal(struct writer_task *t) {
+	unsigned long long seq = t->seq;
+	int rv;
+
+	/* records that failed before go first */
+	if (retry_buf) {
+		if (!append_buf(&retry_buf, &retry_len, t->buf, t->len)) {
+			pthread_mutex_lock(&writer_lock);
+			failed = seq;
+			pthread_mutex_unlock(&writer_lock);
+			return;
+		}
+		t->buf = retry_buf;
+		t->len = retry_len;
+		retry_buf = NULL;
+	}
+
+	rv = journal_write(t->buf, t->len);
+	if (!rv) {
+		retry_buf = t->buf;
+		retry_len = t->len;
+		t->buf = NULL;
+
+		pthread_mutex_lock(&writer_lock);
+		failed = seq;
+		pthread_mutex_unlock(&writer_lock);
+		return;
+	}
+
+	pthread_mutex_lock(&writer_lock);
+	written = seq;
+	pthread_mutex_unlock(&writer_lock);
+
+	if (fsync_policy == FSYNC_ALWAYS && !do_sync(seq)) {
+		pthread_mutex_lock(&writer_lock);
+		failed = seq;
+		pthread_mutex_unlock(&writer_lock);
+	}
+}
+
+static void drop_retries(void) {
+	struct writer_task *t;
+
+	if (retry_buf) {
+		memset(retry_buf, 0, retry_len);
+		free(retry_buf);
+		retry_buf = NULL;
+	}
+
+	while (retry_ckpt) {
+		t = retry_ckpt;
+		retry_ckpt = t->next;
+		free_task(t);
+	}
+	retry_tail = NULL;
+}
+
+/* Takes over the task, snapshots that fail are kept and go in first next time */
+static void do_checkpoint(struct writer_task *t) {
+	struct writer_task *c;
+
+	t->next = NULL;
+	if (retry_tail)
+		retry_tail->next = t;
+	else
+		retry_ckpt = t;
+	retry_tail = t;
+
+	while ((c = retry_ckpt)) {
+		if (!db_checkpoint(c->buf, c->len, c->seq, c->next_id)) {
+			syslog(LOG_WARNING, "Checkpoint failed, keeping journal");
+			return;
+		}
+
+		pthread_mutex_lock(&writer_lock);
+		if (c->seq > written)
+			written = c->seq;
+		if (c->seq > durable)
+			durable = c->seq;
+		checkpointed = 1;
+		pthread_mutex_unlock(&writer_lock);
+
+		retry_ckpt = c->next;
+		if (!retry_ckpt)
+			retry_tail = NULL;
+		free_task(c);
+	}
+
+	/* the journal holds nothing newer, tasks are done in order */
+	journal_truncate();
+	drop_retries();
+}
+
+static int sync_due(struct timespec *when) {
+	if (fsync_policy != FSYNC_INTERVAL || durable >= written)
+		return 0;
+
+	*when = last_sync;
+	when->tv_sec += FSYNC_INTERVAL_MS / 1000;
+	when->tv_nsec += (FSYNC_INTERVAL_MS % 1000) * 1000000;
+	if (when->tv_nsec >= 1000000000) {
+		when->tv_sec++;
+		when->tv_nsec -= 1000000000;
+	}
+
+	return 1;
+}
+
+static void *writer_main(void *arg) {
+	struct writer_task *t;
+	struct timespec when;
+	unsigned long long seq;
+
+	while (1) {
+		pthread_mutex_lock(&writer_lock);
+		while (!head) {
+			if (!sync_due(&when)) {
+				pthread_cond_wait(&writer_cond, &writer_lock);
+				continue;
+			}
+
+			if (pthread_cond_timedwait(&writer_cond, &writer_lock, &when) == ETIMEDOUT)
+				break;
+		}
+
+		t = head;
+		if (t) {
+			head = t->next;
+			if (!head)
+				tail = NULL;
+		}
+		busy = 1;
+		seq = written;
+		pthread_mutex_unlock(&writer_lock);
+
+		if (!t) {
+			do_sync(seq);
+		} else if (t->type == WT_JOURNAL) {
+			do_journal(t);
+		} else if (t->type == WT_CHECKPOINT) {
+			do_checkpoint(t);
+			t = NULL;
+		} else {
+			if (!do_sync(seq)) {
+				pthread_mutex_lock(&writer_lock);
+				failed = t->seq;
+				pthread_mutex_unlock(&writer_lock);
+			}
+		}
+
+		free_task(t);
+
+		pthread_mutex_lock(&writer_lock);
+		busy = 0;
+		pthread_cond_broadcast(&writer_cond);
+		pthread_mutex_unlock(&writer_lock);
+
+		if (write(notify_fd, "", 1) < 0 && errno != EAGAIN)
+			syslog(LOG_ERR, "Writer notify error: %s", strerror(errno));
+	}
+
+	return NULL;
+}
+
+/* Everything up to 'seq' is in the loaded (or just rewritten) database */
+void writer_covered(unsigned long long seq) {
+	pthread_mutex_lock(&writer_lock);
+	written = durable = seq;
+	drop_retries();
+	pthread_mutex_unlock(&writer_lock);
+}
+
+int writer_start(void) {
+	pthread_condattr_t attr;
+	int fds[2];
+
+	if (pipe(fds) < 0) {
+		syslog(LOG_ERR, "Can't create pipe: %s", strerror(errno));
+		return 0;
+	}
+
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	writer_fd = fds[0];
+	notify_fd = fds[1];
+
+	/* sync deadlines are on the monotonic clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&writer_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	clock_gettime(CLOCK_MONOTONIC, &last_sync);
+	writer_covered(journal_seq);
+
+	if (pthread_create(&writer_thread, NULL, writer_main, NULL)) {
+		syslog(LOG_ERR, "Can't start writer thread");
+		return 0;
+	}
+
+	started = 1;
+
+	return 1;
+}
+
+static int submit(int type, unsigned char *buf, unsigned int len,
+		unsigned long long seq, unsigned long long next_id) {
+	struct writer_task *t;
+
+	t = malloc(sizeof(*t));
+	if (!t) {
+		syslog(LOG_ERR, "No memory");
+		return 0;
+	}
+
+	t->type = type;
+	t->buf = buf;
+	t->len = len;
+	t->seq = seq;
+	t->next_id = next_id;
+	t->next = NULL;
+
+	pthread_mutex_lock(&writer_lock);
+	if (tail)
+		tail->next = t;
+	else
+		head = t;
+	tail = t;
+	pthread_cond_broadcast(&writer_cond);
+	pthread_mutex_unlock(&writer_lock);
+
+	return 1;
+}
+
+/* Hand the queued journal records to the writer */
+void writer_journal(void) {
+	unsigned long long seq = journal_seq;
+	unsigned char *buf;
+	unsigned int len;
+
+	if (!journal_pending)
+		return;
+
+	buf = journal_take(&len);
+	if (!submit(WT_JOURNAL, buf, len, seq, 0)) {
+		memset(buf, 0, len);
+		free(buf);
+		pthread_mutex_lock(&writer_lock);
+		failed = seq;
+		pthread_mutex_unlock(&writer_lock);
+	}
+}
+
+int writer_checkpoint(unsigned char *snap, unsigned int len,
+		unsigned long long seq, unsigned long long next_id) {
+	if (!submit(WT_CHECKPOINT, snap, len, seq, next_id)) {
+		secure_free(snap);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Sync whatever has been written so far, whatever the policy */
+void writer_sync(void) {
+	submit(WT_SYNC, NULL, 0, journal_seq, 0);
+}
+
+void writer_wait_idle(void) {
+	if (!started)
+		return;
+
+	pthread_mutex_lock(&writer_lock);
+	while (head || busy)
+		pthread_cond_wait(&writer_cond, &writer_lock);
+	pthread_mutex_unlock(&writer_lock);
+}
+
+/*
+ * Called by the daemon when woken up through writer_fd. Returns
+ * whether a checkpoint has finished since the last call.
+ */
+int writer_status(unsigned long long *w, unsigned long long *d, unsigned long long *f) {
+	char buf[64];
+	int rv;
+
+	while (read(writer_fd, buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&writer_lock);
+	*w = written;
+	*d = durable;
+	*f = failed;
+	rv = checkpointed;
+	checkpointed = 0;
+	pthread_mutex_unlock(&writer_lock);
+
+	return rv;
+}
+
+struct writer_state {
+	unsigned long long written, durable, failed;
+	int checkpointed;
+	unsigned char *retry_buf;
+	unsigned int retry_len;
+	struct writer_task *retry_ckpt, *retry_tail;
+	struct timespec last_sync;
+};
+
+/* Only while the writer is idle, see vault.c */
+int writer_park(struct vault *v) {
+	struct writer_state *s = v->writer;
+
+	if (!s) {
+		s = malloc(sizeof(*s));
+		if (!s) {
+			syslog(LOG_ERR, "No memory");
+			return 0;
+		}
+		v->writer = s;
+	}
+
+	pthread_mutex_lock(&writer_lock);
+	s->written = written;
+	s->durable = durable;
+	s->failed = failed;
+	s->checkpointed = checkpointed;
+	s->retry_buf = retry_buf;
+	s->retry_len = retry_len;
+	s->retry_ckpt = retry_ckpt;
+	s->retry_tail = retry_tail;
+	s->last_sync = last_sync;
+
+	written = durable = failed = 0;
+	checkpointed = 0;
+	retry_buf = NULL;
+	retry_len = 0;
+	retry_ckpt = retry_tail = NULL;
+	pthread_mutex_unlock(&writer_lock);
+
+	return 1;
+}
+
+void writer_resume(struct vault *v) {
+	struct writer_state *s = v->writer;
+
+	pthread_mutex_lock(&writer_lock);
+	written = s->written;
+	durable = s->durable;
+	failed = s->failed;
+	checkpointed = s->checkpointed;
+	retry_buf = s->retry_buf;
+	retry_len = s->retry_len;
+	retry_ckpt = s->retry_ckpt;
+	retry_tail = s->retry_tail;
+	last_sync = s->last_sync;
+	pthread_cond_broadcast(&writer_cond);
+	pthread_mutex_unlock(&writer_lock);
+}